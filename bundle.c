@@ -0,0 +1,381 @@
+/*  This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA. */
+#include "bundle.h"
+#include "fw-cache.h"
+#include <string.h>
+
+/* Bundle files start with this */
+#define BUNDLE_MAGIC "FBB1"
+/* Length of the header:
+   0-3: BUNDLE_MAGIC
+   4-7: Number of entries in the index (4 is lsb)
+  8-15: Reserved */
+#define BUNDLE_HDR 16
+/* Length of each index entry, which describes one half of the firmware
+   for one board type:
+     0: Board type
+     1: Reserved
+   2-3: CRC of the text section, before padding (2 is lsb)
+   4-7: Address of the text section
+  8-11: Length of the text section
+ 12-15: File offset of the text section's data
+ 16-19: Address of the IVT
+ 20-23: Length of the IVT
+ 24-27: File offset of the IVT's data
+ 28-31: File offset of the text section's ranges, each an address and a
+        length, or 0 if the whole section has data
+ 32-35: Number of ranges
+ All values are lsb first. */
+#define BUNDLE_ENTRY 36
+/* The data of each section starts on a multiple of this, so that the
+   largest chunks can be sent from the mapping.  The gap after the text
+   section is filled with the padding the bootloader expects. */
+#define BUNDLE_ALIGN 64
+
+/* A section to be written to a bundle */
+typedef struct {
+	uint8_t board_type;
+	uint16_t text_crc;
+	const elf_section_t *text, *vectors;
+} bundle_entry_t;
+
+/* Read the index of a mapped bundle.
+   Returns the number of entries, or -1 if it isn't a valid bundle. */
+static int bundle_check( const uint8_t *b, gsize len );
+
+/* Returns TRUE if the n ranges at r are sorted, don't overlap and lie
+   within the text section from addr to addr+len */
+static gboolean bundle_check_ranges( const uint8_t *r,
+				     uint32_t n,
+				     uint32_t addr,
+				     uint32_t len );
+
+/* Make the sections described by an index entry of a mapped bundle */
+static void bundle_half( const uint8_t *b,
+			 const uint8_t *entry,
+			 bundle_half_t *half );
+
+static uint32_t round_up( uint32_t v );
+static uint32_t get_u32( const uint8_t *b );
+static void put_u32( uint8_t *b, uint32_t v );
+
+gboolean bundle_load( const char *fname,
+		      uint8_t board_type,
+		      bundle_half_t halves[2] )
+{
+	GMappedFile *map;
+	const uint8_t *b;
+	gsize len;
+	int n, i;
+	uint8_t found = 0;
+
+	g_assert( fname != NULL && halves != NULL );
+
+	map = g_mapped_file_new( fname, FALSE, NULL );
+	if( map == NULL )
+		return FALSE;
+
+	b = (const uint8_t*)g_mapped_file_get_contents( map );
+	len = g_mapped_file_get_length( map );
+
+	n = bundle_check( b, len );
+	for( i=0; i<n && found < 2; i++ ) {
+		const uint8_t *e = b + BUNDLE_HDR + i * BUNDLE_ENTRY;
+
+		if( e[0] == board_type )
+			bundle_half( b, e, halves + found++ );
+	}
+
+	if( found != 2 ) {
+		for( i=0; i<found; i++ ) {
+			g_free( halves[i].text->ranges );
+			g_free( halves[i].text );
+			g_free( halves[i].vectors );
+		}
+
+		g_mapped_file_unref( map );
+		return FALSE;
+	}
+
+	/* Bottom half first */
+	if( halves[0].text->addr > halves[1].text->addr ) {
+		bundle_half_t tmp = halves[0];
+
+		halves[0] = halves[1];
+		halves[1] = tmp;
+	}
+
+	/* The sections point into the mapping, and the firmware is used
+	   until the process exits, so it's never unmapped */
+	return TRUE;
+}
+
+gboolean bundle_write( const char *fname,
+		       uint8_t board_type,
+		       const bundle_half_t halves[2] )
+{
+	GArray *entries;
+	GMappedFile *map;
+	bundle_half_t old[2];
+	gchar *dir;
+	uint8_t *b;
+	uint32_t len, off;
+	guint i;
+	int n;
+	gboolean r;
+
+	g_assert( fname != NULL && halves != NULL );
+
+	entries = g_array_new( FALSE, FALSE, sizeof(bundle_entry_t) );
+
+	for( i=0; i<2; i++ ) {
+		bundle_entry_t e = { board_type, halves[i].text_crc,
+				     halves[i].text, halves[i].vectors };
+		g_array_append_val( entries, e );
+	}
+
+	/* Keep the firmware for the other board types */
+	map = g_mapped_file_new( fname, FALSE, NULL );
+	n = -1;
+	if( map != NULL ) {
+		const uint8_t *ob = (const uint8_t*)g_mapped_file_get_contents( map );
+
+		n = bundle_check( ob, g_mapped_file_get_length( map ) );
+		for( i=0; (int)i<n; i++ ) {
+			const uint8_t *oe = ob + BUNDLE_HDR + i * BUNDLE_ENTRY;
+			bundle_entry_t e;
+
+			if( oe[0] == board_type )
+				continue;
+
+			bundle_half( ob, oe, old );
+			e.board_type = oe[0];
+			e.text_crc = old[0].text_crc;
+			e.text = old[0].text;
+			e.vectors = old[0].vectors;
+			g_array_append_val( entries, e );
+		}
+	}
+
+	/* Lay it out */
+	len = round_up( BUNDLE_HDR + entries->len * BUNDLE_ENTRY );
+	for( i=0; i<entries->len; i++ ) {
+		bundle_entry_t *e = &g_array_index( entries, bundle_entry_t, i );
+
+		len += round_up( e->text->len ) + round_up( e->vectors->len );
+		len += round_up( e->text->n_ranges * 8 );
+	}
+
+	b = g_malloc0( len );
+	memcpy( b, BUNDLE_MAGIC, 4 );
+	put_u32( b + 4, entries->len );
+
+	off = round_up( BUNDLE_HDR + entries->len * BUNDLE_ENTRY );
+	for( i=0; i<entries->len; i++ ) {
+		bundle_entry_t *e = &g_array_index( entries, bundle_entry_t, i );
+		uint8_t *ie = b + BUNDLE_HDR + i * BUNDLE_ENTRY;
+		uint32_t j;
+
+		ie[0] = e->board_type;
+		ie[2] = e->text_crc & 0xff;
+		ie[3] = (e->text_crc >> 8) & 0xff;
+
+		put_u32( ie + 4, e->text->addr );
+		put_u32( ie + 8, e->text->len );
+		put_u32( ie + 12, off );
+		g_memmove( b + off, e->text->data, e->text->len );
+		memset( b + off + e->text->len, 0xaa,
+			round_up( e->text->len ) - e->text->len );
+		off += round_up( e->text->len );
+
+		put_u32( ie + 16, e->vectors->addr );
+		put_u32( ie + 20, e->vectors->len );
+		put_u32( ie + 24, off );
+		g_memmove( b + off, e->vectors->data, e->vectors->len );
+		off += round_up( e->vectors->len );
+
+		put_u32( ie + 28, e->text->ranges != NULL ? off : 0 );
+		put_u32( ie + 32, e->text->ranges != NULL ? e->text->n_ranges : 0 );
+		if( e->text->ranges != NULL ) {
+			for( j=0; j<e->text->n_ranges; j++ ) {
+				put_u32( b + off + j*8, e->text->ranges[j].addr );
+				put_u32( b + off + j*8 + 4, e->text->ranges[j].len );
+			}
+			off += round_up( e->text->n_ranges * 8 );
+		}
+	}
+
+	dir = g_path_get_dirname( fname );
+	r = g_mkdir_with_parents( dir, 0755 ) == 0
+		&& g_file_set_contents( fname, (gchar*)b, off, NULL );
+	g_free( dir );
+
+	/* The old entries point into the mapping */
+	for( i=2; i<entries->len; i++ ) {
+		bundle_entry_t *e = &g_array_index( entries, bundle_entry_t, i );
+
+		g_free( e->text->ranges );
+		g_free( (elf_section_t*)e->text );
+		g_free( (elf_section_t*)e->vectors );
+	}
+	if( map != NULL )
+		g_mapped_file_unref( map );
+
+	g_array_free( entries, TRUE );
+	g_free( b );
+	return r;
+}
+
+gchar* bundle_cache_fname( const char *fna, const char *fnb )
+{
+	GChecksum *sum;
+	const char *fnames[2] = { fna, fnb };
+	gchar *name, *fname;
+	guint i;
+
+	sum = g_checksum_new( G_CHECKSUM_SHA1 );
+
+	for( i=0; i<2; i++ ) {
+		gchar *contents;
+		gsize len;
+
+		if( !g_file_get_contents( fnames[i], &contents, &len, NULL ) ) {
+			g_checksum_free( sum );
+			return NULL;
+		}
+
+		g_checksum_update( sum, (guint8*)contents, len );
+		g_free( contents );
+	}
+
+	name = g_strdup_printf( "%s.fbb", g_checksum_get_string( sum ) );
+	g_checksum_free( sum );
+
+	if( fw_cache_dir != NULL )
+		fname = g_build_filename( fw_cache_dir, "bundles", name, NULL );
+	else
+		fname = g_build_filename( g_get_user_cache_dir(), "flashb", "bundles", name, NULL );
+
+	g_free( name );
+	return fname;
+}
+
+static int bundle_check( const uint8_t *b, gsize len )
+{
+	uint32_t n, i;
+
+	if( len < BUNDLE_HDR || memcmp( b, BUNDLE_MAGIC, 4 ) != 0 )
+		return -1;
+
+	n = get_u32( b + 4 );
+	if( n > (len - BUNDLE_HDR) / BUNDLE_ENTRY )
+		return -1;
+
+	/* Everything the index points at must be in the file */
+	for( i=0; i<n; i++ ) {
+		const uint8_t *e = b + BUNDLE_HDR + i * BUNDLE_ENTRY;
+		uint64_t text_end = (uint64_t)get_u32( e + 12 ) + get_u32( e + 8 );
+		uint64_t vectors_end = (uint64_t)get_u32( e + 24 ) + get_u32( e + 20 );
+		uint64_t ranges_end = (uint64_t)get_u32( e + 28 ) + (uint64_t)get_u32( e + 32 ) * 8;
+
+		if( text_end > len || vectors_end > len || ranges_end > len
+		    || get_u32( e + 8 ) == 0 || get_u32( e + 20 ) == 0 )
+			return -1;
+
+		if( get_u32( e + 28 ) != 0
+		    && !bundle_check_ranges( b + get_u32( e + 28 ), get_u32( e + 32 ),
+					     get_u32( e + 4 ), get_u32( e + 8 ) ) )
+			return -1;
+	}
+
+	return n;
+}
+
+static gboolean bundle_check_ranges( const uint8_t *r,
+				     uint32_t n,
+				     uint32_t addr,
+				     uint32_t len )
+{
+	/* Where the last range ended */
+	uint64_t end = addr;
+	uint32_t i;
+
+	for( i=0; i<n; i++ ) {
+		uint64_t start = get_u32( r + i*8 );
+
+		if( start < end )
+			return FALSE;
+
+		end = start + get_u32( r + i*8 + 4 );
+		if( end > (uint64_t)addr + len )
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void bundle_half( const uint8_t *b,
+			 const uint8_t *entry,
+			 bundle_half_t *half )
+{
+	elf_section_t *s;
+	uint32_t i;
+
+	half->text_crc = entry[2] | (entry[3] << 8);
+
+	s = half->text = g_malloc( sizeof(elf_section_t) );
+	s->name = "data-text";
+	s->addr = get_u32( entry + 4 );
+	s->len = get_u32( entry + 8 );
+	s->offset = 0;
+	s->data = (uint8_t*)b + get_u32( entry + 12 );
+	s->n_ranges = get_u32( entry + 32 );
+	s->ranges = NULL;
+	if( get_u32( entry + 28 ) != 0 ) {
+		const uint8_t *r = b + get_u32( entry + 28 );
+
+		s->ranges = g_malloc( sizeof(elf_range_t) * MAX( s->n_ranges, 1 ) );
+		for( i=0; i<s->n_ranges; i++ ) {
+			s->ranges[i].addr = get_u32( r + i*8 );
+			s->ranges[i].len = get_u32( r + i*8 + 4 );
+		}
+	}
+
+	s = half->vectors = g_malloc( sizeof(elf_section_t) );
+	s->name = ".vectors";
+	s->addr = get_u32( entry + 16 );
+	s->len = get_u32( entry + 20 );
+	s->offset = 0;
+	s->data = (uint8_t*)b + get_u32( entry + 24 );
+	s->n_ranges = 0;
+	s->ranges = NULL;
+}
+
+static uint32_t round_up( uint32_t v )
+{
+	return (v + BUNDLE_ALIGN - 1) & ~(uint32_t)(BUNDLE_ALIGN - 1);
+}
+
+static uint32_t get_u32( const uint8_t *b )
+{
+	return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+static void put_u32( uint8_t *b, uint32_t v )
+{
+	b[0] = v & 0xff;
+	b[1] = (v >> 8) & 0xff;
+	b[2] = (v >> 16) & 0xff;
+	b[3] = (v >> 24) & 0xff;
+}
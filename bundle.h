@@ -0,0 +1,58 @@
+/*  This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA. */
+
+/* Bundles of firmware images that have been pulled out of their ELF files
+   ahead of time.  A bundle holds both halves of the firmware for one or
+   more board types, laid out so that it can be mapped into memory and
+   sent straight from the mapping. */
+#ifndef __BUNDLE
+#define __BUNDLE
+#include <stdint.h>
+#include <glib.h>
+
+#include "elf-access.h"
+
+/* One half of the firmware for a board */
+typedef struct {
+	elf_section_t *text, *vectors;
+	/* CRC of the text section, before padding */
+	uint16_t text_crc;
+} bundle_half_t;
+
+/* Load the two halves of the firmware for the given board type from a
+   bundle, bottom half first.  The sections' data points into a read-only
+   mapping of the file.  Like the sections loaded from ELF files, they
+   are meant to last as long as the process, so the mapping is never
+   unmapped and the sections are never freed.
+   Returns FALSE if the file isn't a valid bundle or doesn't have
+   firmware for the board type. */
+gboolean bundle_load( const char *fname,
+		      uint8_t board_type,
+		      bundle_half_t halves[2] );
+
+/* Write the two halves of the firmware for the given board type to a
+   bundle, bottom half first.  Firmware for other board types already in
+   the bundle is kept.
+   Returns FALSE if the file couldn't be written. */
+gboolean bundle_write( const char *fname,
+		       uint8_t board_type,
+		       const bundle_half_t halves[2] );
+
+/* Returns the name of the bundle in the cache built from the given pair
+   of ELF files.  The name comes from a hash of their contents, so ELF
+   files that haven't changed map to the same bundle.
+   Returns NULL if either file can't be read. */
+gchar* bundle_cache_fname( const char *fna, const char *fnb );
+
+#endif	/* __BUNDLE */
@@ -0,0 +1,52 @@
+/*  This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA. */
+#include "crc16.h"
+
+uint16_t crc16( uint16_t crc, const uint8_t *buf, uint32_t len )
+{
+	uint32_t i;
+	uint8_t j;
+
+	for( i=0; i<len; i++ ) {
+		crc ^= ((uint16_t)buf[i]) << 8;
+
+		for( j=0; j<8; j++ ) {
+			if( crc & 0x8000 )
+				crc = (crc << 1) ^ 0x1021;
+			else
+				crc <<= 1;
+		}
+	}
+
+	return crc;
+}
+
+uint8_t crc8( const uint8_t *buf, uint8_t len )
+{
+	uint8_t crc = 0;
+	uint8_t i, j;
+
+	for( i=0; i<len; i++ ) {
+		crc ^= buf[i];
+
+		for( j=0; j<8; j++ ) {
+			if( crc & 0x80 )
+				crc = (crc << 1) ^ 0x07;
+			else
+				crc <<= 1;
+		}
+	}
+
+	return crc;
+}
@@ -0,0 +1,31 @@
+/*  This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA. */
+
+/* CRCs as calculated by the MSP430 bootloader */
+#ifndef __CRC16
+#define __CRC16
+#include <stdint.h>
+
+/* Initial value to pass to crc16 */
+#define CRC16_INIT 0
+
+/* Add len bytes from buf to the CRC.
+   This is the CCITT polynomial (0x1021), most significant bit first. */
+uint16_t crc16( uint16_t crc, const uint8_t *buf, uint32_t len );
+
+/* CRC-8 (polynomial 0x07) of len bytes from buf.
+   Used to check CMD_FW_NEXT replies. */
+uint8_t crc8( const uint8_t *buf, uint8_t len );
+
+#endif	/* __CRC16 */
@@ -21,16 +21,23 @@
 #include <stdio.h>
 #include <unistd.h>
 
-/* Allocate memory for a section and copy it into memory.
+/* A PT_LOAD segment waiting to be put into a section */
+typedef struct {
+	uint32_t addr;
+	uint32_t len;
+	uint32_t offset;
+	const uint8_t *data;
+} elf_segment_t;
+
+/* Build a section from the given segments.
    Arguments:
-    - section: The section to copy from.
-    -  header: The section header for the section to copy from. */
-static elf_section_t* elf_access_load_section( Elf_Scn *section,
-					       Elf32_Shdr *header );
+    -     name: The name of the section.
+    - segments: The segments to put in it. */
+static elf_section_t* elf_access_build_section( char *name,
+						GArray *segments );
 
-static Elf32_Addr elf_access_find_section_paddr( Elf *elf,
-						 Elf32_Ehdr *ehdr,
-						 elf_section_t *sec );
+/* Order segments by address */
+static int elf_access_segment_cmp( const void *a, const void *b );
 
 void elf_access_load_sections( char* fname,
 			       elf_section_t **text,
@@ -38,12 +45,15 @@ void elf_access_load_sections( char* fname,
 {
 	int efd;
 	Elf *elf;
-	size_t stable;
+	size_t stable, raw_len;
 	Elf32_Ehdr *ehdr;
+	Elf32_Phdr *phdr;
 	Elf_Scn *section;
-	elf_section_t *data = NULL, *tmp = NULL;
-	elf_section_t *dt = NULL;
-	Elf32_Addr data_paddr;
+	Elf32_Half i;
+	const uint8_t *raw;
+	gboolean have_text = FALSE, have_vectors = FALSE;
+	Elf32_Addr vectors_addr = 0;
+	GArray *text_segs, *vector_segs;
 
 	g_assert( fname != NULL && text != NULL && vectors != NULL );
 
@@ -52,7 +62,7 @@ void elf_access_load_sections( char* fname,
 
 	efd = open( fname , O_RDONLY );
 	if( efd < 0 )
-		g_error( "Failed to open elf file 'motor': %m" );
+		g_error( "Failed to open elf file '%s': %m", fname );
 
 	elf = elf_begin( efd, ELF_C_READ, NULL );
 	if( elf == NULL )
@@ -67,7 +77,8 @@ void elf_access_load_sections( char* fname,
 		g_error( "Failed to get elf header: %s", elf_errmsg(-1) );
 	stable = ehdr->e_shstrndx;
 
-	/* Find the .text and .vectors sections */
+	/* Find the .text and .vectors sections, so that we know which
+	   segments belong in the IVT */
 	section = NULL;
 	/* Loop through all the sections */
 	while( (section = elf_nextscn( elf, section )) != NULL ) {
@@ -83,101 +94,141 @@ void elf_access_load_sections( char* fname,
 		if( name == NULL )
 			g_error( "Couldn't get section name: %s", elf_errmsg(-1) );
 
-		if( strcmp( name, ".text" ) == 0 ) {
-			*text = elf_access_load_section( section, hdr );
-			(*text)->name = ".text";
-		}
+		if( strcmp( name, ".text" ) == 0 )
+			have_text = TRUE;
 		else if( strcmp( name, ".vectors" ) == 0 ) {
-			*vectors = elf_access_load_section( section, hdr );
-			(*vectors)->name = ".vectors";
-		}
-		else if( strcmp( name, ".data" ) == 0 ) {
-			data = elf_access_load_section( section, hdr );
-			data->name = ".data";
+			have_vectors = TRUE;
+			vectors_addr = hdr->sh_addr;
 		}
 	}	
 
-	if( text == NULL )
+	if( !have_text )
 		g_error( ".text section not found in ELF file" );
-	if( vectors == NULL )
+	if( !have_vectors )
 		g_error( ".vectors section not found in ELF file" );
-	/* Assume .data section has to be present  */
-	if( data == NULL )
-		g_error( ".data section not found in ELF file" );
-
-	/*** Hack alert... ***/
-	/* Create a merged section containing .text and .data */
-	/* Merge data onto the end of .text */
-	dt = g_malloc( sizeof(elf_section_t) );
-	
-	/* Find the address at which we have to stick .data into flash */
-	data_paddr = elf_access_find_section_paddr( elf, ehdr, data );
 
-	/* We only support this at the moment */
-	g_assert( data_paddr > (*text)->addr );
+	phdr = elf32_getphdr( elf );
+	if( phdr == NULL )
+		g_error( "Failed to get elf program header" );
+
+	raw = (uint8_t*)elf_rawfile( elf, &raw_len );
+	if( raw == NULL )
+		g_error( "Failed to read ELF file: %s", elf_errmsg(-1) );
 
-	dt->addr = (*text)->addr;
-	dt->name = "data-text";
-	dt->len = (data_paddr + data->len) - (*text)->addr;
-	dt->data = g_malloc( dt->len );
+	text_segs = g_array_new( FALSE, FALSE, sizeof(elf_segment_t) );
+	vector_segs = g_array_new( FALSE, FALSE, sizeof(elf_segment_t) );
 
-	/* Copy .text and .data in */
-	g_memmove( dt->data, ((*text)->data), (*text)->len );
-	g_memmove( dt->data + ( data_paddr - (*text)->addr ),
-		   data->data, data->len );
+	/* Number of entries in phdr is ehdr->e_phnum */
+	for( i=0; i < ehdr->e_phnum; i++ ) {
+		Elf32_Phdr *p = phdr + i;
+		elf_segment_t seg;
+
+		/* Segments without any bytes in the file (e.g. .bss)
+		   don't go into flash */
+		if( p->p_type != PT_LOAD || p->p_filesz == 0 )
+			continue;
+
+		if( p->p_offset + p->p_filesz > raw_len )
+			g_error( "Segment at %x runs off the end of the ELF file", p->p_paddr );
+
+		/* Segments are loaded into flash at their physical address */
+		seg.addr = p->p_paddr;
+		seg.len = p->p_filesz;
+		seg.offset = p->p_offset;
+		seg.data = raw + p->p_offset;
+
+		if( seg.addr >= vectors_addr )
+			g_array_append_val( vector_segs, seg );
+		else
+			g_array_append_val( text_segs, seg );
+	}
 
-	tmp = *text;
-	*text = dt;
-	g_free( tmp->data );
-	g_free( tmp );
+	if( text_segs->len == 0 )
+		g_error( "No program segments found below the IVT" );
+	if( vector_segs->len == 0 )
+		g_error( "No program segments found for the IVT" );
+
+	*text = elf_access_build_section( "data-text", text_segs );
+	*vectors = elf_access_build_section( ".vectors", vector_segs );
+
+	g_array_free( text_segs, TRUE );
+	g_array_free( vector_segs, TRUE );
 
 	elf_end( elf );
 	close( efd );
 }
 
-static elf_section_t* elf_access_load_section( Elf_Scn *section, Elf32_Shdr *header )
+gboolean elf_access_populated( const elf_section_t *section,
+			       uint32_t addr,
+			       uint32_t len )
 {
-	Elf_Data *d = NULL;
-	elf_section_t *s = NULL;
-	uint8_t *tpos;
-	g_assert( section != NULL && header != NULL );
+	uint32_t i;
+	g_assert( section != NULL );
 
-	s = g_malloc( sizeof(elf_section_t) );
-	s->data = tpos = g_malloc( header->sh_size );
-	s->len = header->sh_size;
-	s->addr = header->sh_addr;
-	s->offset = header->sh_offset;
-
-	/* The ELF library returns data in multiple buffers, which we iterate through */
-	while ( (d = elf_rawdata( section, d )) != NULL )
-	{
-		g_memmove( tpos, d->d_buf, d->d_size );
-		tpos += d->d_size;
+	if( section->ranges == NULL )
+		return addr < section->addr + section->len
+			&& addr + len > section->addr;
+
+	for( i=0; i < section->n_ranges; i++ ) {
+		const elf_range_t *r = section->ranges + i;
+
+		/* The ranges are sorted */
+		if( r->addr >= addr + len )
+			break;
+
+		if( r->addr + r->len > addr )
+			return TRUE;
 	}
 
-	return s;
+	return FALSE;
 }
 
-static Elf32_Addr elf_access_find_section_paddr( Elf *elf,
-						 Elf32_Ehdr *ehdr,
-						 elf_section_t *sec )
+static elf_section_t* elf_access_build_section( char *name,
+						GArray *segments )
 {
-	Elf32_Phdr *phdr; 
-	Elf32_Half i;
+	elf_section_t *s;
+	elf_segment_t *first, *last;
+	guint i;
 
-	phdr = elf32_getphdr( elf );
-	if( phdr == NULL )
-		g_error( "Failed to get elf program header" );
+	g_assert( segments != NULL && segments->len > 0 );
 
-	/* Number of entries in phdr is ehdr->e_phnum */
-	for( i=0; i < ehdr->e_phnum; i++ ) {
-		Elf32_Phdr *p = phdr + i;
+	g_array_sort( segments, elf_access_segment_cmp );
+	first = &g_array_index( segments, elf_segment_t, 0 );
+	last = &g_array_index( segments, elf_segment_t, segments->len - 1 );
 
-		if( p->p_offset == sec->offset )
-			return p->p_paddr;
+	s = g_malloc( sizeof(elf_section_t) );
+	s->name = name;
+	s->addr = first->addr;
+	s->offset = first->offset;
+	s->len = (last->addr + last->len) - first->addr;
+	s->n_ranges = segments->len;
+	s->ranges = g_malloc( sizeof(elf_range_t) * segments->len );
+
+	/* Anything not in a segment is left as erased flash */
+	s->data = g_malloc( s->len );
+	memset( s->data, 0xff, s->len );
+
+	for( i=0; i < segments->len; i++ ) {
+		elf_segment_t *seg = &g_array_index( segments, elf_segment_t, i );
+
+		if( i > 0 && seg->addr < s->ranges[i-1].addr + s->ranges[i-1].len )
+			g_error( "Segments at %x and %x overlap",
+				 s->ranges[i-1].addr, seg->addr );
+
+		s->ranges[i].addr = seg->addr;
+		s->ranges[i].len = seg->len;
+		g_memmove( s->data + (seg->addr - s->addr), seg->data, seg->len );
 	}
 
-	g_error( "Failed to find section in program header" );
+	return s;
+}
+
+static int elf_access_segment_cmp( const void *a, const void *b )
+{
+	const elf_segment_t *sa = a, *sb = b;
+
+	if( sa->addr < sb->addr )
+		return -1;
 
-	return 0;
+	return sa->addr > sb->addr;
 }
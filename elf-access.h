@@ -17,8 +17,17 @@
 #ifndef __ELF_ACCESS
 #define __ELF_ACCESS
 #include <stdint.h>
+#include <glib.h>
 
+/* A range of addresses that the ELF file has data for */
 typedef struct {
+	uint32_t addr;
+	uint32_t len;
+} elf_range_t;
+
+typedef struct {
+	/* The data from addr to addr+len.
+	   Bytes that aren't in any of the ranges are 0xff. */
 	uint8_t *data;
 	uint32_t len;
 	uint32_t addr;
@@ -26,11 +35,24 @@ typedef struct {
 	/* The offset within the elf file */
 	uint32_t offset;
 	char* name;
+
+	/* The ranges of addresses that have data, sorted by address.
+	   NULL means that the whole section has data. */
+	elf_range_t *ranges;
+	uint32_t n_ranges;
 } elf_section_t;
 
-/* Load */
+/* Load the image to be written into flash from the PT_LOAD segments of
+   an ELF file.
+   The segments that belong in the interrupt vector table are put in
+   *vectors, and all the others in *text. */
 void elf_access_load_sections( char* fname,
 			       elf_section_t **text,
 			       elf_section_t **vectors );
 
+/* Returns TRUE if the ELF file has data for any of the len bytes from addr */
+gboolean elf_access_populated( const elf_section_t *section,
+			       uint32_t addr,
+			       uint32_t len );
+
 #endif	/* __ELF_ACCESS */
@@ -0,0 +1,589 @@
+/*  This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA. */
+
+/* Benchmark of the firmware transfer code against simulated bootloaders.
+   Prints one JSON object per line for each image size. */
+#include <glib.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sric.h>
+
+#include "elf-access.h"
+#include "msp430-fw.h"
+#include "crc16.h"
+#include "sim-sric.h"
+#include "trace.h"
+
+/* Image sizes to send if none are given */
+static const uint32_t default_sizes[] = { 1024, 4096, 16352 };
+
+static gint latency_us = 1000;
+static gint byte_us = 20;
+static gint write_us = 500;
+static gint boot_us = 50000;
+static gdouble loss = 0;
+static gdouble drop = 0;
+static gdouble corrupt = 0;
+static gint window = 1;
+static gint max_window = 0;
+static gint chunk_size = CHUNK_SIZE;
+static gint caps = 0;
+static gint max_chunk = CHUNK_SIZE;
+static gint max_zchunks = 8;
+static gint seed = 1;
+static gint boards = 1;
+static gboolean busy_drop = FALSE;
+static gint delta = 0;
+static gint max_chunks = 0;
+static gchar *replay_fname = NULL;
+static gchar **sizes = NULL;
+
+/* Group address the boards take the image at, when there's more
+   than one */
+#define BENCH_GROUP MSP430_GROUP_MAX
+
+/* The simulated board */
+static msp430_board_t board;
+/* The simulated bus it's on */
+static transport_t *bus;
+
+/* The transactions with each device in the trace being replayed, in
+   the order the devices first appear, and how long the recorded run
+   took */
+static GArray *scripts[SIM_MAX_DEVICES];
+static guint n_scripts = 0;
+static uint64_t recorded_us = 0;
+
+static GOptionEntry entries[] =
+{
+	{ "latency", 'l', 0, G_OPTION_ARG_INT, &latency_us, "Time taken by each transaction", "US" },
+	{ "byte-time", 'b', 0, G_OPTION_ARG_INT, &byte_us, "Time taken by each byte on the bus", "US" },
+	{ "write-time", 'w', 0, G_OPTION_ARG_INT, &write_us, "Time taken to write each chunk to flash", "US" },
+	{ "boot-time", 0, 0, G_OPTION_ARG_INT, &boot_us, "Time taken to reboot after switching over", "US" },
+	{ "loss", 'p', 0, G_OPTION_ARG_DOUBLE, &loss, "Probability of a chunk being lost", "P" },
+	{ "drop", 'd', 0, G_OPTION_ARG_DOUBLE, &drop, "Probability of any transaction getting no reply", "P" },
+	{ "corrupt", 0, 0, G_OPTION_ARG_DOUBLE, &corrupt, "Probability of a chunk being written to flash with a byte wrong", "P" },
+	{ "window", 'W', 0, G_OPTION_ARG_INT, &window, "Chunks sent before checking the next address", "N" },
+	{ "max-window", 0, 0, G_OPTION_ARG_INT, &max_window, "Most chunks the window grows to while none are lost (default: the window, which stays fixed)", "N" },
+	{ "chunk-size", 'C', 0, G_OPTION_ARG_INT, &chunk_size, "Bytes in each chunk", "N" },
+	{ "caps", 0, 0, G_OPTION_ARG_INT, &caps, "Bootloader capability bits", "BITS" },
+	{ "max-chunk", 0, 0, G_OPTION_ARG_INT, &max_chunk, "Largest chunk the bootloader accepts", "N" },
+	{ "max-zchunks", 0, 0, G_OPTION_ARG_INT, &max_zchunks, "Most chunks the bootloader takes in one compressed frame", "N" },
+	{ "boards", 'n', 0, G_OPTION_ARG_INT, &boards, "Identical boards on the bus", "N" },
+	{ "busy-drop", 0, 0, G_OPTION_ARG_NONE, &busy_drop, "Boards miss group frames sent while they're writing flash, as over sricd, rather than holding the bus", NULL },
+	{ "delta", 0, 0, G_OPTION_ARG_INT, &delta, "Start each board with an earlier image that differs in N places, and send the changes against it", "N" },
+	{ "max-chunks", 0, 0, G_OPTION_ARG_INT, &max_chunks, "Fail if a run sends more than N chunk frames", "N" },
+	{ "replay", 'r', 0, G_OPTION_ARG_FILENAME, &replay_fname, "Take the timing of each board's transactions from a trace recorded by flashb --trace, one board for each device in it.  The recorded times include any time the device spent writing, so use with -w 0", "PATH" },
+	{ "seed", 's', 0, G_OPTION_ARG_INT, &seed, "Seed for frame loss", "N" },
+	{ "size", 'S', 0, G_OPTION_ARG_STRING_ARRAY, &sizes, "Image size to send (may be repeated)", "BYTES" },
+	{ NULL }
+};
+
+/* Make a made-up image of the given length at the given address.
+   Like real firmware, it has some erased runs and a gap between
+   segments. */
+static elf_section_t* bench_image( uint32_t addr, uint32_t len );
+
+/* Make a made-up IVT */
+static elf_section_t* bench_vectors( void );
+
+/* Make a copy of the image with n bytes changed, spread across it */
+static elf_section_t* bench_changed_image( const elf_section_t *text, uint32_t n );
+
+/* Send an image to the simulated device and print the results.
+   Returns TRUE if every board ended up with the image and switched
+   over to it. */
+static gboolean bench_run( uint32_t len );
+
+/* Print a summary of the trace to stderr, and split it into the
+   transactions with each device */
+static void bench_load_trace( const char *fname );
+
+/* Send the image to one device, and send it again as flashb does until
+   the CRC matches.  known is what the device already holds, or NULL.
+   The number of times it was sent again is put in *attempts.
+   Returns TRUE if the CRC matched, or FALSE if it didn't or the device
+   stopped answering too often. */
+static gboolean bench_flash( const sric_device *device,
+			     uint16_t dev_caps,
+			     uint16_t dev_chunk,
+			     uint8_t max_z,
+			     elf_section_t *text,
+			     elf_section_t *vectors,
+			     const elf_section_t *known,
+			     uint16_t expected,
+			     uint8_t *attempts,
+			     uint32_t *repaired );
+
+/* Send one section to the device, leaving out chunks that match old
+   (if it's not NULL) where the bootloader allows.  *stalls counts the
+   times the device has stopped answering part way through.
+   Returns FALSE if it has stopped MSP430_XFER_STALLS times. */
+static gboolean bench_send_section( const sric_device *device,
+				    uint16_t caps,
+				    uint16_t chunk_size,
+				    uint8_t zchunks,
+				    elf_section_t *section,
+				    const elf_section_t *old,
+				    gboolean check_first,
+				    uint8_t *stalls );
+
+int main( int argc, char** argv )
+{
+	GError *error = NULL;
+	GOptionContext *context;
+	gboolean ok = TRUE;
+	uint8_t i;
+
+	context = g_option_context_new( "- benchmark firmware transfers to simulated MSP430s" );
+	g_option_context_add_main_entries( context, entries, NULL );
+
+	if( !g_option_context_parse( context, &argc, &argv, &error ) ) {
+		g_print( "Failed to parse command line options: %s\n",
+			 error->message );
+		exit(1);
+	}
+
+	if( window < 1 )
+		g_error( "The window must be at least 1" );
+	if( chunk_size < 2 || chunk_size > MSP430_MAX_CHUNK
+	    || (chunk_size & (chunk_size - 1)) != 0 )
+		g_error( "The chunk size must be a power of two no more than %u",
+			 (unsigned int)MSP430_MAX_CHUNK );
+	if( boards < 1 || boards > SIM_MAX_DEVICES )
+		g_error( "There must be between 1 and %u boards", SIM_MAX_DEVICES );
+	if( delta < 0 || max_chunks < 0 )
+		g_error( "--delta and --max-chunks can't be negative" );
+	if( max_zchunks < 1 || max_zchunks > MSP430_MAX_ZCHUNKS )
+		g_error( "The bootloader must take between 1 and %u chunks in a compressed frame",
+			 MSP430_MAX_ZCHUNKS );
+
+	/* The simulated bootloader uses the same command numbers */
+	board.name = "bench";
+	board.type = 2;
+	for( i=0; i<NUM_COMMANDS; i++ ) {
+		board.commands[i] = i;
+		board.command_present[i] = TRUE;
+	}
+	board.bottom = 0x8000;
+	board.top = 0xc000;
+	board.window = window;
+	board.max_window = MAX( max_window, window );
+	board.chunk_size = chunk_size;
+	if( replay_fname != NULL )
+		bench_load_trace( replay_fname );
+	/* Back off and time transactions in simulated time */
+	msp430_fw_sleep = sim_sleep;
+	msp430_fw_clock = sim_now;
+	bus = sim_transport();
+
+	if( sizes == NULL ) {
+		for( i=0; i<G_N_ELEMENTS(default_sizes); i++ )
+			ok = bench_run( default_sizes[i] ) && ok;
+	} else {
+		gchar **s;
+
+		for( s=sizes; *s != NULL; s++ )
+			ok = bench_run( strtoul( *s, NULL, 0 ) ) && ok;
+	}
+
+	return ok ? 0 : 1;
+}
+
+static gboolean bench_run( uint32_t len )
+{
+	sim_config_t conf;
+	const sric_device *devices[SIM_MAX_DEVICES];
+	const sim_stats_t *stats;
+	elf_section_t *text, *vectors, *old = NULL;
+	uint16_t fw, max, expected, crc, dev_caps = 0, dev_chunk = 0;
+	uint8_t max_z = 0;
+	uint64_t transfer_us, transactions;
+	gint64 host_start, host_us, srtt;
+	int timeout;
+	uint32_t bad, repaired = 0, missed = 0;
+	uint8_t i, attempts, resends = 0;
+	gboolean crc_ok = TRUE, switched = TRUE, group;
+	const uint16_t group_caps = MSP430_CAP_GROUP | MSP430_CAP_KEEP | MSP430_CAP_CRC_RANGE;
+
+	if( len < 2 || len > board.top - board.bottom )
+		g_error( "Image size %u doesn't fit in the bottom half", len );
+
+	memset( &conf, 0, sizeof(conf) );
+	conf.type = board.type;
+	conf.board = &board;
+	conf.caps = caps;
+	conf.max_chunk = max_chunk;
+	conf.max_zchunks = max_zchunks;
+	conf.bottom = board.bottom;
+	conf.top = board.top;
+	conf.latency_us = latency_us;
+	conf.byte_us = byte_us;
+	conf.write_us = write_us;
+	conf.boot_us = boot_us;
+	conf.loss = loss;
+	conf.drop = drop;
+	conf.corrupt = corrupt;
+	conf.busy_drop = busy_drop;
+
+	sim_reset( seed );
+	msp430_link_reset();
+	for( i=0; i<boards; i++ ) {
+		conf.address = i + 1;
+		conf.script = i < n_scripts ? (trace_entry_t*)scripts[i]->data : NULL;
+		conf.script_len = i < n_scripts ? scripts[i]->len : 0;
+		sim_add_device( &conf );
+		devices[i] = bus->enumerate( bus, i ? devices[i-1] : NULL );
+	}
+
+	text = bench_image( board.bottom, len );
+	vectors = bench_vectors();
+	if( delta > 0 ) {
+		old = bench_changed_image( text, delta );
+		for( i=0; i<boards; i++ )
+			sim_load_flash( devices[i]->address, old );
+	}
+
+	host_start = g_get_monotonic_time();
+
+	/* The same sequence as flashb */
+	for( i=0; i<boards; i++ ) {
+		uint8_t tries;
+
+		for( tries=0; !msp430_get_fw_version( bus, &board, devices[i], &fw ); tries++ )
+			if( tries == 10 )
+				g_error( "Simulated device not answering" );
+
+		dev_caps = msp430_get_caps( bus, &board, devices[i], &max, &max_z );
+		dev_chunk = board.chunk_size;
+		while( dev_chunk > max )
+			dev_chunk >>= 1;
+	}
+
+	/* What the CRC should be */
+	expected = msp430_image_crc( crc16( CRC16_INIT, text->data, text->len ),
+				     text, vectors, dev_chunk );
+
+	/* The boards are all the same, so get the same image at once
+	   where they can */
+	group = boards > 1 && (dev_caps & group_caps) == group_caps;
+	if( group ) {
+		for( i=0; i<boards; i++ )
+			msp430_join_group( bus, &board, devices[i], BENCH_GROUP );
+		msp430_send_group_section( bus, &board, BENCH_GROUP, devices[0],
+					   dev_caps, dev_chunk, text );
+	}
+
+	for( i=0; i<boards; i++ ) {
+		elf_section_t *known = NULL;
+		const elf_section_t *against = NULL;
+		const uint16_t delta_caps = MSP430_CAP_CRC_RANGE | MSP430_CAP_KEEP;
+
+		/* Each board is sent what it missed on its own */
+		if( group ) {
+			known = msp430_crc_bisect( bus, &board, devices[i], text, dev_chunk, &bad );
+			if( known != NULL )
+				missed += bad;
+			msp430_get_fw_version( bus, &board, devices[i], &fw );
+			against = known;
+		}
+		/* The earlier image stands in for flashb's cache, and is
+		   checked against the flash the same way */
+		else if( old != NULL && (dev_caps & delta_caps) == delta_caps
+			 && msp430_get_crc_range( bus, &board, devices[i], old->addr, old->len, &crc )
+			 && crc == crc16( CRC16_INIT, old->data, old->len ) )
+			against = old;
+
+		if( !bench_flash( devices[i], dev_caps, dev_chunk, max_z, text, vectors,
+				  against, expected, &attempts, &repaired ) )
+			crc_ok = FALSE;
+		resends = MAX( resends, attempts );
+
+		if( known != NULL ) {
+			g_free( known->data );
+			g_free( known );
+		}
+	}
+
+	stats = sim_get_stats();
+	transfer_us = stats->time_us;
+
+	for( i=0; i<boards; i++ )
+		if( !msp430_confirm_crc( bus, &board, devices[i],
+					 text->data[0] | (text->data[1] << 8) ) )
+			switched = FALSE;
+
+	host_us = g_get_monotonic_time() - host_start;
+	timeout = msp430_link_timeout( bus, devices[0], CMD_FW_CHUNK, &srtt );
+
+	transactions = 0;
+	for( i=0; i<NUM_COMMANDS; i++ )
+		transactions += stats->txrx[i];
+
+	printf( "{\"size\": %u, \"boards\": %i, \"chunk_size\": %hu, \"window\": %hu, \"caps\": %hu, "
+		"\"loss\": %g, \"drop\": %g, \"time_us\": %" G_GUINT64_FORMAT ", "
+		"\"transfer_us\": %" G_GUINT64_FORMAT ", "
+		"\"confirm_us\": %" G_GUINT64_FORMAT ", "
+		"\"bytes_per_s\": %.1f, \"round_trips_per_kb\": %.2f, "
+		"\"transactions\": %" G_GUINT64_FORMAT ", \"chunks\": %u, "
+		"\"retransmits\": %u, \"lost\": %u, \"timeouts\": %u, \"dropped\": %u, "
+		"\"bus_bytes\": %" G_GUINT64_FORMAT ", "
+		"\"zchunks\": %u, \"zip_ratio\": %.2f, "
+		"\"group_chunks\": %u, \"group_missed\": %u, \"delta\": %i, "
+		"\"corrupted\": %u, \"resends\": %hhu, \"repaired_chunks\": %u, "
+		"\"chunk_rtt_us\": %" G_GINT64_FORMAT ", \"timeout_ms\": %i, "
+		"\"crc_ok\": %s, \"switched\": %s, \"recorded_us\": %" G_GUINT64_FORMAT ", "
+		"\"host_us\": %" G_GINT64_FORMAT "}\n",
+		len, boards, dev_chunk, board.window, dev_caps,
+		loss, drop, stats->time_us, transfer_us, stats->time_us - transfer_us,
+		(len + vectors->len) * boards * 1000000.0 / stats->time_us,
+		transactions * 1024.0 / ((len + vectors->len) * boards),
+		transactions, stats->chunks, stats->retransmits, stats->lost,
+		stats->timeouts, stats->dropped, stats->bytes,
+		stats->zchunks, stats->zip_out ? (double)stats->zip_in / stats->zip_out : 1.0,
+		stats->group_chunks, missed, delta,
+		stats->corrupted, resends, repaired, srtt, timeout,
+		crc_ok ? "true" : "false",
+		switched ? "true" : "false",
+		recorded_us, host_us );
+
+	g_free( text->data );
+	g_free( text->ranges );
+	g_free( text );
+	if( old != NULL ) {
+		g_free( old->data );
+		g_free( old->ranges );
+		g_free( old );
+	}
+	g_free( vectors->data );
+	g_free( vectors );
+
+	if( max_chunks > 0 && stats->chunks > (uint32_t)max_chunks ) {
+		fprintf( stderr, "%u bytes took %u chunk frames, expected no more than %i\n",
+			 len, stats->chunks, max_chunks );
+		return FALSE;
+	}
+
+	return crc_ok && switched;
+}
+
+static gboolean bench_flash( const sric_device *device,
+			     uint16_t dev_caps,
+			     uint16_t dev_chunk,
+			     uint8_t max_z,
+			     elf_section_t *text,
+			     elf_section_t *vectors,
+			     const elf_section_t *known,
+			     uint16_t expected,
+			     uint8_t *attempts,
+			     uint32_t *repaired )
+{
+	uint16_t fw, crc;
+	uint32_t bad;
+	uint8_t stalls = 0;
+
+	*attempts = 0;
+	if( !bench_send_section( device, dev_caps, dev_chunk, max_z, text, known, TRUE, &stalls )
+	    || !bench_send_section( device, dev_caps, dev_chunk, max_z, vectors, NULL, FALSE, &stalls ) )
+		return FALSE;
+
+	if( !msp430_get_crc( bus, &board, device, &crc ) )
+		crc = ~expected;
+
+	/* Send it again as flashb does, mending it where the bootloader
+	   can say which chunks are wrong */
+	while( crc != expected && *attempts + 1 < MSP430_XFER_ATTEMPTS ) {
+		elf_section_t *wrong;
+		gboolean sent;
+
+		(*attempts)++;
+		wrong = msp430_crc_mend( bus, &board, device, dev_caps, text, dev_chunk, &bad );
+		if( wrong != NULL )
+			*repaired += bad;
+
+		msp430_get_fw_version( bus, &board, device, &fw );
+		sent = bench_send_section( device, dev_caps, dev_chunk, max_z, text, wrong, TRUE, &stalls )
+			&& bench_send_section( device, dev_caps, dev_chunk, max_z, vectors, NULL, FALSE, &stalls );
+
+		if( wrong != NULL ) {
+			g_free( wrong->data );
+			g_free( wrong );
+		}
+
+		if( !sent )
+			return FALSE;
+
+		if( !msp430_get_crc( bus, &board, device, &crc ) )
+			crc = ~expected;
+	}
+
+	return crc == expected;
+}
+
+static void bench_load_trace( const char *fname )
+{
+	GArray *entries;
+	uint8_t bus_index[SIM_MAX_DEVICES], address[SIM_MAX_DEVICES];
+	uint64_t start = G_MAXUINT64, end = 0;
+	guint i, j;
+
+	entries = trace_load( fname );
+	if( entries == NULL )
+		exit(1);
+	trace_summary( stderr, entries );
+
+	for( i=0; i<entries->len; i++ ) {
+		const trace_entry_t *e = &g_array_index( entries, trace_entry_t, i );
+
+		/* Frames to a group address aren't anyone's in particular */
+		if( e->result == TRACE_SENT || e->result == TRACE_NOT_SENT )
+			continue;
+
+		for( j=0; j<n_scripts; j++ )
+			if( bus_index[j] == e->bus && address[j] == e->address )
+				break;
+		if( j == n_scripts ) {
+			if( n_scripts == SIM_MAX_DEVICES )
+				continue;
+			bus_index[j] = e->bus;
+			address[j] = e->address;
+			scripts[n_scripts++] = g_array_new( FALSE, FALSE, sizeof(trace_entry_t) );
+		}
+
+		g_array_append_val( scripts[j], *e );
+		start = MIN( start, e->time_us );
+		end = MAX( end, e->time_us + e->latency_us );
+	}
+
+	if( n_scripts > 0 )
+		recorded_us = end - start;
+	g_array_free( entries, TRUE );
+}
+
+static gboolean bench_send_section( const sric_device *device,
+				    uint16_t caps,
+				    uint16_t chunk_size,
+				    uint8_t zchunks,
+				    elf_section_t *section,
+				    const elf_section_t *old,
+				    gboolean check_first,
+				    uint8_t *stalls )
+{
+	msp430_xfer_t xfer;
+
+	msp430_xfer_init( &xfer, &board, device, caps, chunk_size, zchunks );
+	xfer.old = old;
+	msp430_xfer_start_section( bus, &xfer, section, check_first );
+
+	/* Carry on from wherever the device got to when it stops
+	   answering, as flashb does, until it's stopped too often */
+	while( msp430_xfer_step( bus, &xfer ) || xfer.failed )
+		if( xfer.failed && ++(*stalls) == MSP430_XFER_STALLS )
+			return FALSE;
+
+	return TRUE;
+}
+
+static elf_section_t* bench_image( uint32_t addr, uint32_t len )
+{
+	elf_section_t *s;
+	uint32_t i, gap;
+	uint32_t r = 0x1234;
+
+	s = g_malloc( sizeof(elf_section_t) );
+	s->addr = addr;
+	s->len = len;
+	s->offset = 0;
+	s->name = "data-text";
+	s->data = g_malloc( len );
+
+	for( i=0; i<len; i++ ) {
+		r = r * 1103515245 + 12345;
+		s->data[i] = r >> 16;
+	}
+
+	/* Firmware version 1 */
+	s->data[0] = 1;
+	s->data[1] = 0;
+
+	/* An erased table a quarter of the way in */
+	memset( s->data + len / 4, 0xff, len / 8 );
+
+	/* .data starts on the next 256 byte boundary after the middle */
+	gap = len / 2;
+	if( gap + 256 < len ) {
+		uint32_t data_start = ((gap + 255) & ~255) + 256;
+
+		if( data_start < len ) {
+			memset( s->data + gap, 0xff, data_start - gap );
+
+			s->n_ranges = 2;
+			s->ranges = g_malloc( sizeof(elf_range_t) * 2 );
+			s->ranges[0].addr = addr;
+			s->ranges[0].len = gap;
+			s->ranges[1].addr = addr + data_start;
+			s->ranges[1].len = len - data_start;
+			return s;
+		}
+	}
+
+	s->n_ranges = 1;
+	s->ranges = g_malloc( sizeof(elf_range_t) );
+	s->ranges[0].addr = addr;
+	s->ranges[0].len = len;
+	return s;
+}
+
+static elf_section_t* bench_vectors( void )
+{
+	elf_section_t *s;
+	uint8_t i;
+
+	s = g_malloc( sizeof(elf_section_t) );
+	s->addr = 0xffe0;
+	s->len = 32;
+	s->offset = 0;
+	s->name = ".vectors";
+	s->ranges = NULL;
+	s->n_ranges = 0;
+	s->data = g_malloc( 32 );
+
+	for( i=0; i<32; i += 2 ) {
+		s->data[i] = 0x00;
+		s->data[i+1] = 0x80;
+	}
+
+	return s;
+}
+
+static elf_section_t* bench_changed_image( const elf_section_t *text, uint32_t n )
+{
+	elf_section_t *s;
+	uint32_t i;
+
+	s = g_malloc( sizeof(elf_section_t) );
+	*s = *text;
+	s->data = g_malloc( text->len );
+	memcpy( s->data, text->data, text->len );
+	s->ranges = g_malloc( sizeof(elf_range_t) * text->n_ranges );
+	memcpy( s->ranges, text->ranges, sizeof(elf_range_t) * text->n_ranges );
+
+	/* Clear of the version at the start */
+	for( i=0; i<n; i++ )
+		s->data[2 + (uint64_t)i * (text->len - 2) / n] ^= 0x5a;
+
+	return s;
+}
@@ -23,17 +23,46 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
 #include <sric.h>
 
 #include "elf-access.h"
 #include "msp430-fw.h"
+#include "crc16.h"
+#include "bundle.h"
+#include "fw-cache.h"
+#include "job-socket.h"
+#include "journal.h"
+#include "stats.h"
+#include "transport.h"
+#include "trace.h"
+#include "progress.h"
 
 /* Sort out all the configuration loading from the cli and config file */
 static void config_load( int *argc, char ***argv );
 
-/* Read configuration from a file */
+/* Read the configuration for each of the targets from a file */
 static void config_file_load( const char* fname );
 
+/* Set up the targets for the given board type and firmware files, or
+ * for the boards in the given manifest */
+static void targets_new( const char *name, const char *manifest,
+			 char **fw, guint n_fw );
+
+/* Read the board settings for a target from the config file */
+static void config_board_load( GKeyFile *keyfile, msp430_board_t *board );
+
+/* Read the targets and their firmware from a manifest */
+static void manifest_load( const char* fname );
+
+/* Read a filename from the manifest, relative to the manifest's directory */
+static char* manifest_get_fname( GKeyFile *keyfile,
+				 const char *dir,
+				 const char *group,
+				 const char *key );
+
 /* Read a single byte value from a GKeyFile that's in hex.
  * Returns the value. */
 static unsigned long int key_file_get_hex( GKeyFile *key_file,
@@ -45,196 +74,1911 @@ static unsigned long int key_file_get_hex( GKeyFile *key_file,
 typedef struct {
 	uint8_t cmd;
 	char* conf_name;
+	/* Whether the command may be left out of the config file */
+	gboolean optional;
 } cmd_desc_t;
 
 cmd_desc_t cmds[] =
 {
-	{ CMD_FW_VER, "cmd_fw_ver" },
-	{ CMD_FW_CHUNK, "cmd_fw_chunk" },
-	{ CMD_FW_NEXT, "cmd_fw_next" },
-	{ CMD_FW_CRCR, "cmd_fw_crcr" },
-	{ CMD_FW_CONFIRM, "cmd_fw_confirm" }
+	{ CMD_FW_VER, "cmd_fw_ver", FALSE },
+	{ CMD_FW_CHUNK, "cmd_fw_chunk", FALSE },
+	{ CMD_FW_NEXT, "cmd_fw_next", FALSE },
+	{ CMD_FW_CRCR, "cmd_fw_crcr", FALSE },
+	{ CMD_FW_CONFIRM, "cmd_fw_confirm", FALSE },
+	{ CMD_FW_CAPS, "cmd_fw_caps", TRUE },
+	{ CMD_FW_ZCHUNK, "cmd_fw_zchunk", TRUE },
+	{ CMD_FW_GROUP, "cmd_fw_group", TRUE }
 };
 
 /* Returns the string for the given command number.
    Looks up the command number in the cmds table. */
 char* conf_get_cmd_str( uint8_t cmd );
 
+/* Returns whether the given command may be left out of the config */
+static gboolean conf_cmd_optional( uint8_t cmd );
+
 static char* config_fname = "flashb.config";
-static uint8_t board_type = 0;
 static char* dev_name = NULL;
-static char *elf_fname_b = NULL;
-static char *elf_fname_t = NULL;
+static char *manifest_fname = NULL;
+/* Bundle to write the firmware to */
+static char *compile_fname = NULL;
 static gboolean force_load = FALSE;
 static gint board_address = 0;
+static gboolean no_delta = FALSE;
+static gboolean plan_only = FALSE;
+static gboolean verify_only = FALSE;
+static gboolean flash_if_different = FALSE;
+static gboolean show_stats = FALSE;
+static char *stats_json_fname = NULL;
+static char *stats_prom_fname = NULL;
+/* Socket to take jobs from, when running as a daemon */
+static char *daemon_fname = NULL;
+/* Socket of the daemon to pass the job to */
+static char *socket_fname = NULL;
+static char **transport_specs = NULL;
+/* File to record every transaction in */
+static char *trace_fname = NULL;
+static gint ping_count = 0;
+static char *progress_name = NULL;
+static gboolean quiet = FALSE;
 
 static GOptionEntry entries[] =
 {
 	{ "config", 'c', 0, G_OPTION_ARG_FILENAME, &config_fname, "Config file path", "PATH" },
 	{ "name", 'n', 0, G_OPTION_ARG_STRING, &dev_name, "Slave device name in config file.", "NAME" },
+	{ "manifest", 'm', 0, G_OPTION_ARG_FILENAME, &manifest_fname, "Flash every type of board listed in a manifest", "PATH" },
 	{ "force", 'f', 0, G_OPTION_ARG_NONE, &force_load, "Force update, even if target has given version", NULL },
 	{ "address", 'a', 0, G_OPTION_ARG_INT, &board_address, "Only program board at address n", "n" },
+	{ "plan", 0, 0, G_OPTION_ARG_NONE, &plan_only, "Find out what needs flashing and how long it should take, without sending any firmware", NULL },
+	{ "verify", 0, 0, G_OPTION_ARG_NONE, &verify_only, "Check that each board is running the firmware given, by the CRC of its flash, without flashing anything", NULL },
+	{ "flash-if-different", 0, 0, G_OPTION_ARG_NONE, &flash_if_different, "Only flash boards whose flash doesn't match the firmware given, whatever version they report", NULL },
+	{ "no-delta", 0, 0, G_OPTION_ARG_NONE, &no_delta, "Send the whole image, even if the board has most of it already", NULL },
+	{ "cache", 0, 0, G_OPTION_ARG_FILENAME, &fw_cache_dir, "Directory to keep images flashed to each board in", "PATH" },
+	{ "compile", 0, 0, G_OPTION_ARG_FILENAME, &compile_fname, "Add the firmware for each board type to a bundle, then exit", "PATH" },
+	{ "journal", 0, 0, G_OPTION_ARG_FILENAME, &journal_fname, "File to record each board's progress in, so an interrupted run can be carried on", "PATH" },
+	{ "progress", 0, 0, G_OPTION_ARG_STRING, &progress_name, "How to show progress: bar (the default), json for one JSON object per line, or none", "MODE" },
+	{ "quiet", 'q', 0, G_OPTION_ARG_NONE, &quiet, "Print nothing", NULL },
+	{ "stats", 's', 0, G_OPTION_ARG_NONE, &show_stats, "Print timing and transaction statistics", NULL },
+	{ "stats-json", 0, 0, G_OPTION_ARG_FILENAME, &stats_json_fname, "Write statistics to a JSON file", "PATH" },
+	{ "stats-prom", 0, 0, G_OPTION_ARG_FILENAME, &stats_prom_fname, "Write statistics to a Prometheus textfile", "PATH" },
+	{ "transport", 't', 0, G_OPTION_ARG_STRING_ARRAY, &transport_specs, "How to reach the boards: sricd (the default), or i2c:DEV:ADDR=TYPE,... to go straight to an i2c-dev device.  Give it more than once to flash several buses at once", "SPEC" },
+	{ "trace", 0, 0, G_OPTION_ARG_FILENAME, &trace_fname, "Record every transaction in a binary trace at PATH, which flashb-bench --replay reads", "PATH" },
+	{ "ping", 0, 0, G_OPTION_ARG_INT, &ping_count, "Time n reads of each board's firmware version, then exit", "n" },
+	{ "daemon", 0, 0, G_OPTION_ARG_FILENAME, &daemon_fname, "Keep running, taking jobs from a socket at PATH", "PATH" },
+	{ "socket", 0, 0, G_OPTION_ARG_FILENAME, &socket_fname, "Pass the job to the daemon listening at PATH", "PATH" },
 	{ NULL }
 };
 
 struct elf_file_t {
 	elf_section_t *text, *vectors;
+	/* CRC of the text section, before padding */
+	uint16_t text_crc;
 };
 
+/* A type of board to flash, and the firmware to flash it with */
+struct target_t {
+	msp430_board_t board;
+
+	/* Where the firmware comes from: either a pair of ELF files,
+	   or a bundle */
+	char *elf_fname_b, *elf_fname_t;
+	char *bundle_fname;
+
+	struct elf_file_t bottom, top;
+};
+
+/* The types of board being flashed */
+static GArray *targets = NULL;
+
+/* Returns the target for the given board type, or NULL if that type
+   isn't being flashed */
+static struct target_t* find_target( uint8_t type );
+
+/* Returns the target for the given section of the config file, or NULL */
+static struct target_t* find_target_by_name( const char *name );
+
+/* A bus that boards are flashed on.  Each bus is flashed by its own
+   thread when there's more than one. */
+struct bus_t {
+	/* What was given to --transport, and the transport it opened */
+	const char *spec;
+	transport_t *ctx;
+	/* Position in the list of buses, which tells its boards apart
+	   from those on other buses in the cache and journal */
+	uint8_t index;
+
+	GThread *thread;
+	/* Set whilst its thread is running */
+	gint running;
+	/* How far through its boards it is, for the progress bar */
+	gint percent;
+	/* TRUE if every board on it ended up running the new firmware */
+	gboolean ok;
+};
+
+/* The buses being flashed */
+static GArray *buses = NULL;
+
+/* The bus the current thread is flashing, when there's more than one */
+static GPrivate current_bus = G_PRIVATE_INIT( NULL );
+
+/* Open a transport for each bus.
+ * Returns FALSE if any of them couldn't be opened. */
+static gboolean buses_open( void );
+
+/* Close the transports of all the buses */
+static void buses_close( void );
+
+/* Load the target's firmware from its bundle, or the cached bundle made
+ * from its ELF files, making one if there isn't one. */
+static void load_firmware( struct target_t *target );
+
 /* Open the two ELF files and work out which is top and which is bottom.
  * Returns the two files in *bottom and *top. */
 static void load_elfs( char* fna, char* fnb,
 		       struct elf_file_t *bottom,
 		       struct elf_file_t *top );
 
+/* Write the target's firmware to a bundle.
+ * Returns FALSE if it couldn't be written. */
+static gboolean write_bundle( const char *fname, struct target_t *target );
+
 /* Get the version number of the given ELF file */
 static uint16_t elf_fw_version( struct elf_file_t *e );
 
-/* Program the given device after making a few sanity checks.
- * Returns TRUE when flashing succeeded */
-static gboolean flash_board( const sric_context ctx,
-                             const sric_device *device,
+
+/* A board being flashed */
+struct flash_job_t {
+	struct bus_t *bus;
+	const sric_device *device;
+	struct target_t *target;
+	/* The half of the firmware being sent */
+	struct elf_file_t *elf;
+	msp430_xfer_t xfer;
+	/* The image the device already has in flash, or NULL */
+	elf_section_t *old;
+	/* Number of times the firmware has been sent */
+	uint8_t attempts;
+	/* Number of times the board has stopped answering */
+	uint8_t stalls;
+	/* Time the board took to answer the pre-flight probe, and the
+	   transfer time estimated from it */
+	gint64 rtt_us;
+	gint64 estimate_us;
+	/* Progress through the section being sent */
+	progress_t progress;
+
+	enum {
+		JOB_TEXT,
+		JOB_VECTORS,
+		JOB_DONE,
+		/* The CRC never matched */
+		JOB_FAILED,
+		/* The board didn't come back with the new firmware */
+		JOB_NOT_SWITCHED,
+		/* The board stopped answering */
+		JOB_NO_ANSWER
+	} stage;
+};
+
+/* What the pre-flight found out about a board */
+typedef enum {
+	/* It's been queued to be flashed */
+	PROBE_FLASH = 0,
+	/* It's already running the firmware */
+	PROBE_CURRENT,
+	/* It didn't answer */
+	PROBE_DEAD,
+	/* It's not one of the boards being flashed */
+	PROBE_IGNORED,
+
+	PROBE_NUM
+} probe_result_t;
+
+/* What was found in the half of flash a board is running from */
+typedef enum {
+	RUNNING_MATCHES,
+	RUNNING_DIFFERS,
+	/* The bootloader can't report the CRC of its flash */
+	RUNNING_UNKNOWN,
+
+	RUNNING_NUM
+} running_t;
+
+/* Returns the target the given device is to be flashed with, or NULL if
+ * it's being left alone */
+static struct target_t* device_target( const sric_device *device );
+
+/* Find out what the given device needs and queue a job to flash it */
+static probe_result_t probe_board( struct bus_t *bus,
+				   const sric_device *device,
+				   GArray *jobs );
+
+/* Read the capabilities of the job's bootloader, and set up its transfer
+ * with the chunk size to use with it */
+static void probe_caps( transport_t *ctx, struct flash_job_t *job );
+
+/* Carry on with a job that an earlier run recorded in the journal, if the
+ * device is still part way through receiving the same image.
+ * Returns TRUE if it can be. */
+static gboolean resume_board( transport_t *ctx,
+			      struct flash_job_t *job,
+			      const journal_entry_t *entry );
+
+/* Set up a job to program the given device after making a few sanity checks.
+ * Unless force is set, a device that already has the image's version is
+ * left alone.
+ * Returns TRUE if the device needs flashing */
+static gboolean flash_board( transport_t *ctx,
+                             struct flash_job_t *job,
                              struct elf_file_t *elf,
-                             const uint16_t fw );
+                             const uint16_t fw,
+                             gboolean force );
+
+/* Compare the half of flash the device is running from with the image for
+ * that half, which is put in *elf.  next is the address the device asked
+ * for after its firmware version was read, so is the start of the other
+ * half. */
+static running_t check_running( transport_t *ctx,
+				struct flash_job_t *job,
+				uint16_t next,
+				struct elf_file_t **elf );
+
+/* Fill in the parts of a job common to new and resumed ones */
+static void job_init( struct flash_job_t *job,
+		      struct bus_t *bus,
+		      const sric_device *device,
+		      struct target_t *target );
+
+/* Record the job's progress in the journal */
+static void job_journal( struct flash_job_t *job );
+
+/* Estimate how long the job's transfer will take, in microseconds,
+ * from how long the board took to answer the pre-flight probe */
+static gint64 job_estimate( const struct flash_job_t *job );
+
+/* Orders jobs with the longest estimated transfer first */
+static gint job_cmp_estimate( gconstpointer a, gconstpointer b );
+
+/* Print what's going to be flashed, and how long it should take */
+static void plan_print( GArray *jobs, const guint *counts );
+
+/* Send the text to boards that are getting the same image all at once,
+ * through a group address, then set each job up to send only the chunks
+ * its board missed. */
+static void multicast_jobs( struct bus_t *bus, GArray *jobs );
+
+/* Returns TRUE if the job's image can be sent through a group address */
+static gboolean job_can_multicast( const struct flash_job_t *job );
+
+/* Start sending the job's text again from the beginning, against the
+ * given image of what the board already holds, which may be NULL.
+ * Takes ownership of known. */
+static void job_restart( transport_t *ctx, struct flash_job_t *job,
+			 elf_section_t *known );
+
+/* Flash all the given boards at once.
+ * A window of chunks is sent to each board in turn, so that one board
+ * writes its flash whilst the next one is receiving data.
+ * Returns TRUE if every board ended up running the new firmware. */
+static gboolean flash_boards( struct bus_t *bus, GArray *jobs );
+
+/* Check that the CRC the device has calculated matches the image.
+ * Returns TRUE if it does. */
+static gboolean verify_board( transport_t *ctx, struct flash_job_t *job );
+
+/* Find out whether the image we last flashed into the half of the device
+ * that's going to be written is still there.
+ * Returns the image if it is, otherwise NULL. */
+static elf_section_t* find_old_image( transport_t *ctx,
+				      struct flash_job_t *job,
+				      uint32_t addr );
+
+/* Start following the progress of the section the job is sending */
+static void job_progress_start( struct flash_job_t *job );
+
+/* Show the progress of each of the jobs on the bus, on one line for
+ * the bar.  With several buses the bar shows how far each bus has got
+ * instead, and is drawn by buses_progress. */
+static void jobs_progress( struct bus_t *bus, GArray *jobs );
+
+/* Draw the progress bar for several buses */
+static void buses_progress( void );
+
+/* Send what's printed to where the progress mode wants it */
+static void output_setup( void );
+
+/* Find and flash all the boards of the types being flashed, on every
+ * bus at once.
+ * Returns the exit status. */
+static int flash_run( void );
+
+/* Find and flash all the boards on one bus.
+ * Returns TRUE if every board found ended up running the new firmware. */
+static gboolean flash_bus( struct bus_t *bus );
+
+/* Check that every board on the bus is running the firmware given,
+ * without flashing any of them.
+ * Returns TRUE if they all are. */
+static gboolean verify_bus( struct bus_t *bus );
+
+/* Runs flash_bus in a thread of its own */
+static gpointer flash_bus_thread( gpointer data );
+
+/* Read the firmware version of each board of the types given
+ * ping_count times, and print how long it took.
+ * Returns the exit status. */
+static int ping_run( void );
+
+/* Ping the boards on one bus */
+static void ping_bus( transport_t *ctx );
+
+/* Print and write out the statistics, as asked for */
+static void stats_output( void );
+
+/* Take jobs from the daemon socket, one at a time, until something
+ * goes badly wrong.
+ * Returns the exit status. */
+static int daemon_run( void );
+
+/* Run a job sent to the daemon, with its output going to the client.
+ * Returns the exit status. */
+static int daemon_job( const job_request_t *req );
+
+/* Pass the job given on the command line to the daemon, and print what
+ * it sends back.
+ * Returns the job's exit status. */
+static int client_run( int argc, char **argv );
+
+/* Returns a newly allocated absolute version of the given path */
+static char* absolute_fname( const char *fname );
 
 int main( int argc, char** argv )
 {
-	sric_context ctx;
-	uint16_t fw, next;
-	struct elf_file_t ef_top, ef_bottom;
-	struct elf_file_t *tos;
+	gint64 t, now;
+	int status;
+	guint i;
 
 	config_load( &argc, &argv );
 
-	ctx = sric_init();
-	if (sric_get_error(ctx) & SRIC_ERROR_SRICD) {
-		g_print("Failed to connect to sricd.\n");
+	if( socket_fname != NULL )
+		return client_run( argc, argv );
+
+	if( compile_fname != NULL ) {
+		for( i=0; i<targets->len; i++ ) {
+			struct target_t *target = &g_array_index( targets, struct target_t, i );
+
+			load_firmware( target );
+
+			if( !write_bundle( compile_fname, target ) ) {
+				g_print( "Failed to write bundle '%s'\n", compile_fname );
+				return 1;
+			}
+
+			g_print( "Added firmware version %hu for %s boards to '%s'\n",
+				 elf_fw_version( &target->bottom ), target->board.name,
+				 compile_fname );
+		}
 		return 0;
 	}
 
-	/* Load and sort the ELF files */
-	load_elfs( elf_fname_b, elf_fname_t, &ef_bottom, &ef_top );
+	t = g_get_monotonic_time();
+	if( !buses_open() )
+		return 1;
+	now = g_get_monotonic_time();
+	stats_phase_add( STATS_PHASE_CONNECT, now - t );
+	t = now;
+
+	if( ping_count > 0 ) {
+		status = ping_run();
+		buses_close();
+		return status;
+	}
+
+	/* Load and sort the firmware */
+	for( i=0; i<targets->len; i++ )
+		load_firmware( &g_array_index( targets, struct target_t, i ) );
+	now = g_get_monotonic_time();
+	stats_phase_add( STATS_PHASE_LOAD, now - t );
+
+	if( daemon_fname != NULL )
+		return daemon_run();
+
+	status = flash_run();
+	buses_close();
+
+	return status;
+}
+
+static gboolean buses_open( void )
+{
+	char *sricd[] = { "sricd", NULL };
+	char **spec = transport_specs != NULL ? transport_specs : sricd;
+
+	buses = g_array_new( FALSE, TRUE, sizeof(struct bus_t) );
+
+	if( trace_fname != NULL && !trace_open( trace_fname ) ) {
+		buses_close();
+		return FALSE;
+	}
+
+	for( ; *spec != NULL; spec++ ) {
+		struct bus_t bus;
+
+		if( buses->len > G_MAXUINT8 ) {
+			g_print( "Error: Too many buses\n" );
+			buses_close();
+			return FALSE;
+		}
+
+		memset( &bus, 0, sizeof(bus) );
+		bus.spec = *spec;
+		bus.index = buses->len;
+		bus.ctx = transport_open( *spec );
+		if( bus.ctx == NULL ) {
+			buses_close();
+			return FALSE;
+		}
+		if( trace_fname != NULL )
+			bus.ctx = trace_transport( bus.ctx, bus.index );
+
+		g_array_append_val( buses, bus );
+	}
+
+	return TRUE;
+}
+
+static void buses_close( void )
+{
+	guint i;
+
+	for( i=0; i<buses->len; i++ ) {
+		struct bus_t *bus = &g_array_index( buses, struct bus_t, i );
+
+		bus->ctx->close( bus->ctx );
+	}
+
+	g_array_free( buses, TRUE );
+	buses = NULL;
+	trace_close();
+}
+
+static int flash_run( void )
+{
+	gint64 shown = 0;
+	gboolean ok = TRUE;
+	guint i, running;
+
+	journal_load();
+
+	if( buses->len == 1 )
+		ok = flash_bus( &g_array_index( buses, struct bus_t, 0 ) );
+	else {
+		/* The firmware is shared between the threads, which only
+		   read it */
+		for( i=0; i<buses->len; i++ ) {
+			struct bus_t *bus = &g_array_index( buses, struct bus_t, i );
+
+			bus->running = 1;
+			bus->percent = 0;
+			bus->thread = g_thread_new( bus->spec, flash_bus_thread, bus );
+		}
 
+		/* The bar is drawn from here, off the buses' threads */
+		do {
+			g_usleep( PROGRESS_INTERVAL / 4 );
+
+			running = 0;
+			for( i=0; i<buses->len; i++ )
+				running += g_atomic_int_get( &g_array_index( buses, struct bus_t, i ).running );
+
+			if( progress_mode == PROGRESS_BAR && progress_due( &shown ) )
+				buses_progress();
+		} while( running > 0 );
+
+		if( progress_mode == PROGRESS_BAR ) {
+			buses_progress();
+			progress_end();
+		}
+
+		for( i=0; i<buses->len; i++ ) {
+			struct bus_t *bus = &g_array_index( buses, struct bus_t, i );
+
+			g_thread_join( bus->thread );
+			ok = ok && bus->ok;
+		}
+	}
+
+	/* Nothing left to carry on with on any of the buses */
+	if( ok && !plan_only && !verify_only )
+		journal_clear();
+
+	stats_output();
+	return ok ? 0 : 1;
+}
+
+static gpointer flash_bus_thread( gpointer data )
+{
+	struct bus_t *bus = data;
+
+	g_private_set( &current_bus, bus );
+	bus->ok = flash_bus( bus );
+	g_atomic_int_set( &bus->running, 0 );
+
+	return NULL;
+}
+
+static gboolean flash_bus( struct bus_t *bus )
+{
+	transport_t *ctx = bus->ctx;
+	GArray *jobs;
+	gint64 t, now;
+	gboolean ok;
+	guint counts[PROBE_NUM] = { 0 };
+	guint i;
+
+	if( verify_only )
+		return verify_bus( bus );
+
+	t = g_get_monotonic_time();
+
+	jobs = g_array_new( FALSE, FALSE, sizeof(struct flash_job_t) );
+
+	/* Every type of board is found in one pass over the bus */
 	const sric_device* device = NULL;
-	/* Used to keep count of the index of the current board type */
-	while((device = sric_enumerate_devices(ctx, device))) {
+	while((device = ctx->enumerate(ctx, device))) {
+		now = g_get_monotonic_time();
+		stats_phase_add( STATS_PHASE_ENUMERATE, now - t );
+		t = now;
+
+		counts[ probe_board( bus, device, jobs ) ]++;
+
+		now = g_get_monotonic_time();
+		stats_phase_add( STATS_PHASE_PROBE, now - t );
+		t = now;
+	}
+	stats_phase_add( STATS_PHASE_ENUMERATE, g_get_monotonic_time() - t );
+
+	for( i=0; i<jobs->len; i++ ) {
+		struct flash_job_t *job = &g_array_index( jobs, struct flash_job_t, i );
+
+		job->estimate_us = job_estimate( job );
+	}
+
+	/* Each round gives every board a window in turn.  The longest
+	   transfer decides when the run ends, so it goes first. */
+	g_array_sort( jobs, job_cmp_estimate );
+	plan_print( jobs, counts );
+
+	if( plan_only ) {
+		for( i=0; i<jobs->len; i++ )
+			fw_cache_free( g_array_index( jobs, struct flash_job_t, i ).old );
+		g_array_free( jobs, TRUE );
+		return TRUE;
+	}
+
+	if( jobs->len > 0 && !journal_save() )
+		g_print( "Failed to write journal\n" );
+
+	multicast_jobs( bus, jobs );
+	ok = flash_boards( bus, jobs );
+	g_array_free( jobs, TRUE );
+
+	return ok;
+}
+
+static gboolean verify_bus( struct bus_t *bus )
+{
+	transport_t *ctx = bus->ctx;
+	const sric_device *device = NULL;
+	guint counts[RUNNING_NUM] = { 0 };
+	guint dead = 0;
+	gint64 start = g_get_monotonic_time();
+
+	while((device = ctx->enumerate(ctx, device))) {
+		struct target_t *target;
+		const msp430_board_t *board;
+		struct flash_job_t job;
+		struct elf_file_t *elf;
+		uint16_t fw, next;
+		running_t running;
+
 		g_print("Address: %i\tType: %i\n", device->address, device->type);
 
-		if (board_address != 0) {
-			if (board_address != device->address)
+		target = device_target( device );
+		if( target == NULL )
+			continue;
+		board = &target->board;
+
+		job_init( &job, bus, device, target );
+
+		if( !msp430_probe( ctx, board, device ) ) {
+			g_print( "'%s[%i]' not answering\n", board->name, device->address );
+			dead++;
+			continue;
+		}
+		probe_caps( ctx, &job );
+
+		/* Reading the version leaves the board asking for the
+		   start of the half it isn't running from */
+		if( !msp430_get_fw_version( ctx, board, device, &fw )
+		    || !msp430_get_next_address( ctx, board, device, job.xfer.caps, &next ) ) {
+			g_print( "'%s[%i]' not answering\n", board->name, device->address );
+			dead++;
+			continue;
+		}
+		if( next != board->bottom && next != board->top )
+			g_error( "MSP430 is requesting unexpected address: 0x%4.4hx", next );
+
+		running = check_running( ctx, &job, next, &elf );
+		counts[running]++;
+
+		switch( running ) {
+		case RUNNING_MATCHES:
+			g_print( "'%s[%i]' is running version %hu, matching the firmware given\n",
+				 board->name, device->address, fw );
+			break;
+		case RUNNING_DIFFERS:
+			g_print( "'%s[%i]' reports version %hu, but its flash doesn't match version %hu\n",
+				 board->name, device->address, fw, elf_fw_version( elf ) );
+			break;
+		default:
+			g_print( "'%s[%i]' reports version %hu, but can't report the CRC of its flash\n",
+				 board->name, device->address, fw );
+			break;
+		}
+	}
+	stats_phase_add( STATS_PHASE_VERIFY, g_get_monotonic_time() - start );
+
+	g_print( "Verify: %u match, %u differ, %u couldn't be checked, %u not answering\n",
+		 counts[RUNNING_MATCHES], counts[RUNNING_DIFFERS],
+		 counts[RUNNING_UNKNOWN], dead );
+
+	return counts[RUNNING_DIFFERS] == 0 && counts[RUNNING_UNKNOWN] == 0
+		&& dead == 0;
+}
+
+static int ping_run( void )
+{
+	guint i;
+
+	for( i=0; i<buses->len; i++ ) {
+		struct bus_t *bus = &g_array_index( buses, struct bus_t, i );
+
+		if( buses->len > 1 )
+			g_print( "Bus '%s':\n", bus->spec );
+		ping_bus( bus->ctx );
+	}
+
+	stats_output();
+	return 0;
+}
+
+static void ping_bus( transport_t *ctx )
+{
+	const sric_device *device = NULL;
+
+	while((device = ctx->enumerate(ctx, device))) {
+		struct target_t *target = find_target( device->type );
+		gint64 start, us, min_us = G_MAXINT64, max_us = 0, total_us = 0;
+		guint i, answered = 0;
+		uint16_t fw;
+
+		if( target == NULL
+		    || (board_address != 0 && board_address != device->address) )
+			continue;
+
+		for( i=0; i<(guint)ping_count; i++ ) {
+			start = g_get_monotonic_time();
+			if( !msp430_get_fw_version( ctx, &target->board, device, &fw ) )
 				continue;
-			else if (board_type != device->type)
-				g_error("Board at address %i is not the correct type", board_address);
-		} else if (device->type != board_type)
+			us = g_get_monotonic_time() - start;
+
+			answered++;
+			total_us += us;
+			min_us = MIN( min_us, us );
+			max_us = MAX( max_us, us );
+		}
+
+		if( answered == 0 ) {
+			g_print( "'%s[%i]' not answering\n",
+				 target->board.name, device->address );
 			continue;
+		}
 
-		/* Get the firmware version.
-		   The MSP430 resets its firmware reception code upon receiving this. */
-		if( !msp430_get_fw_version( ctx, device, &fw ) ) {
-			g_print( "'%s[%i]' not answering\n", dev_name, device->address );
-			return FALSE;
+		g_print( "'%s[%i]' answered %u of %i: %.3f ms mean, %.3f ms min, %.3f ms max\n",
+			 target->board.name, device->address, answered, ping_count,
+			 total_us / 1000.0 / answered, min_us / 1000.0, max_us / 1000.0 );
+	}
+}
+
+static void stats_output( void )
+{
+	/* Only progress goes to stdout in JSON mode */
+	if( show_stats && !quiet )
+		stats_print( progress_mode == PROGRESS_JSON ? stderr : stdout );
+	if( stats_json_fname != NULL && !stats_write_json( stats_json_fname ) )
+		g_print( "Failed to write statistics to '%s'\n", stats_json_fname );
+	if( stats_prom_fname != NULL && !stats_write_prom( stats_prom_fname ) )
+		g_print( "Failed to write statistics to '%s'\n", stats_prom_fname );
+}
+
+static int daemon_run( void )
+{
+	int sock;
+
+	sock = job_socket_listen( daemon_fname );
+	if( sock < 0 ) {
+		g_print( "Failed to listen on '%s': %s\n", daemon_fname, strerror(errno) );
+		return 1;
+	}
+
+	/* A client going away mustn't stop its job part way through */
+	signal( SIGPIPE, SIG_IGN );
+
+	g_print( "Waiting for jobs on '%s'\n", daemon_fname );
+
+	while( 1 ) {
+		job_request_t req;
+		int fd, status, wstatus;
+		pid_t pid;
+
+		fd = accept( sock, NULL, NULL );
+		if( fd < 0 ) {
+			if( errno == EINTR )
+				continue;
+			g_print( "Failed to accept job: %s\n", strerror(errno) );
+			break;
 		}
 
-		/* Find out which ELF file to send (top or bottom) */
-		next = msp430_get_next_address( ctx, device );
-		if( next == msp430_fw_bottom ) {
-			g_print("Sending bottom half\n");
-			tos = &ef_bottom;
+		if( !job_request_read( fd, &req ) ) {
+			close( fd );
+			continue;
 		}
-		else if( next == msp430_fw_top ) {
-			g_print("Sending top half\n");
-			tos = &ef_top;
+
+		/* Each job is run by a child, so that one that hits an error
+		   can't take the daemon down with it, and everything it
+		   loads and changes is thrown away afterwards.  Only one runs
+		   at a time, as they all share the bus. */
+		fflush( stdout );
+		pid = fork();
+		if( pid == 0 ) {
+			close( sock );
+			dup2( fd, STDOUT_FILENO );
+			dup2( fd, STDERR_FILENO );
+			close( fd );
+			setvbuf( stdout, NULL, _IOLBF, 0 );
+
+			status = daemon_job( &req );
+			fflush( stdout );
+			_exit( status );
 		}
-		else
-			g_error( "MSP430 is requesting unexpected address: 0x%4.4hx", next );
+		job_request_free( &req );
+
+		status = 1;
+		if( pid < 0 )
+			g_print( "Failed to start job: %s\n", strerror(errno) );
+		else {
+			while( waitpid( pid, &wstatus, 0 ) < 0 && errno == EINTR );
+
+			if( WIFEXITED(wstatus) )
+				status = WEXITSTATUS(wstatus);
+			else {
+				/* It may have died part way through a transaction */
+				g_print( "Job died, reconnecting\n" );
+				buses_close();
+				if( !buses_open() ) {
+					job_status_write( fd, status );
+					close( fd );
+					close( sock );
+					return 1;
+				}
+			}
+		}
+
+		job_status_write( fd, status );
+		close( fd );
+	}
 
-		if( elf_fw_version( &ef_bottom ) != elf_fw_version( &ef_top ) )
-			g_error( "Supplied ELF files have different version numbers" );
+	close( sock );
+	buses_close();
+	return 1;
+}
 
-		flash_board(ctx, device, tos, fw);
+static int daemon_job( const job_request_t *req )
+{
+	gint64 t;
+	guint i;
+
+	force_load = req->force;
+	no_delta = req->no_delta;
+	plan_only = req->plan;
+	verify_only = req->verify;
+	flash_if_different = req->flash_if_different;
+	show_stats = req->stats;
+	board_address = req->address;
+	quiet = req->quiet;
+	progress_mode = req->progress;
+	output_setup();
+
+	/* Only what this job does gets reported */
+	stats_reset();
+
+	if( req->name != NULL || req->manifest != NULL ) {
+		if( req->manifest != NULL && (req->name != NULL || req->n_fw > 0) ) {
+			g_print( "Error: Boards and firmware come from the manifest.\n" );
+			return 1;
+		}
+		if( req->manifest == NULL && req->n_fw == 0 ) {
+			g_print( "Error: Two ELF files or a bundle required.\n" );
+			return 1;
+		}
+
+		t = g_get_monotonic_time();
+		targets_new( req->name, req->manifest, (char**)req->fw, req->n_fw );
+		config_file_load( config_fname );
+
+		for( i=0; i<targets->len; i++ )
+			load_firmware( &g_array_index( targets, struct target_t, i ) );
+		stats_phase_add( STATS_PHASE_LOAD, g_get_monotonic_time() - t );
+	} else if( targets->len == 0 ) {
+		g_print( "Error: No firmware given, and the daemon wasn't started with any.\n" );
+		return 1;
 	}
 
-	sric_quit(ctx);
+	return flash_run();
+}
 
-	return 0;
+static int client_run( int argc, char **argv )
+{
+	job_request_t req;
+	int fd, status;
+	guint i;
+
+	memset( &req, 0, sizeof(req) );
+	req.name = dev_name;
+	if( manifest_fname != NULL )
+		req.manifest = absolute_fname( manifest_fname );
+	/* The daemon may not be running in the same directory */
+	for( i=1; i<(guint)argc; i++ )
+		req.fw[req.n_fw++] = absolute_fname( argv[i] );
+	req.force = force_load;
+	req.no_delta = no_delta;
+	req.plan = plan_only;
+	req.verify = verify_only;
+	req.flash_if_different = flash_if_different;
+	req.stats = show_stats;
+	req.quiet = quiet;
+	req.progress = progress_mode;
+	req.address = board_address;
+
+	fd = job_socket_connect( socket_fname );
+	if( fd < 0 ) {
+		g_print( "Failed to connect to flashb daemon at '%s': %s\n",
+			 socket_fname, strerror(errno) );
+		return 1;
+	}
+
+	if( !job_request_write( fd, &req ) ) {
+		g_print( "Failed to send job to flashb daemon\n" );
+		close( fd );
+		return 1;
+	}
+	shutdown( fd, SHUT_WR );
+
+	status = job_output_relay( fd, STDOUT_FILENO );
+	if( status < 0 ) {
+		g_print( "\nLost the flashb daemon part way through the job\n" );
+		status = 1;
+	}
+
+	close( fd );
+	return status;
+}
+
+static char* absolute_fname( const char *fname )
+{
+	gchar *cwd, *abs;
+
+	if( g_path_is_absolute( fname ) )
+		return g_strdup( fname );
+
+	cwd = g_get_current_dir();
+	abs = g_build_filename( cwd, fname, NULL );
+	g_free( cwd );
+	return abs;
+}
+
+static probe_result_t probe_board( struct bus_t *bus,
+				   const sric_device *device,
+				   GArray *jobs )
+{
+	transport_t *ctx = bus->ctx;
+	uint16_t fw, next;
+	struct target_t *target;
+	struct elf_file_t *tos;
+	struct flash_job_t job;
+	const msp430_board_t *board;
+	journal_entry_t entry;
+	gboolean journalled, differs = FALSE;
+	gint64 start;
+
+	g_print("Address: %i\tType: %i\n", device->address, device->type);
+
+	target = device_target( device );
+	if( target == NULL )
+		return PROBE_IGNORED;
+	board = &target->board;
+
+	job_init( &job, bus, device, target );
+
+	/* A board that isn't there is left out, rather than holding up
+	   the rest */
+	start = g_get_monotonic_time();
+	if( !msp430_probe( ctx, board, device ) ) {
+		g_print( "'%s[%i]' not answering, leaving it out\n", board->name, device->address );
+		return PROBE_DEAD;
+	}
+	job.rtt_us = g_get_monotonic_time() - start;
+
+	probe_caps( ctx, &job );
+
+	/* Carry on from where an earlier run got to.  This must happen
+	   before the firmware version is read. */
+	journalled = journal_find( bus->index, board->type, device->address, &entry );
+	if( journalled && !entry.done && resume_board( ctx, &job, &entry ) ) {
+		g_array_append_val( jobs, job );
+		return PROBE_FLASH;
+	}
+
+	/* Get the firmware version.
+	   The MSP430 resets its firmware reception code upon receiving this. */
+	if( !msp430_get_fw_version( ctx, board, device, &fw ) ) {
+		g_print( "'%s[%i]' not answering, leaving it out\n", board->name, device->address );
+		return PROBE_DEAD;
+	}
+
+	/* Find out which ELF file to send (top or bottom) */
+	if( !msp430_get_next_address( ctx, board, device, job.xfer.caps, &next ) ) {
+		g_print( "'%s[%i]' not answering, leaving it out\n", board->name, device->address );
+		return PROBE_DEAD;
+	}
+
+	if( next == board->bottom ) {
+		g_print("Sending bottom half\n");
+		tos = &target->bottom;
+	}
+	else if( next == board->top ) {
+		g_print("Sending top half\n");
+		tos = &target->top;
+	}
+	else
+		g_error( "MSP430 is requesting unexpected address: 0x%4.4hx", next );
+
+	/* Go by what's in the flash rather than the version it reports */
+	if( flash_if_different ) {
+		struct elf_file_t *running;
+
+		switch( check_running( ctx, &job, next, &running ) ) {
+		case RUNNING_MATCHES:
+			g_print( "'%s[%i]' already has version %hu in its flash\n",
+				 board->name, device->address, elf_fw_version( running ) );
+			return PROBE_CURRENT;
+		case RUNNING_DIFFERS:
+			differs = TRUE;
+			break;
+		default:
+			g_print( "'%s[%i]' can't report the CRC of its flash, going by its version\n",
+				 board->name, device->address );
+			break;
+		}
+	}
+
+	if( !flash_board(ctx, &job, tos, fw, force_load || differs) )
+		return PROBE_CURRENT;
+
+	g_array_append_val( jobs, job );
+	if( !plan_only )
+		job_journal( &job );
+	return PROBE_FLASH;
+}
+
+static struct target_t* device_target( const sric_device *device )
+{
+	struct target_t *target = find_target( device->type );
+
+	if (board_address != 0) {
+		if (board_address != device->address)
+			return NULL;
+		else if (target == NULL)
+			g_error("Board at address %i is not the correct type", board_address);
+	}
+
+	return target;
 }
 
-static gboolean flash_board( const sric_context ctx,
-                             const sric_device *device,
+static running_t check_running( transport_t *ctx,
+				struct flash_job_t *job,
+				uint16_t next,
+				struct elf_file_t **elf )
+{
+	const msp430_board_t *board = &job->target->board;
+	const elf_section_t *text;
+	uint16_t crc;
+
+	/* The half that's going to be written is the one not running */
+	*elf = next == board->bottom ? &job->target->top : &job->target->bottom;
+	text = (*elf)->text;
+
+	if( !(job->xfer.caps & MSP430_CAP_CRC_RANGE) || text->len > 0xffff
+	    || !msp430_get_crc_range( ctx, board, job->device, text->addr, text->len, &crc ) )
+		return RUNNING_UNKNOWN;
+
+	return crc == (*elf)->text_crc ? RUNNING_MATCHES : RUNNING_DIFFERS;
+}
+
+static void probe_caps( transport_t *ctx, struct flash_job_t *job )
+{
+	const msp430_board_t *board = &job->target->board;
+	uint16_t caps, max_chunk, chunk_size;
+	uint8_t max_zchunks;
+
+	/* Find out what the bootloader supports */
+	caps = msp430_get_caps( ctx, board, job->device, &max_chunk, &max_zchunks );
+
+	chunk_size = board->chunk_size;
+	while( chunk_size > max_chunk )
+		chunk_size >>= 1;
+	if( chunk_size != board->chunk_size )
+		g_print( "'%s[%i]' only accepts chunks of up to %hu bytes, using %hu\n",
+			 board->name, job->device->address, max_chunk, chunk_size );
+
+	msp430_xfer_init( &job->xfer, board, job->device, caps, chunk_size, max_zchunks );
+}
+
+static gboolean resume_board( transport_t *ctx,
+			      struct flash_job_t *job,
+			      const journal_entry_t *entry )
+{
+	struct target_t *target = job->target;
+	struct elf_file_t *tos;
+	uint16_t next;
+	uint32_t end;
+
+	if( entry->addr == target->bottom.text->addr )
+		tos = &target->bottom;
+	else if( entry->addr == target->top.text->addr )
+		tos = &target->top;
+	else
+		return FALSE;
+
+	/* Must be the same image, sent in the same size chunks */
+	if( entry->version != elf_fw_version( tos )
+	    || entry->crc != tos->text_crc
+	    || entry->chunk_size != job->xfer.chunk_size )
+		return FALSE;
+
+	/* The device has to be part way through the text section.
+	   Anything else is started again from scratch. */
+	end = tos->text->addr + tos->text->len;
+	if( !msp430_get_next_address( ctx, &target->board, job->device,
+				      job->xfer.caps, &next )
+	    || next <= tos->text->addr || next >= end
+	    || next % job->xfer.chunk_size != 0 )
+		return FALSE;
+
+	g_print( "Carrying on sending firmware version %hu to '%s[%i]' from %4.4hx\n",
+		entry->version, target->board.name, job->device->address, next );
+	stats_count( STATS_RESUME );
+
+	job->elf = tos;
+	msp430_xfer_resume_section( &job->xfer, tos->text, next );
+
+	return TRUE;
+}
+
+static gboolean flash_board( transport_t *ctx,
+                             struct flash_job_t *job,
                              struct elf_file_t *elf,
-                             const uint16_t fw) {
+                             const uint16_t fw,
+                             gboolean force ) {
 
+		const sric_device *device = job->device;
+		const char *name = job->target->board.name;
 
-		printf( "Existing firmware version on '%s[%i]': %hx\n", dev_name, device->address, fw );
+		g_print( "Existing firmware version on '%s[%i]': %hx\n", name, device->address, fw );
 
 		if( elf->vectors->len != 32 ) {
 			g_print( ".vectors section incorrect length: %u should be 32", elf->vectors->len );
 			return FALSE;
 		}
 
-		if( !force_load && fw == elf_fw_version( elf ) ) {
+		if( !force && fw == elf_fw_version( elf ) ) {
 			g_print( "No update required\n" );
 			return FALSE;
 		}
 
-		printf("Sending firmware version %hu to '%s[%i]'\n", elf_fw_version(elf), dev_name, device->address);
+		g_print( "Sending firmware version %hu to '%s[%i]'\n", elf_fw_version(elf), name, device->address );
 
-		msp430_send_section( ctx, device, elf->text, TRUE );
-		msp430_send_section( ctx, device, elf->vectors, FALSE );
-		printf( "Confirming CRC\n" );
-		msp430_confirm_crc( ctx, device );
+		job->elf = elf;
+
+		/* A plan only probes, so it counts every chunk rather than
+		   asking what the board already holds */
+		if( plan_only ) {
+			msp430_xfer_resume_section( &job->xfer, elf->text, elf->text->addr );
+			return TRUE;
+		}
+
+		if( !no_delta )
+			job->old = find_old_image( ctx, job, elf->text->addr );
+		job->xfer.old = job->old;
+
+		msp430_xfer_start_section( ctx, &job->xfer, elf->text, TRUE );
 
 		return TRUE;
 }
 
+static void job_init( struct flash_job_t *job,
+		      struct bus_t *bus,
+		      const sric_device *device,
+		      struct target_t *target )
+{
+	job->bus = bus;
+	job->device = device;
+	job->target = target;
+	job->elf = NULL;
+	job->stage = JOB_TEXT;
+	job->old = NULL;
+	job->attempts = 1;
+	job->stalls = 0;
+	job->rtt_us = 0;
+	job->estimate_us = 0;
+}
+
+static gint64 job_estimate( const struct flash_job_t *job )
+{
+	uint32_t chunks, windows;
+	/* Reads of the next address after each window, which bootloaders
+	   that put it in the reply to each chunk don't need */
+	uint32_t reads = (job->xfer.caps & MSP430_CAP_NEXT_ACK) ? 0
+		: (job->xfer.caps & MSP430_CAP_NEXT_CHECK) ? 1 : 2;
+
+	chunks = msp430_xfer_chunks_left( &job->xfer );
+	chunks += (job->elf->vectors->len + job->xfer.chunk_size - 1) / job->xfer.chunk_size;
+	windows = (chunks + job->xfer.window - 1) / job->xfer.window;
+
+	/* Chunk frames are longer than the probe's, so this is on the
+	   low side for slow buses */
+	return job->rtt_us * (chunks + windows * reads);
+}
+
+static gint job_cmp_estimate( gconstpointer a, gconstpointer b )
+{
+	const struct flash_job_t *ja = a, *jb = b;
+
+	if( ja->estimate_us > jb->estimate_us )
+		return -1;
+	return ja->estimate_us < jb->estimate_us;
+}
+
+static void plan_print( GArray *jobs, const guint *counts )
+{
+	gint64 total = 0;
+	guint i;
+
+	for( i=0; i<jobs->len; i++ ) {
+		struct flash_job_t *job = &g_array_index( jobs, struct flash_job_t, i );
+
+		g_print( "Plan: '%s[%i]' %s half, version %hu, %u chunks, about %.1f s\n",
+			 job->target->board.name, job->device->address,
+			 job->elf == &job->target->bottom ? "bottom" : "top",
+			 elf_fw_version( job->elf ),
+			 msp430_xfer_chunks_left( &job->xfer ),
+			 job->estimate_us / 1e6 );
+
+		/* They all share the bus */
+		total += job->estimate_us;
+	}
+
+	g_print( "Plan: %u to flash, %u up to date, %u not answering, about %.1f s in all\n",
+		 counts[PROBE_FLASH], counts[PROBE_CURRENT], counts[PROBE_DEAD],
+		 total / 1e6 );
+}
+
+static void job_journal( struct flash_job_t *job )
+{
+	journal_entry_t e;
+
+	e.bus = job->bus->index;
+	e.board_type = job->target->board.type;
+	e.address = job->device->address;
+	e.addr = job->elf->text->addr;
+	e.version = elf_fw_version( job->elf );
+	e.crc = job->elf->text_crc;
+	e.chunk_size = job->xfer.chunk_size;
+	e.offset = job->stage == JOB_TEXT ? msp430_xfer_progress( &job->xfer )
+		: job->elf->text->len;
+	e.done = job->stage == JOB_DONE;
+
+	journal_set( &e );
+}
+
+static gboolean flash_boards( struct bus_t *bus, GArray *jobs )
+{
+	transport_t *ctx = bus->ctx;
+	guint i, active;
+	gint64 start, shown = 0;
+	gboolean stepping, ok;
+
+	if( jobs->len == 0 )
+		return TRUE;
+
+	for( i=0; i<jobs->len; i++ )
+		job_progress_start( &g_array_index( jobs, struct flash_job_t, i ) );
+
+	do {
+		active = 0;
+
+		for( i=0; i<jobs->len; i++ ) {
+			struct flash_job_t *job = &g_array_index( jobs, struct flash_job_t, i );
+
+			if( job->stage == JOB_DONE || job->stage == JOB_FAILED
+			    || job->stage == JOB_NOT_SWITCHED
+			    || job->stage == JOB_NO_ANSWER )
+				continue;
+			active++;
+
+			start = g_get_monotonic_time();
+			stepping = msp430_xfer_step( ctx, &job->xfer );
+			stats_phase_add( job->stage == JOB_TEXT ? STATS_PHASE_SEND_TEXT
+					 : STATS_PHASE_SEND_VECTORS,
+					 g_get_monotonic_time() - start );
+
+			if( stepping )
+				continue;
+
+			if( job->xfer.failed ) {
+				/* The next step carries on from wherever it got to.
+				   A board that stops answering is the likeliest
+				   to need carrying on with by a later run. */
+				job_journal( job );
+				journal_save();
+				job->stalls++;
+				if( job->stalls == MSP430_XFER_STALLS )
+					job->stage = JOB_NO_ANSWER;
+				continue;
+			}
+
+			/* The current section has been sent */
+			if( progress_mode == PROGRESS_JSON )
+				progress_show( &job->progress, job->xfer.section->len );
+
+			if( job->stage == JOB_TEXT ) {
+				job_journal( job );
+				journal_save();
+				job->stage = JOB_VECTORS;
+				job->xfer.old = NULL;
+				msp430_xfer_start_section( ctx, &job->xfer,
+							   job->elf->vectors, FALSE );
+				job_progress_start( job );
+			} else {
+				gboolean crc_ok;
+
+				start = g_get_monotonic_time();
+				crc_ok = verify_board( ctx, job );
+				stats_phase_add( STATS_PHASE_VERIFY, g_get_monotonic_time() - start );
+
+				if( crc_ok ) {
+					start = g_get_monotonic_time();
+					if( msp430_confirm_crc( ctx, &job->target->board, job->device,
+								elf_fw_version( job->elf ) ) ) {
+						job->stage = JOB_DONE;
+						job_journal( job );
+						journal_save();
+					} else
+						job->stage = JOB_NOT_SWITCHED;
+					stats_phase_add( STATS_PHASE_CONFIRM, g_get_monotonic_time() - start );
+				} else if( job->attempts < MSP430_XFER_ATTEMPTS ) {
+					uint32_t bad;
+					elf_section_t *known;
+
+					/* Bootloaders that keep what they aren't sent
+					   only need the chunks that are wrong again */
+					known = msp430_crc_mend( ctx, &job->target->board,
+								 job->device, job->xfer.caps,
+								 job->elf->text,
+								 job->xfer.chunk_size, &bad );
+					if( known != NULL ) {
+						if( buses->len == 1 )
+							progress_end();
+						g_print( "'%s[%i]' has %u chunks wrong, sending just those again\n",
+							 job->target->board.name, job->device->address, bad );
+						stats_count( STATS_REPAIR );
+						stats_count_add( STATS_REPAIR_CHUNKS, bad );
+					}
+
+					stats_count( STATS_RETRY );
+					job->attempts++;
+					job_restart( ctx, job, known );
+					job_progress_start( job );
+					job_journal( job );
+				} else
+					job->stage = JOB_FAILED;
+			}
+		}
+
+		/* Drawing the progress is slow over a serial console, so
+		   it's kept out of the way of the transfer */
+		if( progress_due( &shown ) )
+			jobs_progress( bus, jobs );
+	} while( active > 0 );
+
+	if( progress_mode == PROGRESS_BAR )
+		jobs_progress( bus, jobs );
+	if( buses->len == 1 )
+		progress_end();
+
+	ok = TRUE;
+	for( i=0; i<jobs->len; i++ ) {
+		struct flash_job_t *job = &g_array_index( jobs, struct flash_job_t, i );
+		const char *name = job->target->board.name;
+		gint64 srtt;
+		int timeout;
+
+		if( job->stage != JOB_DONE )
+			ok = FALSE;
+
+		timeout = msp430_link_timeout( ctx, job->device, CMD_FW_CHUNK, &srtt );
+		stats_link( bus->index, name, job->device->address, job->xfer.window,
+			    srtt, timeout );
+
+		if( job->stage == JOB_NO_ANSWER ) {
+			g_print( "'%s[%i]' stopped answering at %4.4hx, run again to carry on\n",
+				name, job->device->address, job->xfer.next );
+			fw_cache_free( job->old );
+			continue;
+		}
+
+		if( job->stage == JOB_FAILED ) {
+			g_print( "CRC of firmware on '%s[%i]' didn't match after %hhu attempts, not switching over\n",
+				name, job->device->address, job->attempts );
+			fw_cache_free( job->old );
+			continue;
+		}
+
+		if( job->stage == JOB_NOT_SWITCHED ) {
+			g_print( "'%s[%i]' didn't switch over to firmware version %hu\n",
+				name, job->device->address, elf_fw_version( job->elf ) );
+			fw_cache_free( job->old );
+			continue;
+		}
+
+		g_print( "Sent firmware version %hu to '%s[%i]', which is now running it\n",
+			elf_fw_version( job->elf ), name, job->device->address );
+
+		if( !fw_cache_store( job->bus->index, job->target->board.type, job->device->address,
+				     job->elf->text, elf_fw_version( job->elf ) ) )
+			g_print( "Failed to record image sent to '%s[%i]'\n",
+				 name, job->device->address );
+
+		fw_cache_free( job->old );
+	}
+
+	if( !ok && !journal_save() )
+		g_print( "Failed to write journal\n" );
+
+	return ok;
+}
+
+static void multicast_jobs( struct bus_t *bus, GArray *jobs )
+{
+	transport_t *ctx = bus->ctx;
+	const sric_device *device;
+	gboolean taken[128] = { FALSE };
+	gboolean *done;
+	gint64 start;
+	guint i, j;
+	int group;
+
+	/* Group addresses come from the top of the range down, missing
+	   out any that a board answers to */
+	device = NULL;
+	while( (device = ctx->enumerate( ctx, device )) )
+		if( device->address >= 0 && device->address < 128 )
+			taken[device->address] = TRUE;
+	for( group = MSP430_GROUP_MAX; group >= MSP430_GROUP_MIN && taken[group]; group-- )
+		;
+	if( group < MSP430_GROUP_MIN )
+		return;
+
+	done = g_new0( gboolean, jobs->len );
+
+	for( i=0; i<jobs->len; i++ ) {
+		struct flash_job_t *first = &g_array_index( jobs, struct flash_job_t, i );
+		const msp430_board_t *board = &first->target->board;
+		GArray *members;
+		uint32_t bad;
+
+		if( done[i] || !job_can_multicast( first ) )
+			continue;
+
+		/* Boards getting the same image, in the same size chunks */
+		members = g_array_new( FALSE, FALSE, sizeof(guint) );
+		for( j=i; j<jobs->len; j++ ) {
+			struct flash_job_t *job = &g_array_index( jobs, struct flash_job_t, j );
+
+			if( done[j] || job->elf != first->elf
+			    || job->xfer.chunk_size != first->xfer.chunk_size
+			    || !job_can_multicast( job ) )
+				continue;
+			done[j] = TRUE;
+			g_array_append_val( members, j );
+		}
+
+		if( members->len < 2 ) {
+			g_array_free( members, TRUE );
+			continue;
+		}
+
+		start = g_get_monotonic_time();
+		for( j=0; j<members->len; j++ ) {
+			struct flash_job_t *job = &g_array_index( jobs, struct flash_job_t,
+								  g_array_index( members, guint, j ) );
+
+			/* One that doesn't join gets everything sent to it
+			   on its own */
+			if( !msp430_join_group( ctx, board, job->device, group ) )
+				g_array_remove_index( members, j-- );
+		}
+
+		if( members->len >= 2 ) {
+			/* first may have failed to join, and a board outside
+			   the group answers straight away */
+			struct flash_job_t *pace = &g_array_index( jobs, struct flash_job_t,
+								   g_array_index( members, guint, 0 ) );
+			uint16_t chunk_size = first->xfer.chunk_size;
+
+			g_print( "Sending firmware version %hu to %u '%s' boards at once\n",
+				 elf_fw_version( first->elf ), members->len, board->name );
+			stats_count_add( STATS_GROUP_BOARDS, members->len );
+			stats_count_add( STATS_GROUP_CHUNKS,
+					 (first->elf->text->len + chunk_size - 1) / chunk_size );
+			msp430_send_group_section( ctx, board, group, pace->device,
+						   pace->xfer.caps, chunk_size,
+						   first->elf->text );
+		}
+		stats_phase_add( STATS_PHASE_SEND_TEXT, g_get_monotonic_time() - start );
+
+		for( j=0; j<members->len; j++ ) {
+			struct flash_job_t *job = &g_array_index( jobs, struct flash_job_t,
+								  g_array_index( members, guint, j ) );
+			elf_section_t *known = NULL;
+
+			start = g_get_monotonic_time();
+			if( members->len >= 2 ) {
+				known = msp430_crc_bisect( ctx, board, job->device, job->elf->text,
+							   job->xfer.chunk_size, &bad );
+				/* The last chunk is always among them */
+				if( known != NULL && bad > 1 )
+					g_print( "'%s[%i]' needs %u chunks sent on its own\n",
+						 board->name, job->device->address, bad );
+			}
+			stats_phase_add( STATS_PHASE_VERIFY, g_get_monotonic_time() - start );
+
+			/* Resetting the reception code also leaves the group */
+			job_restart( ctx, job, known );
+		}
+
+		g_array_free( members, TRUE );
+	}
+
+	g_free( done );
+}
+
+static gboolean job_can_multicast( const struct flash_job_t *job )
+{
+	const uint16_t needed = MSP430_CAP_GROUP | MSP430_CAP_KEEP | MSP430_CAP_CRC_RANGE;
+
+	/* Boards with something to diff against, or that are part way
+	   through, are better off on their own */
+	return (job->xfer.caps & needed) == needed
+		&& job->target->board.command_present[CMD_FW_GROUP]
+		&& job->stage == JOB_TEXT && job->old == NULL
+		&& msp430_xfer_progress( &job->xfer ) == 0;
+}
+
+static void job_restart( transport_t *ctx, struct flash_job_t *job,
+			 elf_section_t *known )
+{
+	uint16_t fw;
+
+	fw_cache_free( job->old );
+	job->old = known;
+
+	/* Reading the firmware version resets the msp430's reception code */
+	job->stage = JOB_TEXT;
+	job->xfer.old = job->old;
+	msp430_get_fw_version( ctx, &job->target->board, job->device, &fw );
+	msp430_xfer_start_section( ctx, &job->xfer, job->elf->text, TRUE );
+}
+
+static gboolean verify_board( transport_t *ctx, struct flash_job_t *job )
+{
+	const msp430_board_t *board = &job->target->board;
+	uint16_t crc, expected;
+
+	expected = msp430_image_crc( job->elf->text_crc, job->elf->text,
+				     job->elf->vectors, job->xfer.chunk_size );
+
+	if( !msp430_get_crc( ctx, board, job->device, &crc ) ) {
+		g_print( "\nFailed to read CRC from '%s[%i]'\n",
+			 board->name, job->device->address );
+		return FALSE;
+	}
+
+	if( crc != expected ) {
+		g_print( "\n'%s[%i]' has CRC %4.4hx, expected %4.4hx\n",
+			 board->name, job->device->address, crc, expected );
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static elf_section_t* find_old_image( transport_t *ctx,
+				      struct flash_job_t *job,
+				      uint32_t addr )
+{
+	const msp430_board_t *board = &job->target->board;
+	const sric_device *device = job->device;
+	elf_section_t *old;
+	uint16_t version, crc;
+	const uint16_t needed = MSP430_CAP_CRC_RANGE | MSP430_CAP_KEEP;
+
+	if( (job->xfer.caps & needed) != needed )
+		return NULL;
+
+	old = fw_cache_load( job->bus->index, board->type, device->address, addr, &version );
+	if( old == NULL )
+		return NULL;
+
+	/* Check that the flash still holds it */
+	if( old->len > 0xffff
+	    || !msp430_get_crc_range( ctx, board, device, old->addr, old->len, &crc )
+	    || crc != crc16( CRC16_INIT, old->data, old->len ) ) {
+		g_print( "'%s[%i]' no longer holds version %hu, sending whole image\n",
+			 board->name, device->address, version );
+		fw_cache_free( old );
+		return NULL;
+	}
+
+	g_print( "Sending changes against version %hu already on '%s[%i]'\n",
+		 version, board->name, device->address );
+	return old;
+}
+
+static void job_progress_start( struct flash_job_t *job )
+{
+	progress_start( &job->progress, job->target->board.name, job->device->address,
+			job->xfer.section->name, job->xfer.section->len,
+			msp430_xfer_progress( &job->xfer ) );
+
+	if( buses->len > 1 )
+		job->progress.bus = job->bus->spec;
+}
+
+static void jobs_progress( struct bus_t *bus, GArray *jobs )
+{
+	guint i;
+
+	if( progress_mode == PROGRESS_BAR && buses->len > 1 ) {
+		guint total = 0;
+
+		/* Finished boards count as all the way through */
+		for( i=0; i<jobs->len; i++ ) {
+			struct flash_job_t *job = &g_array_index( jobs, struct flash_job_t, i );
+
+			if( job->stage == JOB_TEXT )
+				total += progress_percent( &job->progress,
+							   msp430_xfer_progress( &job->xfer ) );
+			else
+				total += 100;
+		}
+
+		g_atomic_int_set( &bus->percent, jobs->len ? total / jobs->len : 100 );
+		return;
+	}
+
+	if( progress_mode == PROGRESS_JSON ) {
+		for( i=0; i<jobs->len; i++ ) {
+			struct flash_job_t *job = &g_array_index( jobs, struct flash_job_t, i );
+
+			if( job->stage == JOB_TEXT || job->stage == JOB_VECTORS )
+				progress_show( &job->progress, msp430_xfer_progress( &job->xfer ) );
+		}
+		return;
+	}
+
+	printf( "\r" );
+
+	for( i=0; i<jobs->len; i++ ) {
+		struct flash_job_t *job = &g_array_index( jobs, struct flash_job_t, i );
+
+		if( job->stage == JOB_DONE )
+			printf( "[%i] done          ", job->device->address );
+		else if( job->stage == JOB_FAILED || job->stage == JOB_NOT_SWITCHED
+			 || job->stage == JOB_NO_ANSWER )
+			printf( "[%i] failed        ", job->device->address );
+		else
+			printf( "[%i] %-9s %3u%%  ", job->device->address,
+				job->xfer.section->name,
+				progress_percent( &job->progress,
+						  msp430_xfer_progress( &job->xfer ) ) );
+	}
+
+	fflush(stdout);
+}
+
+static void buses_progress( void )
+{
+	guint i;
+
+	printf( "\r" );
+
+	for( i=0; i<buses->len; i++ ) {
+		struct bus_t *bus = &g_array_index( buses, struct bus_t, i );
+
+		printf( "%s %3i%%  ", bus->spec, g_atomic_int_get( &bus->percent ) );
+	}
+
+	fflush(stdout);
+}
+
+static void print_line( const gchar *s )
+{
+	/* Only progress goes to stdout in JSON mode */
+	FILE *f = progress_mode == PROGRESS_JSON ? stderr : stdout;
+	const struct bus_t *bus = g_private_get( &current_bus );
+
+	/* Say which bus it's about, in one write so that the buses'
+	   messages don't get mixed up */
+	if( bus != NULL )
+		fprintf( f, "%s: %s", bus->spec, s );
+	else
+		fputs( s, f );
+}
+
+static void print_nothing( const gchar *s )
+{
+}
+
+static void output_setup( void )
+{
+	if( quiet ) {
+		progress_mode = PROGRESS_NONE;
+		g_set_print_handler( print_nothing );
+	} else
+		g_set_print_handler( print_line );
+}
+
+static void targets_new( const char *name, const char *manifest,
+			 char **fw, guint n_fw )
+{
+	struct target_t target;
+
+	targets = g_array_new( FALSE, TRUE, sizeof(struct target_t) );
+
+	if( manifest != NULL ) {
+		manifest_load( manifest );
+		return;
+	}
+
+	if( name == NULL )
+		return;
+
+	memset( &target, 0, sizeof(target) );
+	target.board.name = g_strdup( name );
+
+	if( n_fw == 1 )
+		target.bundle_fname = fw[0];
+	else if( n_fw == 2 ) {
+		target.elf_fname_b = fw[0];
+		target.elf_fname_t = fw[1];
+	}
+
+	g_array_append_val( targets, target );
+}
+
 static void config_file_load( const char* fname )
 {
 	GError *err = NULL;
-	GKeyFile *keyfile;
-	uint8_t i;
+	/* Kept, so that a daemon only reads it once */
+	static GKeyFile *keyfile = NULL;
+	guint i;
+
+	if( keyfile == NULL ) {
+		keyfile = g_key_file_new();
+		g_key_file_load_from_file( keyfile,
+					   fname, 
+					   0, &err );
+		if( err != NULL )
+			g_error( "Failed to load config from file '%s': %s", 
+				 fname, err->message );
+	}
 
-	keyfile = g_key_file_new();
-	g_key_file_load_from_file( keyfile,
-				   fname, 
-				   0, &err );
-	if( err != NULL )
-		g_error( "Failed to load config from file '%s': %s", 
-			 fname, err->message );
+	for( i=0; i<targets->len; i++ ) {
+		msp430_board_t *board = &g_array_index( targets, struct target_t, i ).board;
+
+		config_board_load( keyfile, board );
+
+		/* Boards are matched to firmware by type alone */
+		if( find_target( board->type ) != &g_array_index( targets, struct target_t, i ) )
+			g_error( "%s has the same board type as %s",
+				 board->name, find_target( board->type )->board.name );
+	}
+}
+
+static void config_board_load( GKeyFile *keyfile, msp430_board_t *board )
+{
+	GError *err = NULL;
+	const char *name = board->name;
+	uint8_t i;
 
 	/* Check for the board type exists */
-	if (!g_key_file_has_key(keyfile, dev_name, "board", NULL))
-		g_error("%s.board config not found", dev_name);
+	if (!g_key_file_has_key(keyfile, name, "board", NULL))
+		g_error("%s.board config not found", name);
 
 	err = NULL;
-	board_type = key_file_get_hex(keyfile, dev_name, "board", &err);
+	board->type = key_file_get_hex(keyfile, name, "board", &err);
 	if (err != NULL)
-		g_error("Failed to read %s.board: %s", dev_name, err->message);
+		g_error("Failed to read %s.board: %s", name, err->message);
 
 	/** Load in the commands **/
-	/* dev_name */
 	for( i=0; i<NUM_COMMANDS; i++ ) {
 		char *key = conf_get_cmd_str(i);
 
+		board->command_present[i] = FALSE;
+
 		err = NULL;
-		if( !g_key_file_has_key( keyfile, dev_name, key, &err ) )
+		if( !g_key_file_has_key( keyfile, name, key, &err ) ) {
+			if( conf_cmd_optional(i) )
+				continue;
+
 			g_error( "%s board has no %s command defined.",
-				 dev_name, key );
+				 name, key );
+		}
 
 		err = NULL;
-		commands[i] = g_key_file_get_integer( keyfile, dev_name,
-						      key, &err );
+		board->commands[i] = g_key_file_get_integer( keyfile, name,
+							     key, &err );
 		if( err != NULL )
-			g_error( "Failed to read %s.%s from config file: %s", dev_name, key, err->message );
+			g_error( "Failed to read %s.%s from config file: %s", name, key, err->message );
+		board->command_present[i] = TRUE;
 	}
 
 	/* Grab the top and bottom addresses */
-	if( !g_key_file_has_key( keyfile, dev_name, "bottom", NULL ) )
-		g_error( "%s.bottom config not found", dev_name );
-	if( !g_key_file_has_key( keyfile, dev_name, "top", NULL ) )
-		g_error( "%s.top config not found", dev_name );
+	if( !g_key_file_has_key( keyfile, name, "bottom", NULL ) )
+		g_error( "%s.bottom config not found", name );
+	if( !g_key_file_has_key( keyfile, name, "top", NULL ) )
+		g_error( "%s.top config not found", name );
+
+	board->bottom = key_file_get_hex( keyfile, name, "bottom", NULL );
+	board->top = key_file_get_hex( keyfile, name, "top", NULL );
+
+	/* The window size is optional */
+	board->window = 1;
+	if( g_key_file_has_key( keyfile, name, "window", NULL ) ) {
+		gint window;
+
+		err = NULL;
+		window = g_key_file_get_integer( keyfile, name, "window", &err );
+		if( err != NULL )
+			g_error( "Failed to read %s.window from config file: %s", name, err->message );
+		if( window < 1 )
+			g_error( "%s.window must be at least 1", name );
+
+		board->window = window;
+	}
+
+	/* The window only grows if the config lets it, so that boards
+	   whose bootloaders were set up for a fixed window keep it */
+	board->max_window = board->window;
+	if( g_key_file_has_key( keyfile, name, "max_window", NULL ) ) {
+		gint max_window;
+
+		err = NULL;
+		max_window = g_key_file_get_integer( keyfile, name, "max_window", &err );
+		if( err != NULL )
+			g_error( "Failed to read %s.max_window from config file: %s", name, err->message );
+		if( max_window < board->window )
+			g_error( "%s.max_window must be at least %s.window", name, name );
+
+		board->max_window = max_window;
+	}
+
+	/* As is the chunk size */
+	board->chunk_size = CHUNK_SIZE;
+	if( g_key_file_has_key( keyfile, name, "chunk_size", NULL ) ) {
+		gint chunk_size;
+
+		err = NULL;
+		chunk_size = g_key_file_get_integer( keyfile, name, "chunk_size", &err );
+		if( err != NULL )
+			g_error( "Failed to read %s.chunk_size from config file: %s", name, err->message );
+		if( chunk_size < 2 || (chunk_size & (chunk_size - 1)) != 0 )
+			g_error( "%s.chunk_size must be a power of two", name );
+		if( chunk_size > MSP430_MAX_CHUNK )
+			g_error( "%s.chunk_size must be no more than %u bytes",
+				 name, (unsigned int)MSP430_MAX_CHUNK );
+
+		board->chunk_size = chunk_size;
+	}
+}
+
+static void manifest_load( const char* fname )
+{
+	GError *err = NULL;
+	GKeyFile *keyfile;
+	gchar **groups, *dir;
+	gsize i, n;
+
+	keyfile = g_key_file_new();
+	g_key_file_load_from_file( keyfile, fname, 0, &err );
+	if( err != NULL )
+		g_error( "Failed to load manifest from file '%s': %s",
+			 fname, err->message );
+
+	/* Files are relative to the manifest */
+	dir = g_path_get_dirname( fname );
+
+	groups = g_key_file_get_groups( keyfile, &n );
+	for( i=0; i<n; i++ ) {
+		struct target_t target;
+		const char *name = groups[i];
+
+		memset( &target, 0, sizeof(target) );
+		target.board.name = g_strdup( name );
 
-	msp430_fw_bottom = key_file_get_hex( keyfile, dev_name, "bottom", NULL );
-	msp430_fw_top = key_file_get_hex( keyfile, dev_name, "top", NULL );
+		if( find_target_by_name( name ) != NULL )
+			g_error( "%s appears more than once in the manifest", name );
+
+		if( g_key_file_has_key( keyfile, name, "bundle", NULL ) )
+			target.bundle_fname = manifest_get_fname( keyfile, dir, name, "bundle" );
+		else if( g_key_file_has_key( keyfile, name, "bottom", NULL )
+			 && g_key_file_has_key( keyfile, name, "top", NULL ) ) {
+			target.elf_fname_b = manifest_get_fname( keyfile, dir, name, "bottom" );
+			target.elf_fname_t = manifest_get_fname( keyfile, dir, name, "top" );
+		} else
+			g_error( "Manifest gives no bundle, or bottom and top ELF files, for %s", name );
+
+		g_array_append_val( targets, target );
+	}
+
+	if( targets->len == 0 )
+		g_error( "Manifest '%s' doesn't list any boards", fname );
+
+	g_strfreev( groups );
+	g_free( dir );
+	g_key_file_free( keyfile );
+}
+
+static char* manifest_get_fname( GKeyFile *keyfile,
+				 const char *dir,
+				 const char *group,
+				 const char *key )
+{
+	gchar *v, *fname;
+
+	v = g_key_file_get_string( keyfile, group, key, NULL );
+	if( v == NULL )
+		g_error( "Failed to read %s.%s from manifest", group, key );
+
+	if( g_path_is_absolute( v ) )
+		return v;
+
+	fname = g_build_filename( dir, v, NULL );
+	g_free( v );
+	return fname;
 }
 
 static unsigned long int key_file_get_hex( GKeyFile *key_file,
@@ -275,7 +2019,7 @@ static void config_load( int *argc, char ***argv )
 	GError *error = NULL;
 	GOptionContext *context;
 
-	context = g_option_context_new( "BOTTOM_ELF_FILE TOP_ELF_FILE - flash MSP430s over I2C" );
+	context = g_option_context_new( "[BOTTOM_ELF_FILE TOP_ELF_FILE | BUNDLE] - flash MSP430s over I2C" );
 	g_option_context_add_main_entries( context, entries, NULL );
 
 	/* Parse command line options */
@@ -285,20 +2029,47 @@ static void config_load( int *argc, char ***argv )
 		exit(1);
 	}
 
-	/* Device must be specified */
-	if( dev_name == NULL ) {
-		g_print( "Error: No device name specified.  See --help\n");
+	if( manifest_fname != NULL ) {
+		if( dev_name != NULL || *argc != 1 ) {
+			g_print( "Error: Boards and firmware come from the manifest.  See --help\n" );
+			exit(1);
+		}
+	} else if( dev_name != NULL || *argc != 1
+		   || (daemon_fname == NULL && socket_fname == NULL) ) {
+		/* Only the daemon and its clients can do without, when the
+		   daemon was started with firmware */
+
+		/* Device must be specified */
+		if( dev_name == NULL ) {
+			g_print( "Error: No device name specified.  See --help\n");
+			exit(1);
+		}
+
+		/* Arguments without letters are the elf filenames, or a
+		   bundle.  --ping doesn't need any. */
+		if( *argc != 2 && *argc != 3 && !(*argc == 1 && ping_count > 0) ) {
+			g_print( "Error: Two ELF files or a bundle required.  See --help\n" );
+			exit(1);
+		}
+	}
+
+	if( (compile_fname != NULL || ping_count > 0)
+	    && (daemon_fname != NULL || socket_fname != NULL) ) {
+		g_print( "Error: --compile and --ping can't be used with --daemon or --socket\n" );
 		exit(1);
 	}
 
-	/* Argument without letter is the elf filename */
-	if( *argc != 3 ) {
-		g_print( "Error: Two ELF files required.  See --help\n" );
+	if( progress_name != NULL && !progress_mode_parse( progress_name, &progress_mode ) ) {
+		g_print( "Error: Unknown progress mode '%s'.  See --help\n", progress_name );
 		exit(1);
 	}
+	output_setup();
 
-	elf_fname_b = (*argv)[1];
-	elf_fname_t = (*argv)[2];
+	/* The daemon loads everything */
+	if( socket_fname != NULL )
+		return;
+
+	targets_new( dev_name, manifest_fname, *argv + 1, *argc - 1 );
 
 	/* Load settings from the config file  */
 	config_file_load( config_fname );
@@ -318,6 +2089,79 @@ char* conf_get_cmd_str( uint8_t cmd )
 	return NULL;
 }
 
+static gboolean conf_cmd_optional( uint8_t cmd )
+{
+	uint8_t i;
+
+	for( i=0; i<NUM_COMMANDS; i++ ) {
+		if( cmds[i].cmd == cmd )
+			return cmds[i].optional;
+	}
+
+	g_error( "Command number %hhu not found in table", cmd );
+	return FALSE;
+}
+
+static void load_firmware( struct target_t *target )
+{
+	const msp430_board_t *board = &target->board;
+	struct elf_file_t *bottom = &target->bottom, *top = &target->top;
+	bundle_half_t halves[2];
+	gchar *cache = NULL;
+
+	if( target->bundle_fname != NULL ) {
+		if( !bundle_load( target->bundle_fname, board->type, halves ) )
+			g_error( "'%s' isn't a bundle with firmware for %s boards",
+				 target->bundle_fname, board->name );
+	} else {
+		/* ELF files that have been seen before don't need parsing again */
+		cache = bundle_cache_fname( target->elf_fname_b, target->elf_fname_t );
+
+		if( cache == NULL || !bundle_load( cache, board->type, halves ) ) {
+			load_elfs( target->elf_fname_b, target->elf_fname_t, bottom, top );
+			halves[0].text = NULL;
+		}
+	}
+
+	if( halves[0].text != NULL ) {
+		bottom->text = halves[0].text;
+		bottom->vectors = halves[0].vectors;
+		bottom->text_crc = halves[0].text_crc;
+		top->text = halves[1].text;
+		top->vectors = halves[1].vectors;
+		top->text_crc = halves[1].text_crc;
+	}
+
+	if( bottom->text->addr != board->bottom )
+		g_error( "Lower half for %s has .text offset %hx -- should be %hx\n", board->name, bottom->text->addr, board->bottom );
+
+	if( top->text->addr != board->top )
+		g_error( "Upper half for %s has .text offset %hx -- should be %hx\n", board->name, top->text->addr, board->top );
+
+	if( elf_fw_version( bottom ) != elf_fw_version( top ) )
+		g_error( "Supplied ELF files for %s have different version numbers", board->name );
+
+	/* Only cache what's been checked */
+	if( cache != NULL && halves[0].text == NULL
+	    && !write_bundle( cache, target ) )
+		g_print( "Failed to cache firmware in '%s'\n", cache );
+	g_free( cache );
+}
+
+static gboolean write_bundle( const char *fname, struct target_t *target )
+{
+	bundle_half_t halves[2];
+
+	halves[0].text = target->bottom.text;
+	halves[0].vectors = target->bottom.vectors;
+	halves[0].text_crc = target->bottom.text_crc;
+	halves[1].text = target->top.text;
+	halves[1].vectors = target->top.vectors;
+	halves[1].text_crc = target->top.text_crc;
+
+	return bundle_write( fname, target->board.type, halves );
+}
+
 static void load_elfs( char* fna, char* fnb,
 		       struct elf_file_t *bottom,
 		       struct elf_file_t *top )
@@ -336,12 +2180,37 @@ static void load_elfs( char* fna, char* fnb,
 		*top = tmp;
 	}
 
-	if( bottom->text->addr != msp430_fw_bottom )
-		g_error( "Lower ELF file has .text offset %hx -- should be %hx\n", bottom->text->addr, msp430_fw_bottom );
+	bottom->text_crc = crc16( CRC16_INIT, bottom->text->data, bottom->text->len );
+	top->text_crc = crc16( CRC16_INIT, top->text->data, top->text->len );
 
-	if( top->text->addr != msp430_fw_top )
-		g_error( "Upper ELF file has .text offset %hx -- should be %hx\n", top->text->addr, msp430_fw_top );
+}
 
+static struct target_t* find_target( uint8_t type )
+{
+	guint i;
+
+	for( i=0; i<targets->len; i++ ) {
+		struct target_t *target = &g_array_index( targets, struct target_t, i );
+
+		if( target->board.type == type )
+			return target;
+	}
+
+	return NULL;
+}
+
+static struct target_t* find_target_by_name( const char *name )
+{
+	guint i;
+
+	for( i=0; i<targets->len; i++ ) {
+		struct target_t *target = &g_array_index( targets, struct target_t, i );
+
+		if( strcmp( target->board.name, name ) == 0 )
+			return target;
+	}
+
+	return NULL;
 }
 
 static uint16_t elf_fw_version( struct elf_file_t *e )
@@ -0,0 +1,154 @@
+/*  This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA. */
+#include "fw-cache.h"
+#include <string.h>
+
+/* Cache files start with this */
+#define FW_CACHE_MAGIC "FBC1"
+/* Length of the header:
+   0-3: FW_CACHE_MAGIC
+   4-5: Firmware version (4 is lsb)
+   6-9: Address of the image (6 is lsb)
+ 10-13: Length of the image (10 is lsb) */
+#define FW_CACHE_HDR 14
+
+char *fw_cache_dir = NULL;
+
+/* Returns the filename of the cache entry for the given board and half */
+static gchar* fw_cache_fname( uint8_t bus, uint8_t board_type, int address, uint32_t addr );
+
+static uint32_t get_u32( const uint8_t *b );
+static void put_u32( uint8_t *b, uint32_t v );
+
+elf_section_t* fw_cache_load( uint8_t bus,
+			      uint8_t board_type,
+			      int address,
+			      uint32_t addr,
+			      uint16_t *version )
+{
+	gchar *fname, *contents;
+	gsize len;
+	const uint8_t *b;
+	elf_section_t *image;
+
+	g_assert( version != NULL );
+
+	fname = fw_cache_fname( bus, board_type, address, addr );
+	if( !g_file_get_contents( fname, &contents, &len, NULL ) ) {
+		g_free( fname );
+		return NULL;
+	}
+	g_free( fname );
+
+	b = (uint8_t*)contents;
+	if( len < FW_CACHE_HDR
+	    || memcmp( b, FW_CACHE_MAGIC, 4 ) != 0
+	    || get_u32( b + 6 ) != addr
+	    || get_u32( b + 10 ) != len - FW_CACHE_HDR ) {
+		g_free( contents );
+		return NULL;
+	}
+
+	image = g_malloc( sizeof(elf_section_t) );
+	image->addr = addr;
+	image->len = len - FW_CACHE_HDR;
+	image->offset = 0;
+	image->name = "cached";
+	image->ranges = NULL;
+	image->n_ranges = 0;
+	image->data = g_malloc( image->len );
+	g_memmove( image->data, b + FW_CACHE_HDR, image->len );
+
+	*version = b[4] | (b[5] << 8);
+
+	g_free( contents );
+	return image;
+}
+
+gboolean fw_cache_store( uint8_t bus,
+			 uint8_t board_type,
+			 int address,
+			 const elf_section_t *image,
+			 uint16_t version )
+{
+	gchar *fname, *dir;
+	uint8_t *b;
+	gboolean r;
+
+	g_assert( image != NULL );
+
+	dir = fw_cache_dir;
+	if( dir == NULL )
+		dir = g_build_filename( g_get_user_cache_dir(), "flashb", NULL );
+	else
+		dir = g_strdup( dir );
+
+	if( g_mkdir_with_parents( dir, 0755 ) != 0 ) {
+		g_free( dir );
+		return FALSE;
+	}
+	g_free( dir );
+
+	b = g_malloc( FW_CACHE_HDR + image->len );
+	memcpy( b, FW_CACHE_MAGIC, 4 );
+	b[4] = version & 0xff;
+	b[5] = (version >> 8) & 0xff;
+	put_u32( b + 6, image->addr );
+	put_u32( b + 10, image->len );
+	g_memmove( b + FW_CACHE_HDR, image->data, image->len );
+
+	fname = fw_cache_fname( bus, board_type, address, image->addr );
+	r = g_file_set_contents( fname, (gchar*)b, FW_CACHE_HDR + image->len, NULL );
+
+	g_free( fname );
+	g_free( b );
+	return r;
+}
+
+void fw_cache_free( elf_section_t *image )
+{
+	if( image == NULL )
+		return;
+
+	g_free( image->data );
+	g_free( image );
+}
+
+static gchar* fw_cache_fname( uint8_t bus, uint8_t board_type, int address, uint32_t addr )
+{
+	gchar *name, *fname;
+
+	name = g_strdup_printf( "%hhu-%hhu-%i-%4.4x.img", bus, board_type, address, addr );
+
+	if( fw_cache_dir != NULL )
+		fname = g_build_filename( fw_cache_dir, name, NULL );
+	else
+		fname = g_build_filename( g_get_user_cache_dir(), "flashb", name, NULL );
+
+	g_free( name );
+	return fname;
+}
+
+static uint32_t get_u32( const uint8_t *b )
+{
+	return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+static void put_u32( uint8_t *b, uint32_t v )
+{
+	b[0] = v & 0xff;
+	b[1] = (v >> 8) & 0xff;
+	b[2] = (v >> 16) & 0xff;
+	b[3] = (v >> 24) & 0xff;
+}
@@ -0,0 +1,52 @@
+/*  This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA. */
+
+/* A store of the images last flashed into each half of each board.
+   Used to send only the parts of an image that have changed. */
+#ifndef __FW_CACHE
+#define __FW_CACHE
+#include <stdint.h>
+#include <glib.h>
+
+#include "elf-access.h"
+
+/* Directory the cache lives in.
+   Defaults to "flashb" in the user's cache directory. */
+extern char *fw_cache_dir;
+
+/* Boards are told apart by their bus, board type and address.  The bus
+   is its position in the list of buses being flashed, starting at 0.
+
+   Load the image that was last flashed into the half of flash starting
+   at addr on the given board.
+   Returns NULL if there isn't one.  The image's firmware version is
+   put in *version. */
+elf_section_t* fw_cache_load( uint8_t bus,
+			      uint8_t board_type,
+			      int address,
+			      uint32_t addr,
+			      uint16_t *version );
+
+/* Record that the given image has been flashed onto the given board.
+   Returns FALSE if the cache couldn't be written. */
+gboolean fw_cache_store( uint8_t bus,
+			 uint8_t board_type,
+			 int address,
+			 const elf_section_t *image,
+			 uint16_t version );
+
+/* Free an image returned by fw_cache_load */
+void fw_cache_free( elf_section_t *image );
+
+#endif	/* __FW_CACHE */
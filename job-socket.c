@@ -0,0 +1,290 @@
+/*  This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA. */
+#include "job-socket.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* Requests are lines of "key value", ended by an empty line:
+   name NAME, manifest PATH, fw PATH (up to twice), address N,
+   progress MODE, and force, no-delta, plan, verify, flash-if-different,
+   stats and quiet on their own. */
+
+/* Largest request that will be read */
+#define REQUEST_MAX 16384
+
+/* Fill in the address of the socket at the given path.
+   Returns FALSE if the path is too long. */
+static gboolean socket_addr( const char *path, struct sockaddr_un *addr );
+
+/* Write all of a buffer to an fd.
+   Returns FALSE on error. */
+static gboolean write_all( int fd, const char *buf, size_t len );
+
+/* Add a line to a request.
+   Returns FALSE if the value can't be sent. */
+static gboolean request_add( GString *s, const char *key, const char *val );
+
+int job_socket_listen( const char *path )
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if( !socket_addr( path, &addr ) )
+		return -1;
+
+	fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+	if( fd < 0 )
+		return -1;
+
+	unlink( path );
+	if( bind( fd, (struct sockaddr*)&addr, sizeof(addr) ) < 0
+	    || listen( fd, 8 ) < 0 ) {
+		close( fd );
+		return -1;
+	}
+
+	return fd;
+}
+
+int job_socket_connect( const char *path )
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if( !socket_addr( path, &addr ) )
+		return -1;
+
+	fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+	if( fd < 0 )
+		return -1;
+
+	if( connect( fd, (struct sockaddr*)&addr, sizeof(addr) ) < 0 ) {
+		close( fd );
+		return -1;
+	}
+
+	return fd;
+}
+
+gboolean job_request_write( int fd, const job_request_t *req )
+{
+	GString *s = g_string_new( "" );
+	gboolean ok = TRUE;
+	guint i;
+
+	if( req->name != NULL )
+		ok = ok && request_add( s, "name", req->name );
+	if( req->manifest != NULL )
+		ok = ok && request_add( s, "manifest", req->manifest );
+	for( i=0; i<req->n_fw; i++ )
+		ok = ok && request_add( s, "fw", req->fw[i] );
+	if( req->force )
+		ok = ok && request_add( s, "force", NULL );
+	if( req->no_delta )
+		ok = ok && request_add( s, "no-delta", NULL );
+	if( req->plan )
+		ok = ok && request_add( s, "plan", NULL );
+	if( req->verify )
+		ok = ok && request_add( s, "verify", NULL );
+	if( req->flash_if_different )
+		ok = ok && request_add( s, "flash-if-different", NULL );
+	if( req->stats )
+		ok = ok && request_add( s, "stats", NULL );
+	if( req->quiet )
+		ok = ok && request_add( s, "quiet", NULL );
+	if( req->progress != PROGRESS_BAR )
+		ok = ok && request_add( s, "progress", progress_mode_name( req->progress ) );
+	if( req->address != 0 )
+		g_string_append_printf( s, "address %i\n", req->address );
+	g_string_append_c( s, '\n' );
+
+	ok = ok && write_all( fd, s->str, s->len );
+	g_string_free( s, TRUE );
+	return ok;
+}
+
+gboolean job_request_read( int fd, job_request_t *req )
+{
+	GString *s = g_string_new( "" );
+	gchar **lines, **l;
+	gboolean ok = TRUE;
+	char c;
+
+	memset( req, 0, sizeof(*req) );
+
+	/* Read up to the empty line.  The client waits for an answer after
+	   it, so there's nothing to over-read. */
+	while( s->len < 2 || strcmp( s->str + s->len - 2, "\n\n" ) != 0 ) {
+		ssize_t r = read( fd, &c, 1 );
+
+		if( r < 0 && errno == EINTR )
+			continue;
+		if( r <= 0 || c == '\0' || s->len == REQUEST_MAX ) {
+			g_string_free( s, TRUE );
+			return FALSE;
+		}
+		g_string_append_c( s, c );
+	}
+
+	lines = g_strsplit( s->str, "\n", 0 );
+	g_string_free( s, TRUE );
+
+	for( l = lines; *l != NULL && **l != '\0' && ok; l++ ) {
+		char *val = strchr( *l, ' ' );
+
+		if( val != NULL )
+			*val++ = '\0';
+
+		if( strcmp( *l, "force" ) == 0 )
+			req->force = TRUE;
+		else if( strcmp( *l, "no-delta" ) == 0 )
+			req->no_delta = TRUE;
+		else if( strcmp( *l, "plan" ) == 0 )
+			req->plan = TRUE;
+		else if( strcmp( *l, "verify" ) == 0 )
+			req->verify = TRUE;
+		else if( strcmp( *l, "flash-if-different" ) == 0 )
+			req->flash_if_different = TRUE;
+		else if( strcmp( *l, "stats" ) == 0 )
+			req->stats = TRUE;
+		else if( strcmp( *l, "quiet" ) == 0 )
+			req->quiet = TRUE;
+		else if( val == NULL )
+			ok = FALSE;
+		else if( strcmp( *l, "name" ) == 0 && req->name == NULL )
+			req->name = g_strdup( val );
+		else if( strcmp( *l, "manifest" ) == 0 && req->manifest == NULL )
+			req->manifest = g_strdup( val );
+		else if( strcmp( *l, "fw" ) == 0 && req->n_fw < 2 )
+			req->fw[req->n_fw++] = g_strdup( val );
+		else if( strcmp( *l, "address" ) == 0 )
+			req->address = atoi( val );
+		else if( strcmp( *l, "progress" ) == 0 )
+			ok = progress_mode_parse( val, &req->progress );
+		else
+			ok = FALSE;
+	}
+	g_strfreev( lines );
+
+	if( !ok )
+		job_request_free( req );
+	return ok;
+}
+
+void job_request_free( job_request_t *req )
+{
+	guint i;
+
+	g_free( req->name );
+	g_free( req->manifest );
+	for( i=0; i<req->n_fw; i++ )
+		g_free( req->fw[i] );
+	memset( req, 0, sizeof(*req) );
+}
+
+void job_status_write( int fd, int status )
+{
+	char buf[16];
+	int len;
+
+	len = g_snprintf( buf + 1, sizeof(buf) - 1, "%i", status );
+	buf[0] = '\0';
+	write_all( fd, buf, len + 1 );
+}
+
+int job_output_relay( int fd, int out )
+{
+	char buf[512];
+	GString *status = NULL;
+	ssize_t r;
+
+	while( (r = read( fd, buf, sizeof(buf) )) != 0 ) {
+		char *end;
+
+		if( r < 0 ) {
+			if( errno == EINTR )
+				continue;
+			break;
+		}
+
+		if( status != NULL ) {
+			g_string_append_len( status, buf, r );
+			continue;
+		}
+
+		/* The job's output is text, so the first NUL ends it */
+		end = memchr( buf, '\0', r );
+		if( end == NULL ) {
+			write_all( out, buf, r );
+			continue;
+		}
+
+		write_all( out, buf, end - buf );
+		status = g_string_new_len( end + 1, r - (end + 1 - buf) );
+	}
+
+	if( status == NULL )
+		return -1;
+
+	r = status->len > 0 ? atoi( status->str ) : -1;
+	g_string_free( status, TRUE );
+	return r;
+}
+
+static gboolean socket_addr( const char *path, struct sockaddr_un *addr )
+{
+	memset( addr, 0, sizeof(*addr) );
+	addr->sun_family = AF_UNIX;
+
+	if( strlen( path ) >= sizeof(addr->sun_path) )
+		return FALSE;
+	strcpy( addr->sun_path, path );
+	return TRUE;
+}
+
+static gboolean write_all( int fd, const char *buf, size_t len )
+{
+	while( len > 0 ) {
+		ssize_t w = write( fd, buf, len );
+
+		if( w < 0 ) {
+			if( errno == EINTR )
+				continue;
+			return FALSE;
+		}
+
+		buf += w;
+		len -= w;
+	}
+
+	return TRUE;
+}
+
+static gboolean request_add( GString *s, const char *key, const char *val )
+{
+	if( val == NULL ) {
+		g_string_append_printf( s, "%s\n", key );
+		return TRUE;
+	}
+
+	if( *val == '\0' || strchr( val, '\n' ) != NULL )
+		return FALSE;
+
+	g_string_append_printf( s, "%s %s\n", key, val );
+	return TRUE;
+}
@@ -0,0 +1,72 @@
+/*  This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA. */
+/* The Unix domain socket that jobs are passed to a running flashb
+   daemon over.  The client sends a request, the daemon sends back
+   everything the job prints, followed by a NUL byte and the job's exit
+   status. */
+#ifndef __JOB_SOCKET
+#define __JOB_SOCKET
+#include <glib.h>
+#include "progress.h"
+
+typedef struct {
+	/* Config file section of the board type to flash, or NULL */
+	char *name;
+	/* Manifest to flash from, or NULL */
+	char *manifest;
+	/* Firmware for the named board type: two ELF files or a bundle.
+	   With no name, manifest or firmware the daemon flashes the
+	   firmware it was started with. */
+	char *fw[2];
+	guint n_fw;
+
+	gboolean force;
+	gboolean no_delta;
+	gboolean plan;
+	gboolean verify;
+	gboolean flash_if_different;
+	gboolean stats;
+	gboolean quiet;
+	progress_mode_t progress;
+	gint address;
+} job_request_t;
+
+/* Listen for jobs on the socket at the given path, replacing any
+   socket left there by an earlier daemon.
+   Returns the listening fd, or -1 on error. */
+int job_socket_listen( const char *path );
+
+/* Connect to the daemon listening at the given path.
+   Returns the fd, or -1 on error. */
+int job_socket_connect( const char *path );
+
+/* Send a request.  Paths must already be absolute.
+   Returns FALSE if it couldn't be sent. */
+gboolean job_request_write( int fd, const job_request_t *req );
+
+/* Read a request sent by job_request_write.
+   Returns FALSE if the client went away or sent nonsense. */
+gboolean job_request_read( int fd, job_request_t *req );
+
+/* Free the strings in a request read by job_request_read */
+void job_request_free( job_request_t *req );
+
+/* Send the end of a job's output and its exit status */
+void job_status_write( int fd, int status );
+
+/* Copy the daemon's output to the given fd until the job finishes.
+   Returns the job's exit status, or -1 if the daemon went away. */
+int job_output_relay( int fd, int out );
+
+#endif	/* __JOB_SOCKET */
@@ -0,0 +1,201 @@
+/*  This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA. */
+#include "journal.h"
+#include "fw-cache.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/* The first line of a journal file.  Each line after it is:
+   bus board_type address addr version crc chunk_size offset state
+   where state is "done" or "sending". */
+#define JOURNAL_MAGIC "# flashb journal 1"
+
+char *journal_fname = NULL;
+
+/* The entries, in the order they were added */
+static GArray *entries = NULL;
+G_LOCK_DEFINE_STATIC( entries );
+
+/* Returns the filename of the journal */
+static gchar* journal_get_fname( void );
+
+/* Returns the entry for the given board, or NULL if there isn't one.
+   Must be called with the lock held. */
+static journal_entry_t* find_entry( uint8_t bus, uint8_t board_type, int address );
+
+void journal_load( void )
+{
+	gchar *fname, *contents;
+	gchar **lines, **l;
+
+	if( entries == NULL )
+		entries = g_array_new( FALSE, FALSE, sizeof(journal_entry_t) );
+	g_array_set_size( entries, 0 );
+
+	fname = journal_get_fname();
+	if( !g_file_get_contents( fname, &contents, NULL, NULL ) ) {
+		g_free( fname );
+		return;
+	}
+	g_free( fname );
+
+	lines = g_strsplit( contents, "\n", 0 );
+	g_free( contents );
+
+	if( lines[0] == NULL || strcmp( lines[0], JOURNAL_MAGIC ) != 0 ) {
+		g_strfreev( lines );
+		return;
+	}
+
+	for( l = lines + 1; *l != NULL; l++ ) {
+		journal_entry_t e;
+		unsigned int bus, type, addr, version, crc, chunk_size;
+		char state[8];
+
+		if( sscanf( *l, "%u %u %i %x %x %x %u %u %7s",
+			    &bus, &type, &e.address, &addr, &version, &crc,
+			    &chunk_size, &e.offset, state ) != 9 )
+			continue;
+
+		e.bus = bus;
+		e.board_type = type;
+		e.addr = addr;
+		e.version = version;
+		e.crc = crc;
+		e.chunk_size = chunk_size;
+		e.done = strcmp( state, "done" ) == 0;
+
+		journal_set( &e );
+	}
+
+	g_strfreev( lines );
+}
+
+gboolean journal_find( uint8_t bus,
+		       uint8_t board_type,
+		       int address,
+		       journal_entry_t *entry )
+{
+	journal_entry_t *e;
+
+	g_assert( entry != NULL );
+
+	G_LOCK( entries );
+	e = find_entry( bus, board_type, address );
+	if( e != NULL )
+		*entry = *e;
+	G_UNLOCK( entries );
+
+	return e != NULL;
+}
+
+void journal_set( const journal_entry_t *entry )
+{
+	journal_entry_t *e;
+
+	g_assert( entry != NULL );
+
+	G_LOCK( entries );
+	if( entries == NULL )
+		entries = g_array_new( FALSE, FALSE, sizeof(journal_entry_t) );
+
+	e = find_entry( entry->bus, entry->board_type, entry->address );
+	if( e != NULL )
+		*e = *entry;
+	else
+		g_array_append_val( entries, *entry );
+	G_UNLOCK( entries );
+}
+
+gboolean journal_save( void )
+{
+	gchar *fname, *dir;
+	GString *s;
+	gboolean r;
+	guint i;
+
+	fname = journal_get_fname();
+	dir = g_path_get_dirname( fname );
+	if( g_mkdir_with_parents( dir, 0755 ) != 0 ) {
+		g_free( dir );
+		g_free( fname );
+		return FALSE;
+	}
+	g_free( dir );
+
+	G_LOCK( entries );
+	s = g_string_new( JOURNAL_MAGIC "\n" );
+	for( i=0; entries != NULL && i<entries->len; i++ ) {
+		journal_entry_t *e = &g_array_index( entries, journal_entry_t, i );
+
+		g_string_append_printf( s, "%hhu %hhu %i %4.4hx %4.4hx %4.4hx %hu %u %s\n",
+					e->bus, e->board_type, e->address, e->addr,
+					e->version, e->crc, e->chunk_size,
+					e->offset, e->done ? "done" : "sending" );
+	}
+
+	/* Written to a temporary file and renamed, so a run that's
+	   interrupted part way through leaves the old journal intact.
+	   The lock is held until it's there, so that an older journal
+	   can't replace a newer one. */
+	r = g_file_set_contents( fname, s->str, s->len, NULL );
+	G_UNLOCK( entries );
+
+	g_string_free( s, TRUE );
+	g_free( fname );
+	return r;
+}
+
+void journal_clear( void )
+{
+	gchar *fname;
+
+	G_LOCK( entries );
+	if( entries != NULL )
+		g_array_set_size( entries, 0 );
+
+	fname = journal_get_fname();
+	unlink( fname );
+	g_free( fname );
+	G_UNLOCK( entries );
+}
+
+static journal_entry_t* find_entry( uint8_t bus, uint8_t board_type, int address )
+{
+	guint i;
+
+	if( entries == NULL )
+		return NULL;
+
+	for( i=0; i<entries->len; i++ ) {
+		journal_entry_t *e = &g_array_index( entries, journal_entry_t, i );
+
+		if( e->bus == bus && e->board_type == board_type && e->address == address )
+			return e;
+	}
+
+	return NULL;
+}
+
+static gchar* journal_get_fname( void )
+{
+	if( journal_fname != NULL )
+		return g_strdup( journal_fname );
+
+	if( fw_cache_dir != NULL )
+		return g_build_filename( fw_cache_dir, "journal", NULL );
+
+	return g_build_filename( g_get_user_cache_dir(), "flashb", "journal", NULL );
+}
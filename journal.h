@@ -0,0 +1,71 @@
+/*  This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA. */
+
+/* A record of how far each board got during a run, so that a run that
+   was interrupted, or that lost touch with some of its boards, can be
+   carried on from where it stopped rather than started again. */
+#ifndef __JOURNAL
+#define __JOURNAL
+#include <stdint.h>
+#include <glib.h>
+
+typedef struct {
+	/* The board, as for fw_cache_load */
+	uint8_t bus;
+	uint8_t board_type;
+	int address;
+
+	/* Base address of the half being written */
+	uint16_t addr;
+	/* Version and CRC of the text section being sent to it, and the
+	   chunk size it was sent with */
+	uint16_t version;
+	uint16_t crc;
+	uint16_t chunk_size;
+
+	/* Number of bytes of the text section the board had received */
+	uint32_t offset;
+	/* TRUE once the board is running the new firmware */
+	gboolean done;
+} journal_entry_t;
+
+/* File the journal is kept in.
+   Defaults to "journal" in the firmware cache directory. */
+extern char *journal_fname;
+
+/* The journal may be used by the threads flashing several buses at
+   once. */
+
+/* Read the journal left by an earlier run, if there is one */
+void journal_load( void );
+
+/* Copy the journal entry for the given board into *entry.
+   Returns FALSE if there isn't one. */
+gboolean journal_find( uint8_t bus,
+		       uint8_t board_type,
+		       int address,
+		       journal_entry_t *entry );
+
+/* Add an entry to the journal, replacing any for the same board.
+   The journal isn't written out until journal_save is called. */
+void journal_set( const journal_entry_t *entry );
+
+/* Write the journal out.
+   Returns FALSE if it couldn't be written. */
+gboolean journal_save( void );
+
+/* Forget about all boards, and remove the journal file */
+void journal_clear( void );
+
+#endif	/* __JOURNAL */
@@ -0,0 +1,161 @@
+/*  This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA. */
+
+/* Round trip tests of the CMD_FW_ZCHUNK compression.
+   Exits with status 1 if any of them fail. */
+#include <glib.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lz.h"
+
+/* Length of each test input */
+#define TEST_LEN 1000
+
+/* Compress the input, decompress it again with the bootloader's
+   decompressor and check that it comes back the same.  If max_out isn't
+   0, the compressed data must be no longer than that.
+   Returns TRUE if it passed. */
+static gboolean test_round_trip( const char *name,
+				 const uint8_t *in, uint32_t len,
+				 uint32_t max_out );
+
+/* Check that compressing into too small a buffer fails cleanly, and
+   that corrupt data is refused rather than decompressed.
+   Returns TRUE if it passed. */
+static gboolean test_limits( void );
+
+int main( int argc, char** argv )
+{
+	uint8_t in[TEST_LEN];
+	uint32_t i, r = 0x1234;
+	gboolean ok = TRUE;
+
+	memset( in, 0xff, TEST_LEN );
+	ok = test_round_trip( "empty", in, 0, 0 ) && ok;
+	ok = test_round_trip( "all 0xff", in, TEST_LEN, TEST_LEN / 32 ) && ok;
+
+	for( i=0; i<TEST_LEN; i++ ) {
+		r = r * 1103515245 + 12345;
+		in[i] = r >> 16;
+	}
+	ok = test_round_trip( "incompressible", in, TEST_LEN, 0 ) && ok;
+
+	/* Copies from one, two and three bytes back, each longer than
+	   the distance it reaches back */
+	for( i=0; i<TEST_LEN; i++ )
+		in[i] = i < 300 ? 0x55 : i < 600 ? "ab"[i % 2] : "xyz"[i % 3];
+	ok = test_round_trip( "overlapping copies", in, TEST_LEN, 32 ) && ok;
+
+	/* The longest copy, and the furthest back one can reach */
+	for( i=0; i<LZ_MAX_OFFSET; i++ ) {
+		r = r * 1103515245 + 12345;
+		in[i] = r >> 16;
+	}
+	for( ; i<TEST_LEN; i++ )
+		in[i] = in[i - LZ_MAX_OFFSET];
+	ok = test_round_trip( "longest reach", in, TEST_LEN,
+			      LZ_MAX_OFFSET + LZ_MAX_OFFSET / 128 + 1
+			      + 2 * (TEST_LEN / LZ_MAX_MATCH + 1) ) && ok;
+
+	ok = test_limits() && ok;
+
+	return ok ? 0 : 1;
+}
+
+static gboolean test_round_trip( const char *name,
+				 const uint8_t *in, uint32_t len,
+				 uint32_t max_out )
+{
+	/* Incompressible data gains a byte for every 128 */
+	uint8_t z[TEST_LEN + TEST_LEN / 128 + 1];
+	uint8_t out[TEST_LEN];
+	uint32_t done = 0;
+	int32_t zlen, olen;
+
+	zlen = lz_compress( in, len, z, sizeof(z), &done );
+	if( zlen < 0 ) {
+		g_print( "FAIL %s: didn't fit in %u bytes, %u done\n",
+			 name, (unsigned int)sizeof(z), done );
+		return FALSE;
+	}
+
+	/* Only empty input compresses to nothing */
+	if( (zlen == 0) != (len == 0) ) {
+		g_print( "FAIL %s: %u bytes compressed to %i\n", name, len, zlen );
+		return FALSE;
+	}
+
+	if( max_out != 0 && (uint32_t)zlen > max_out ) {
+		g_print( "FAIL %s: compressed to %i bytes, expected no more than %u\n",
+			 name, zlen, max_out );
+		return FALSE;
+	}
+
+	olen = lz_decompress( z, zlen, out, sizeof(out) );
+	if( olen != (int32_t)len || memcmp( in, out, len ) != 0 ) {
+		g_print( "FAIL %s: %u bytes came back as %i different ones\n",
+			 name, len, olen );
+		return FALSE;
+	}
+
+	g_print( "ok %s: %u bytes to %i\n", name, len, zlen );
+	return TRUE;
+}
+
+static gboolean test_limits( void )
+{
+	uint8_t in[TEST_LEN], z[TEST_LEN], out[TEST_LEN];
+	uint32_t i, done = 0;
+	int32_t zlen;
+	gboolean ok = TRUE;
+
+	for( i=0; i<TEST_LEN; i++ )
+		in[i] = i * 7;
+
+	/* 10 bytes only has room for 9 literals */
+	if( lz_compress( in, TEST_LEN, z, 10, &done ) != -1 || done > 9 ) {
+		g_print( "FAIL too small: claimed %u bytes fitted in 10\n", done );
+		ok = FALSE;
+	}
+
+	zlen = lz_compress( in, TEST_LEN, z, sizeof(z), &done );
+
+	/* The output must fit */
+	if( lz_decompress( z, zlen, out, TEST_LEN - 1 ) != -1 ) {
+		g_print( "FAIL short output: decompressed past the end\n" );
+		ok = FALSE;
+	}
+
+	/* A copy from before the start, and a copy missing its offset */
+	z[0] = 0x80;
+	z[1] = 0;
+	if( lz_decompress( z, 2, out, sizeof(out) ) != -1
+	    || lz_decompress( z, 1, out, sizeof(out) ) != -1 ) {
+		g_print( "FAIL corrupt: decompressed a bad copy\n" );
+		ok = FALSE;
+	}
+
+	/* Literals running off the end */
+	z[0] = 0x10;
+	if( lz_decompress( z, 4, out, sizeof(out) ) != -1 ) {
+		g_print( "FAIL corrupt: decompressed missing literals\n" );
+		ok = FALSE;
+	}
+
+	if( ok )
+		g_print( "ok limits\n" );
+	return ok;
+}
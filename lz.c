@@ -0,0 +1,121 @@
+/*  This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA. */
+#include "lz.h"
+
+/* Add n literal bytes to the output at *o, in runs of up to 128.
+   Returns 0 if they don't fit. */
+static int put_literals( const uint8_t *lit, uint32_t n,
+			 uint8_t *out, uint32_t max, uint32_t *o );
+
+int32_t lz_compress( const uint8_t *in, uint32_t len,
+		     uint8_t *out, uint32_t max,
+		     uint32_t *done )
+{
+	/* Start of the literals waiting to be written */
+	uint32_t lit = 0;
+	uint32_t i = 0, o = 0;
+
+	while( i < len ) {
+		uint32_t best = 0, best_off = 0, off;
+
+		/* Longest match within reach */
+		for( off = 1; off <= LZ_MAX_OFFSET && off <= i; off++ ) {
+			uint32_t l = 0;
+
+			while( i + l < len && l < LZ_MAX_MATCH
+			       && in[i + l] == in[i + l - off] )
+				l++;
+
+			if( l > best ) {
+				best = l;
+				best_off = off;
+				if( l == LZ_MAX_MATCH )
+					break;
+			}
+		}
+
+		if( best < 3 ) {
+			i++;
+			continue;
+		}
+
+		if( !put_literals( in + lit, i - lit, out, max, &o ) )
+			break;
+		if( o + 2 > max )
+			break;
+
+		out[o++] = 0x80 | (best - 3);
+		out[o++] = best_off - 1;
+		i += best;
+		lit = i;
+	}
+
+	if( i >= len && put_literals( in + lit, len - lit, out, max, &o ) )
+		return o;
+
+	*done = lit;
+	return -1;
+}
+
+int32_t lz_decompress( const uint8_t *in, uint32_t len,
+		       uint8_t *out, uint32_t max )
+{
+	uint32_t i = 0, o = 0;
+
+	while( i < len ) {
+		uint8_t t = in[i++];
+		uint32_t n;
+
+		if( t < 0x80 ) {
+			n = t + 1;
+			if( i + n > len || o + n > max )
+				return -1;
+
+			while( n-- )
+				out[o++] = in[i++];
+		} else {
+			uint32_t off;
+
+			if( i == len )
+				return -1;
+			n = (t & 0x7f) + 3;
+			off = in[i++] + 1;
+			if( off > o || o + n > max )
+				return -1;
+
+			/* Byte by byte, as the copy may overlap itself */
+			for( ; n > 0; n--, o++ )
+				out[o] = out[o - off];
+		}
+	}
+
+	return o;
+}
+
+static int put_literals( const uint8_t *lit, uint32_t n,
+			 uint8_t *out, uint32_t max, uint32_t *o )
+{
+	while( n > 0 ) {
+		uint32_t run = n > 128 ? 128 : n;
+
+		if( *o + 1 + run > max )
+			return 0;
+
+		out[(*o)++] = run - 1;
+		for( ; run > 0; run--, n-- )
+			out[(*o)++] = *lit++;
+	}
+
+	return 1;
+}
@@ -0,0 +1,45 @@
+/*  This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA. */
+
+/* The compression used for CMD_FW_ZCHUNK frames.
+   A small LZ77 variant, chosen so that the decompressor fits in the
+   bootloader.  The compressed data is a sequence of tokens:
+    0x00-0x7f: t+1 literal bytes follow
+    0x80-0xff: copy (t & 0x7f) + 3 bytes from o+1 bytes back in the
+               output, where o is the byte after the token
+   A copy may overlap the bytes it produces, so runs of one byte cost
+   two tokens. */
+#ifndef __LZ
+#define __LZ
+#include <stdint.h>
+
+/* Longest copy, and how far back a copy can reach */
+#define LZ_MAX_MATCH (0x7f + 3)
+#define LZ_MAX_OFFSET 256
+
+/* Compress len bytes from in into no more than max bytes of out.
+   Returns the compressed length, which is 0 only if len is, or -1 if it
+   didn't fit, in which case *done is set to the number of bytes of in
+   that did fit. */
+int32_t lz_compress( const uint8_t *in, uint32_t len,
+		     uint8_t *out, uint32_t max,
+		     uint32_t *done );
+
+/* Decompress len bytes from in into no more than max bytes of out.
+   Returns the decompressed length, or -1 if the data is corrupt or
+   doesn't fit. */
+int32_t lz_decompress( const uint8_t *in, uint32_t len,
+		       uint8_t *out, uint32_t max );
+
+#endif	/* __LZ */
@@ -14,22 +14,167 @@
     along with this program; if not, write to the Free Software
     Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA. */
 #include "msp430-fw.h"
+#include "crc16.h"
+#include "lz.h"
+#include "stats.h"
 
 /* Number of times to retry 'calling' the device */
 #define MSP430_FW_RETRIES 10
-/* How many milliseconds to wait for a response from a device */
+/* How many milliseconds to wait for a response from a device, before
+   its round trip time has been measured */
 #define MSP430_FW_TIMEOUT 200
+/* Bounds on the timeout worked out from the round trip time */
+#define MSP430_FW_TIMEOUT_MIN 20
+#define MSP430_FW_TIMEOUT_MAX 1000
+/* How many milliseconds to wait for a response when looking for a
+   device that is switching over to new firmware */
+#define MSP430_FW_PROBE_TIMEOUT 20
+/* How many times to look for a device that is switching over */
+#define MSP430_FW_SWITCH_PROBES 150
+/* How many times to look for a device before deciding it's not there */
+#define MSP430_FW_PROBE_ATTEMPTS 3
+/* How many milliseconds to wait before retrying a failed transaction.
+   Doubles with each retry, up to MSP430_FW_BACKOFF_MAX. */
+#define MSP430_FW_BACKOFF 5
+#define MSP430_FW_BACKOFF_MAX 100
+/* How many times to ask for the bootloader's capabilities.  Older
+   bootloaders never answer, so this is kept small. */
+#define MSP430_FW_CAPS_ATTEMPTS 3
 
-uint8_t commands[NUM_COMMANDS];
 uint8_t* msp430_fw_i2c_address = NULL;
-uint16_t msp430_fw_bottom = 0;
-uint16_t msp430_fw_top = 0;
+void (*msp430_fw_sleep)( gulong us ) = g_usleep;
+gint64 (*msp430_fw_clock)( void ) = g_get_monotonic_time;
 
-static void graph( char* str, uint16_t done, uint16_t total );
+/* Round trip times measured to one device */
+typedef struct {
+	transport_t *ctx;
+	int address;
+	/* Smoothed round trip time and its mean deviation in us, for each
+	   command.  srtt is 0 until the first has been measured. */
+	gint64 srtt[NUM_COMMANDS];
+	gint64 rttvar[NUM_COMMANDS];
+} fw_link_t;
 
-gboolean msp430_get_fw_version( sric_context ctx,
+/* Every device that's been talked to.  Shared by the threads flashing
+   several buses. */
+static GArray *links = NULL;
+G_LOCK_DEFINE_STATIC( links );
+
+
+/* Send a frame and wait for the reply over the transport, recording
+   statistics about the given command */
+static int fw_txrx( transport_t *ctx,
+		    uint8_t cmd,
+		    const sric_frame *msg,
+		    sric_frame *rtn,
+		    int timeout );
+
+/* Returns the link to the device at the given address, adding it if
+   it's new.  Must be called with the lock held. */
+static fw_link_t* link_find( transport_t *ctx, int address );
+
+/* Add a round trip time to the device's estimate for the command */
+static void link_sample( transport_t *ctx, int address, uint8_t cmd, gint64 rtt );
+
+/* Returns the timeout in ms for the command to the device */
+static int link_timeout( transport_t *ctx, int address, uint8_t cmd );
+
+/* Read the next address from the reply to a chunk, as sent by
+   bootloaders with MSP430_CAP_NEXT_ACK.
+   Returns FALSE if the reply is too short or doesn't check out. */
+static gboolean chunk_ack( const sric_frame *rtn, uint16_t *next );
+
+/* Send a frame that gets no reply, recording it in the statistics */
+static int fw_tx( transport_t *ctx,
+		  uint8_t cmd,
+		  const sric_frame *msg );
+
+/* As fw_txrx, but retry up to MSP430_FW_RETRIES times, backing off
+   between attempts */
+static int fw_txrx_retry( transport_t *ctx,
+			  uint8_t cmd,
+			  const sric_frame *msg,
+			  sric_frame *rtn );
+
+/* Start sending the given section, without talking to the device */
+static void set_section( msp430_xfer_t *xfer,
+			 elf_section_t *section,
+			 gboolean check_first );
+
+/* Returns the address of the first chunk at or after pos that needs
+   sending, skipping chunks that are already in flash */
+static uint32_t chunk_needed( const msp430_xfer_t *xfer, uint32_t pos );
+
+/* Returns TRUE if every byte of the chunk is 0xff */
+static gboolean chunk_erased( const uint8_t *chunk, uint32_t len );
+
+/* Compress as many of the chunks from pos as will fit in one frame, up
+   to max of them, stopping at any that don't need sending.
+   Returns the number compressed into zdata, with the compressed length
+   in *zlen, or 0 if they're better sent as they are. */
+static uint8_t zip_chunks( const msp430_xfer_t *xfer,
+			   uint32_t pos,
+			   uint8_t max,
+			   uint8_t *zdata,
+			   uint16_t *zlen );
+
+/* Read the firmware version, waiting timeout ms for the reply */
+static gboolean get_fw_version( transport_t *ctx,
+				const msp430_board_t *board,
+				const sric_device *device,
+				int timeout,
+				uint16_t *ver );
+
+/* Read the next address once, waiting timeout ms for the reply.
+   Returns FALSE if there was no reply. */
+static gboolean probe_next_address( transport_t *ctx,
+				    const msp430_board_t *board,
+				    const sric_device *device,
+				    int timeout,
+				    uint16_t *next );
+
+/* Find the chunks in len bytes of section from addr that don't match
+   the device's flash, and invert them in image.  known_bad is TRUE if
+   it's already known that some of them don't match.
+   Returns FALSE if the device stopped answering. */
+static gboolean crc_bisect( transport_t *ctx,
+			    const msp430_board_t *board,
+			    const sric_device *device,
+			    const elf_section_t *section,
+			    elf_section_t *image,
+			    uint32_t addr,
+			    uint32_t len,
+			    uint16_t chunk_size,
+			    gboolean known_bad,
+			    uint32_t *bad );
+
+gboolean msp430_probe( transport_t *ctx,
+		       const msp430_board_t *board,
+		       const sric_device *device )
+{
+	uint16_t next;
+	uint8_t i;
+
+	for( i=0; i<MSP430_FW_PROBE_ATTEMPTS; i++ )
+		if( probe_next_address( ctx, board, device, MSP430_FW_PROBE_TIMEOUT, &next ) )
+			return TRUE;
+
+	return FALSE;
+}
+
+gboolean msp430_get_fw_version( transport_t *ctx,
+                                const msp430_board_t *board,
                                 const sric_device *device,
                                 uint16_t *ver)
+{
+	return get_fw_version( ctx, board, device, MSP430_FW_TIMEOUT, ver );
+}
+
+static gboolean get_fw_version( transport_t *ctx,
+				const msp430_board_t *board,
+				const sric_device *device,
+				int timeout,
+				uint16_t *ver )
 {
 	g_assert( ver != NULL );
 
@@ -37,9 +182,9 @@ gboolean msp430_get_fw_version( sric_context ctx,
 	msg.address = device->address;
 	msg.note = -1;
 	msg.payload_length = 1;
-	msg.payload[0] = commands[CMD_FW_VER];
+	msg.payload[0] = board->commands[CMD_FW_VER];
 
-	if (sric_txrx(ctx, &msg, &rtn, MSP430_FW_TIMEOUT)) {
+	if (fw_txrx(ctx, CMD_FW_VER, &msg, &rtn, timeout)) {
 		/* It's not a fatal error if the firmware version cannot be read,
 		 * this allows the board to be skipped. */
 		return FALSE;
@@ -51,140 +196,865 @@ gboolean msp430_get_fw_version( sric_context ctx,
 	return TRUE;
 }
 
-uint16_t msp430_get_next_address( sric_context ctx, const sric_device *device )
+uint16_t msp430_get_caps( transport_t *ctx,
+			  const msp430_board_t *board,
+			  const sric_device *device,
+			  uint16_t *max_chunk,
+			  uint8_t *max_zchunks )
+{
+	uint16_t caps;
+	uint8_t i;
+	int r;
+
+	g_assert( max_chunk != NULL && max_zchunks != NULL );
+	*max_chunk = CHUNK_SIZE;
+	*max_zchunks = 1;
+
+	if( !board->command_present[CMD_FW_CAPS] )
+		return 0;
+
+	sric_frame msg, rtn;
+	msg.address = device->address;
+	msg.note = -1;
+	msg.payload_length = 1;
+	msg.payload[0] = board->commands[CMD_FW_CAPS];
+
+	/* Older bootloaders won't answer this.  Ones that do must not be
+	   mistaken for them because of one lost reply. */
+	for( i=0; i<MSP430_FW_CAPS_ATTEMPTS; i++ ) {
+		r = fw_txrx(ctx, CMD_FW_CAPS, &msg, &rtn, MSP430_FW_TIMEOUT);
+		if( r == 0 )
+			break;
+	}
+
+	if( r || rtn.payload_length < 2 )
+		return 0;
+
+	/* Format of reply:
+	   0-1: Capability bits (0 is lsb)
+	     2: Largest chunk size accepted (optional)
+	     3: Most chunks in one compressed frame (optional) */
+	caps = rtn.payload[0];
+	caps |= rtn.payload[1] << 8;
+
+	if( rtn.payload_length >= 3 && rtn.payload[2] != 0 )
+		*max_chunk = rtn.payload[2];
+	if( rtn.payload_length >= 4 && rtn.payload[3] != 0 )
+		*max_zchunks = rtn.payload[3];
+
+	return caps;
+}
+
+gboolean msp430_get_crc( transport_t *ctx,
+			 const msp430_board_t *board,
+			 const sric_device *device,
+			 uint16_t *crc )
+{
+	g_assert( crc != NULL );
+
+	sric_frame msg, rtn;
+	msg.address = device->address;
+	msg.note = -1;
+	msg.payload_length = 1;
+	msg.payload[0] = board->commands[CMD_FW_CRCR];
+
+	if (fw_txrx_retry(ctx, CMD_FW_CRCR, &msg, &rtn)
+	    || rtn.payload_length < 2)
+		return FALSE;
+
+	*crc = rtn.payload[0];
+	*crc |= rtn.payload[1] << 8;
+
+	return TRUE;
+}
+
+gboolean msp430_get_crc_range( transport_t *ctx,
+			       const msp430_board_t *board,
+			       const sric_device *device,
+			       uint16_t addr,
+			       uint16_t len,
+			       uint16_t *crc )
+{
+	g_assert( crc != NULL );
+
+	/* Format of request:
+	   0-1: Start address (0 is lsb)
+	   2-3: Length (2 is lsb)
+	   Format of reply:
+	   0-1: CRC (0 is lsb) */
+
+	sric_frame msg, rtn;
+	msg.address = device->address;
+	msg.note = -1;
+	msg.payload_length = 5;
+	msg.payload[0] = board->commands[CMD_FW_CRCR];
+	msg.payload[1] = addr & 0xff;
+	msg.payload[2] = (addr >> 8) & 0xff;
+	msg.payload[3] = len & 0xff;
+	msg.payload[4] = (len >> 8) & 0xff;
+
+	if (fw_txrx_retry(ctx, CMD_FW_CRCR, &msg, &rtn)
+	    || rtn.payload_length < 2)
+		return FALSE;
+
+	*crc = rtn.payload[0];
+	*crc |= rtn.payload[1] << 8;
+
+	return TRUE;
+}
+
+gboolean msp430_join_group( transport_t *ctx,
+			    const msp430_board_t *board,
+			    const sric_device *device,
+			    int group )
+{
+	/* Format of request:
+	   0: Group address
+	   The reply is empty. */
+
+	sric_frame msg, rtn;
+	msg.address = device->address;
+	msg.note = -1;
+	msg.payload_length = 2;
+	msg.payload[0] = board->commands[CMD_FW_GROUP];
+	msg.payload[1] = group;
+
+	return fw_txrx_retry(ctx, CMD_FW_GROUP, &msg, &rtn) == 0;
+}
+
+void msp430_send_group_section( transport_t *ctx,
+				const msp430_board_t *board,
+				int group,
+				const sric_device *pace,
+				uint16_t caps,
+				uint16_t chunk_size,
+				const elf_section_t *section )
+{
+	uint32_t pos, end = section->addr + section->len;
+	uint16_t sent = 0, next;
+
+	g_assert( chunk_size <= MSP430_MAX_SKIP_CHUNK );
+	g_assert( section->addr % chunk_size == 0 );
+
+	/* As msp430_send_block_from, except that the address it must be
+	   expecting is ignored */
+	for( pos = section->addr; pos + chunk_size < end; pos += chunk_size ) {
+		sric_frame msg;
+
+		msg.address = group;
+		msg.note = -1;
+		msg.payload_length = 1+6+chunk_size;
+		msg.payload[0] = board->commands[CMD_FW_CHUNK];
+		msg.payload[1] = 0;
+		msg.payload[2] = 0;
+		msg.payload[3] = pos & 0xff;
+		msg.payload[4] = (pos >> 8) & 0xff;
+		msg.payload[5] = pos & 0xff;
+		msg.payload[6] = (pos >> 8) & 0xff;
+		g_memmove(msg.payload+7, section->data + (pos - section->addr), chunk_size);
+
+		fw_tx( ctx, CMD_FW_CHUNK, &msg );
+
+		/* Whether it answers or not, it's had time to write them */
+		if( ++sent == board->window ) {
+			msp430_get_next_address( ctx, board, pace, caps, &next );
+			sent = 0;
+		}
+	}
+}
+
+elf_section_t* msp430_crc_bisect( transport_t *ctx,
+				  const msp430_board_t *board,
+				  const sric_device *device,
+				  const elf_section_t *section,
+				  uint16_t chunk_size,
+				  uint32_t *bad )
+{
+	elf_section_t *image;
+
+	g_assert( section != NULL && bad != NULL );
+
+	image = g_malloc0( sizeof(elf_section_t) );
+	image->addr = section->addr;
+	image->len = section->len;
+	image->name = section->name;
+	image->data = g_malloc( section->len );
+	memcpy( image->data, section->data, section->len );
+
+	*bad = 0;
+	if( !crc_bisect( ctx, board, device, section, image,
+			 section->addr, section->len, chunk_size, FALSE, bad ) ) {
+		g_free( image->data );
+		g_free( image );
+		return NULL;
+	}
+
+	return image;
+}
+
+elf_section_t* msp430_crc_mend( transport_t *ctx,
+				const msp430_board_t *board,
+				const sric_device *device,
+				uint16_t caps,
+				const elf_section_t *section,
+				uint16_t chunk_size,
+				uint32_t *bad )
+{
+	const uint16_t needed = MSP430_CAP_CRC_RANGE | MSP430_CAP_KEEP;
+
+	*bad = 0;
+	if( (caps & needed) != needed )
+		return NULL;
+
+	return msp430_crc_bisect( ctx, board, device, section, chunk_size, bad );
+}
+
+uint16_t msp430_image_crc( uint16_t text_crc,
+			   const elf_section_t *text,
+			   const elf_section_t *vectors,
+			   uint16_t chunk_size )
+{
+	uint16_t crc = text_crc;
+	uint32_t rem = text->len % chunk_size;
+
+	/* The last chunk of the text section is padded with 0xaa */
+	if( rem != 0 ) {
+		uint8_t b[MSP430_MAX_CHUNK];
+
+		memset( b, 0xaa, chunk_size - rem );
+		crc = crc16( crc, b, chunk_size - rem );
+	}
+
+	return crc16( crc, vectors->data, vectors->len );
+}
+
+static gboolean crc_bisect( transport_t *ctx,
+			    const msp430_board_t *board,
+			    const sric_device *device,
+			    const elf_section_t *section,
+			    elf_section_t *image,
+			    uint32_t addr,
+			    uint32_t len,
+			    uint16_t chunk_size,
+			    gboolean known_bad,
+			    uint32_t *bad )
+{
+	uint32_t n, half, before, i;
+	uint16_t crc;
+
+	if( !known_bad ) {
+		if( !msp430_get_crc_range( ctx, board, device, addr, len, &crc ) )
+			return FALSE;
+
+		if( crc == crc16( CRC16_INIT, section->data + (addr - section->addr), len ) )
+			return TRUE;
+	}
+
+	if( len <= chunk_size ) {
+		/* Make sure it's sent again */
+		for( i=0; i<len; i++ )
+			image->data[addr - image->addr + i] ^= 0xff;
+		(*bad)++;
+		return TRUE;
+	}
+
+	/* Split on a chunk boundary.  If the first half matches, the
+	   second half can't, so it doesn't need asking about. */
+	n = (len + chunk_size - 1) / chunk_size;
+	half = (n / 2) * chunk_size;
+	before = *bad;
+
+	if( !crc_bisect( ctx, board, device, section, image,
+			 addr, half, chunk_size, FALSE, bad ) )
+		return FALSE;
+
+	return crc_bisect( ctx, board, device, section, image,
+			   addr + half, len - half, chunk_size, *bad == before, bad );
+}
+
+gboolean msp430_get_next_address( transport_t *ctx,
+				  const msp430_board_t *board,
+				  const sric_device *device,
+				  uint16_t caps,
+				  uint16_t *next )
 {
 	uint16_t r1, r2;
+	uint8_t i;
+
+	g_assert( next != NULL );
+
+	for( i=0; i<MSP430_FW_RETRIES; i++ ) {
+		if( caps & MSP430_CAP_NEXT_CHECK ) {
+			/* fw_txrx_retry has already tried again if there
+			   was no reply, so only a reply that failed its
+			   check is worth asking for again */
+			switch( msp430_get_next_address_checked( ctx, board, device, next ) ) {
+			case MSP430_NEXT_OK:
+				return TRUE;
+			case MSP430_NEXT_NO_REPLY:
+				return FALSE;
+			default:
+				break;
+			}
+		}
+		else {
+			if( !msp430_get_next_address_once( ctx, board, device, &r1 )
+			    || !msp430_get_next_address_once( ctx, board, device, &r2 ) )
+				return FALSE;
 
-	do {
-		r1 = msp430_get_next_address_once(ctx, device);
-		r2 = msp430_get_next_address_once(ctx, device);
-	} while ( r1 != r2 );
+			if( r1 == r2 ) {
+				*next = r1;
+				return TRUE;
+			}
+		}
+
+		stats_count( STATS_NEXT_REREAD );
+	}
 
-	return r1;
+	return FALSE;
 }
 
-void msp430_send_block( sric_context ctx,
-			const sric_device *device,
-			uint16_t fw_ver,
-			uint16_t addr,
-			uint8_t *chunk )
+gboolean msp430_send_block( transport_t *ctx,
+			    const msp430_board_t *board,
+			    const sric_device *device,
+			    uint16_t fw_ver,
+			    uint16_t addr,
+			    uint8_t *chunk,
+			    uint16_t len,
+			    uint16_t *next )
 {
-	uint8_t b[4 + CHUNK_SIZE];
+	uint8_t b[4 + MSP430_MAX_CHUNK];
+
+	g_assert( len <= MSP430_MAX_CHUNK );
 
 	/* Format:
 	   0-1: Firmware version (1 is lsb)
 	   2-3: Address (3 is lsb)
-	   4-19: The data */
+	   4-: The data */
 
 	b[0] = fw_ver & 0xff;
 	b[1] = (fw_ver >> 8) & 0xff;
 	b[2] = addr & 0xff;
 	b[3] = (addr >> 8) & 0xff;
 
-	g_memmove( b + 4, chunk, CHUNK_SIZE );
+	g_memmove( b + 4, chunk, len );
 
 	sric_frame msg, rtn;
 	msg.address = device->address;
 	msg.note = -1;
-	msg.payload_length = 1+4+CHUNK_SIZE;
-	msg.payload[0] = commands[CMD_FW_CHUNK];
-	g_memmove(msg.payload+1, b, 4+CHUNK_SIZE);
+	msg.payload_length = 1+4+len;
+	msg.payload[0] = board->commands[CMD_FW_CHUNK];
+	g_memmove(msg.payload+1, b, 4+len);
 
-	if (sric_txrx(ctx, &msg, &rtn, MSP430_FW_TIMEOUT))
-		g_error( "Failed to write data" );
+	if( fw_txrx_retry(ctx, CMD_FW_CHUNK, &msg, &rtn) )
+		return FALSE;
+	return next == NULL || chunk_ack( &rtn, next );
 }
 
-uint16_t msp430_get_next_address_once( sric_context ctx, const sric_device *device )
+gboolean msp430_send_block_from( transport_t *ctx,
+				 const msp430_board_t *board,
+				 const sric_device *device,
+				 uint16_t fw_ver,
+				 uint16_t from,
+				 uint16_t addr,
+				 uint8_t *chunk,
+				 uint16_t len,
+				 uint16_t *next )
 {
-	uint16_t r;
+	g_assert( len <= MSP430_MAX_SKIP_CHUNK );
+
+	/* Format:
+	   0-1: Firmware version (1 is lsb)
+	   2-3: Address (3 is lsb)
+	   4-5: The address the bootloader must be expecting (5 is lsb)
+	   6-: The data */
+
+	sric_frame msg, rtn;
+	msg.address = device->address;
+	msg.note = -1;
+	msg.payload_length = 1+6+len;
+	msg.payload[0] = board->commands[CMD_FW_CHUNK];
+	msg.payload[1] = fw_ver & 0xff;
+	msg.payload[2] = (fw_ver >> 8) & 0xff;
+	msg.payload[3] = addr & 0xff;
+	msg.payload[4] = (addr >> 8) & 0xff;
+	msg.payload[5] = from & 0xff;
+	msg.payload[6] = (from >> 8) & 0xff;
+	g_memmove(msg.payload+7, chunk, len);
+
+	if( fw_txrx_retry(ctx, CMD_FW_CHUNK, &msg, &rtn) )
+		return FALSE;
+	return next == NULL || chunk_ack( &rtn, next );
+}
+
+gboolean msp430_send_zblock( transport_t *ctx,
+			     const msp430_board_t *board,
+			     const sric_device *device,
+			     uint16_t fw_ver,
+			     uint16_t from,
+			     uint16_t addr,
+			     uint8_t n,
+			     uint8_t *zdata,
+			     uint16_t zlen,
+			     uint16_t *next )
+{
+	g_assert( zlen <= MSP430_MAX_ZDATA );
+
+	/* Format:
+	   0-1: Firmware version (1 is lsb)
+	   2-3: Address of the first chunk (3 is lsb)
+	   4-5: The address the bootloader must be expecting (5 is lsb)
+	     6: Number of chunks
+	   7-: The chunks, compressed */
+
+	sric_frame msg, rtn;
+	msg.address = device->address;
+	msg.note = -1;
+	msg.payload_length = 1+7+zlen;
+	msg.payload[0] = board->commands[CMD_FW_ZCHUNK];
+	msg.payload[1] = fw_ver & 0xff;
+	msg.payload[2] = (fw_ver >> 8) & 0xff;
+	msg.payload[3] = addr & 0xff;
+	msg.payload[4] = (addr >> 8) & 0xff;
+	msg.payload[5] = from & 0xff;
+	msg.payload[6] = (from >> 8) & 0xff;
+	msg.payload[7] = n;
+	g_memmove(msg.payload+8, zdata, zlen);
+
+	if( fw_txrx_retry(ctx, CMD_FW_ZCHUNK, &msg, &rtn) )
+		return FALSE;
+	return next == NULL || chunk_ack( &rtn, next );
+}
+
+gboolean msp430_get_next_address_once( transport_t *ctx,
+				       const msp430_board_t *board,
+				       const sric_device *device,
+				       uint16_t *next )
+{
+	g_assert( next != NULL );
 
 	sric_frame msg, rtn;
 	msg.address = device->address;
 	msg.note = -1;
 	msg.payload_length = 1;
-	msg.payload[0] = commands[CMD_FW_NEXT];
+	msg.payload[0] = board->commands[CMD_FW_NEXT];
 
-	if (sric_txrx(ctx, &msg, &rtn, MSP430_FW_TIMEOUT))
-		g_error("Failed to read next address");
+	if (fw_txrx_retry(ctx, CMD_FW_NEXT, &msg, &rtn)
+	    || rtn.payload_length < 2)
+		return FALSE;
 
-	r = rtn.payload[0];
-	r |= rtn.payload[1] << 8;
+	*next = rtn.payload[0];
+	*next |= rtn.payload[1] << 8;
 
-	return r;
+	return TRUE;
 }
 
-void msp430_send_section( sric_context ctx,
-			  const sric_device *device,
-			  elf_section_t *section, 
-			  gboolean check_first )
+msp430_next_t msp430_get_next_address_checked( transport_t *ctx,
+					       const msp430_board_t *board,
+					       const sric_device *device,
+					       uint16_t *next )
 {
-	uint16_t next;
-	g_assert( section != NULL );
+	/* Shared by the threads flashing several buses */
+	static gint seq_count = 0;
+	uint8_t seq;
+
+	g_assert( next != NULL );
+
+	/* Format of request:
+	   0: Sequence number
+	   Format of reply:
+	   0-1: Next address (0 is lsb)
+	     2: Sequence number echoed back
+	     3: CRC-8 of bytes 0-2 */
+
+	seq = g_atomic_int_add( &seq_count, 1 ) + 1;
+
+	sric_frame msg, rtn;
+	msg.address = device->address;
+	msg.note = -1;
+	msg.payload_length = 2;
+	msg.payload[0] = board->commands[CMD_FW_NEXT];
+	msg.payload[1] = seq;
+
+	if (fw_txrx_retry(ctx, CMD_FW_NEXT, &msg, &rtn))
+		return MSP430_NEXT_NO_REPLY;
+
+	if (rtn.payload_length < 4
+	    || rtn.payload[2] != seq
+	    || rtn.payload[3] != crc8( rtn.payload, 3 ) )
+		return MSP430_NEXT_BAD;
+
+	*next = rtn.payload[0];
+	*next |= rtn.payload[1] << 8;
+
+	return MSP430_NEXT_OK;
+}
+
+void msp430_xfer_init( msp430_xfer_t *xfer,
+		       const msp430_board_t *board,
+		       const sric_device *device,
+		       uint16_t caps,
+		       uint16_t chunk_size,
+		       uint8_t zchunks )
+{
+	g_assert( xfer != NULL && board != NULL && device != NULL );
+
+	xfer->board = board;
+	xfer->device = device;
+	xfer->caps = caps;
+	xfer->chunk_size = chunk_size;
+	xfer->window = board->window;
+	xfer->max_window = MAX( board->max_window, board->window );
+	xfer->zchunks = MIN( zchunks, MSP430_MAX_ZCHUNKS );
+	xfer->section = NULL;
+	xfer->old = NULL;
+	xfer->done = TRUE;
+	xfer->failed = FALSE;
+
+	/* Chunks that can skip ahead carry an extra address */
+	if( xfer->caps & MSP430_CAP_SKIP )
+		while( xfer->chunk_size > MSP430_MAX_SKIP_CHUNK )
+			xfer->chunk_size >>= 1;
+
+	/* Compressed frames need a command number for them */
+	if( !board->command_present[CMD_FW_ZCHUNK] )
+		xfer->caps &= ~MSP430_CAP_COMPRESS;
+}
+
+gboolean msp430_xfer_start_section( transport_t *ctx,
+				    msp430_xfer_t *xfer,
+				    elf_section_t *section,
+				    gboolean check_first )
+{
+	set_section( xfer, section, check_first );
 
 	if( check_first ) {
-		next = msp430_get_next_address( ctx, device );
+		if( !msp430_get_next_address( ctx, xfer->board, xfer->device,
+					      xfer->caps, &xfer->next ) ) {
+			/* msp430_xfer_step finds out where it's got to later */
+			xfer->failed = TRUE;
+			xfer->next = section->addr;
+			return FALSE;
+		}
 
-		if( next != section->addr )
-			g_error( "I've got the wrong binary -- need one that starts at %hx, got %hx\n", next, section->addr );
+		if( xfer->next != section->addr )
+			g_error( "I've got the wrong binary -- need one that starts at %hx, got %hx\n", xfer->next, section->addr );
 	}
 	else
-		next = section->addr;
+		xfer->next = section->addr;
+
+	/* MSP430 indicates all firmware received with 0 */
+	xfer->done = chunk_needed( xfer, xfer->next ) >= (section->addr + section->len)
+		|| xfer->next == 0;
+
+	return TRUE;
+}
+
+void msp430_xfer_resume_section( msp430_xfer_t *xfer,
+				 elf_section_t *section,
+				 uint16_t next )
+{
+	set_section( xfer, section, TRUE );
+
+	xfer->next = next;
+	xfer->done = chunk_needed( xfer, xfer->next ) >= (section->addr + section->len)
+		|| xfer->next == 0;
+}
 
-	printf( " " );
+static void set_section( msp430_xfer_t *xfer,
+			 elf_section_t *section,
+			 gboolean check_first )
+{
+	g_assert( xfer != NULL && section != NULL );
+
+	xfer->section = section;
+	xfer->check_first = check_first;
+	xfer->failed = FALSE;
+	xfer->done = FALSE;
+
+	/* The section must start on a chunk boundary.  Small sections
+	   such as the IVT may not be aligned to large chunks, so shrink
+	   the chunks until they fit. */
+	xfer->section_chunk = xfer->chunk_size;
+	while( section->addr % xfer->section_chunk != 0 )
+		xfer->section_chunk >>= 1;
+}
+
+gboolean msp430_xfer_step( transport_t *ctx, msp430_xfer_t *xfer )
+{
+	elf_section_t *section;
+	uint16_t chunk_size;
+	/* Address of the chunk being sent within this window, and the end
+	   of the one before it.
+	   32 bits wide as the end of the IVT is 0x10000. */
+	uint32_t pos, from;
+	uint16_t i, acked_next;
+	/* Whether the reply to the last chunk said where the device got to */
+	gboolean sent, acked = FALSE;
+	uint16_t *ack = (xfer->caps & MSP430_CAP_NEXT_ACK) ? &acked_next : NULL;
+
+	g_assert( xfer != NULL && xfer->section != NULL );
+	section = xfer->section;
+	chunk_size = xfer->section_chunk;
+
+	if( xfer->failed ) {
+		/* Carry on from wherever the device got to */
+		if( !msp430_get_next_address( ctx, xfer->board, xfer->device,
+					      xfer->caps, &xfer->next ) )
+			return FALSE;
+		xfer->failed = FALSE;
+		stats_count( STATS_RESUME );
+
+		if( xfer->next != 0 && xfer->next < section->addr )
+			xfer->next = section->addr;
+		xfer->done = chunk_needed( xfer, xfer->next ) >= (section->addr + section->len)
+			|| xfer->next == 0;
+	}
 
-	while( next < (section->addr + section->len) 
-	       /* MSP430 indicates all firmware received with 0 */
-	       && next != 0 ) {
-		uint16_t rem, done;
+	if( xfer->done )
+		return FALSE;
+
+	/* Send a window of chunks back to back without checking
+	   where the msp430 has got to.  If one of them gets lost, the
+	   msp430 will ignore the rest of the window and we'll rewind
+	   to the address it reports below. */
+	pos = chunk_needed( xfer, xfer->next );
+	from = xfer->next;
+	for( i=0; i < xfer->window
+		     && pos < (section->addr + section->len); ) {
+		uint16_t rem, zlen;
 		uint8_t *chunk;
+		uint8_t b[MSP430_MAX_CHUNK];
+		uint8_t n = 0;
+
+		/* Must be chunk aligned */
+		g_assert( pos % chunk_size == 0 );
+		g_assert( pos >= section->addr );
+
+		chunk = section->data + (pos - section->addr);
+		rem = section->len - (pos - section->addr);
+
+		if( xfer->caps & MSP430_CAP_COMPRESS )
+			n = zip_chunks( xfer, pos, MIN( xfer->window - i, xfer->zchunks ),
+					b, &zlen );
 
-		/* Must be CHUNK_SIZE aligned */
-		g_assert( next % CHUNK_SIZE == 0 );
-		g_assert( next >= section->addr );
+		if( n > 0 ) {
+			sent = msp430_send_zblock( ctx,
+						   xfer->board,
+						   xfer->device,
+						   0,
+						   from,
+						   pos,
+						   n,
+						   b,
+						   zlen,
+						   ack );
+			if( sent ) {
+				stats_count_add( STATS_ZIP_IN, n * chunk_size );
+				stats_count_add( STATS_ZIP_OUT, zlen );
+			}
+		} else {
+			n = 1;
 
-		chunk = section->data + (next - section->addr);
+			if( rem < chunk_size ) {
+				/* Pad out to a whole chunk */
+				g_memmove( b, chunk, rem );
+				memset( b + rem, 0xaa, chunk_size - rem );
+				chunk = b;
+			}
 
-		done = next - section->addr;
-		rem = section->len - (next - section->addr);
+			if( xfer->caps & MSP430_CAP_SKIP )
+				sent = msp430_send_block_from( ctx,
+							       xfer->board,
+							       xfer->device,
+							       0,
+							       from,
+							       pos,
+							       chunk,
+							       chunk_size,
+							       ack );
+			else
+				sent = msp430_send_block( ctx,
+							  xfer->board,
+							  xfer->device,
+							  0, 
+							  pos, 
+							  chunk,
+							  chunk_size,
+							  ack );
+		}
 
-		graph( section->name, done, section->len );
+		/* Find out where the device got to before going on */
+		acked = sent && ack != NULL;
+		if( !sent )
+			break;
 
-		if( rem < CHUNK_SIZE ) {
-			/* Pad out to 16 bytes long */
-			uint8_t b[CHUNK_SIZE];
-			uint8_t i;
+		i += n;
+		from = pos + n * chunk_size;
+		pos = chunk_needed( xfer, from );
 
-			g_memmove( b, chunk, rem );
-			for( i=rem; i<CHUNK_SIZE; i++ )
-				b[i] = 0xaa;
+		/* The rest of the window would be ignored after a chunk
+		   that the device didn't take */
+		if( acked && acked_next != (from & 0xffff) )
+			break;
+	}
 
-			msp430_send_block( ctx,
-					   device,
-					   0, 
-					   next, 
-					   b );
+	/* The reply to the last chunk says where the device got to */
+	if( acked )
+		xfer->next = acked_next;
+	else if( !msp430_get_next_address( ctx, xfer->board, xfer->device,
+					   xfer->caps, &xfer->next ) ) {
+		/* Pick up from wherever it is when it comes back */
+		xfer->failed = TRUE;
+		return FALSE;
+	}
+	/* Fewer chunks are put at risk once one has been lost, and more
+	   for as long as none are (additive increase, multiplicative
+	   decrease).  A board without a max_window keeps its window. */
+	if( xfer->next < from && xfer->next != 0 ) {
+		stats_count( STATS_REWIND );
+		if( xfer->window > xfer->board->window ) {
+			xfer->window = MAX( xfer->window / 2, xfer->board->window );
+			stats_count( STATS_WINDOW_SHRINK );
+		}
+	} else if( i == xfer->window && xfer->window < xfer->max_window ) {
+		xfer->window++;
+		stats_count( STATS_WINDOW_GROW );
+	}
+
+	/* May have failed.  Sections that the device takes at any time,
+	   such as the IVT, are started again if the first chunk was lost. */
+	if( xfer->next != 0 && xfer->next < section->addr )
+		xfer->next = section->addr;
+
+	xfer->done = chunk_needed( xfer, xfer->next ) >= (section->addr + section->len)
+		|| xfer->next == 0;
+
+	return !xfer->done;
+}
+
+static uint32_t chunk_needed( const msp430_xfer_t *xfer, uint32_t pos )
+{
+	const elf_section_t *section = xfer->section;
+	const elf_section_t *old = xfer->old;
+	uint32_t end = section->addr + section->len;
+
+	if( pos < section->addr )
+		return pos;
+
+	for( ; pos < end; pos += xfer->section_chunk ) {
+		uint32_t len = MIN( xfer->section_chunk, end - pos );
+		const uint8_t *chunk = section->data + (pos - section->addr);
+
+		/* The last chunk is always sent so that the bootloader
+		   knows where the image ends */
+		if( pos + xfer->section_chunk >= end )
+			break;
+
+		if( xfer->caps & MSP430_CAP_KEEP ) {
+			/* Skipped flash keeps what was there before */
+			if( old == NULL
+			    || pos < old->addr || pos + len > old->addr + old->len
+			    || memcmp( chunk, old->data + (pos - old->addr), len ) != 0 )
+				break;
+		}
+		else if( xfer->caps & MSP430_CAP_JUMP ) {
+			/* Skipped flash is left erased */
+			if( elf_access_populated( section, pos, len )
+			    && !chunk_erased( chunk, len ) )
+				break;
 		}
 		else
-			msp430_send_block( ctx,
-					   device,
-					   0, 
-					   next, 
-					   chunk );
+			break;
+	}
+
+	return pos;
+}
 
-		next = msp430_get_next_address( ctx, device );
+static gboolean chunk_erased( const uint8_t *chunk, uint32_t len )
+{
+	uint32_t i;
+
+	for( i=0; i<len; i++ )
+		if( chunk[i] != 0xff )
+			return FALSE;
+
+	return TRUE;
+}
 
-		/* May have failed */
-		if( check_first && next < section->addr )
-			next = section->addr;
+static uint8_t zip_chunks( const msp430_xfer_t *xfer,
+			   uint32_t pos,
+			   uint8_t max,
+			   uint8_t *zdata,
+			   uint16_t *zlen )
+{
+	const elf_section_t *section = xfer->section;
+	uint32_t end = section->addr + section->len;
+	uint16_t chunk_size = xfer->section_chunk;
+	uint8_t raw[MSP430_MAX_ZCHUNKS * MSP430_MAX_CHUNK];
+	uint32_t len, done;
+	int32_t r = -1;
+	uint8_t n;
+
+	/* Only chunks that follow on from each other */
+	for( n=1; n < max && pos + n * chunk_size < end
+		     && chunk_needed( xfer, pos + n * chunk_size ) == pos + n * chunk_size; n++ );
+
+	/* Padded out to a whole chunk at the end */
+	len = MIN( (uint32_t)n * chunk_size, end - pos );
+	memcpy( raw, section->data + (pos - section->addr), len );
+	memset( raw + len, 0xaa, n * chunk_size - len );
+
+	/* Drop chunks off the end until it fits */
+	while( n > 0 ) {
+		r = lz_compress( raw, n * chunk_size, zdata, MSP430_MAX_ZDATA, &done );
+		if( r >= 0 )
+			break;
+
+		n = MIN( n - 1, done / chunk_size );
 	}
 
-	graph( section->name, section->len, section->len );
-	printf ("\n");
+	if( n == 0 || r >= n * chunk_size )
+		return 0;
+	*zlen = r;
+	return n;
 }
 
-void msp430_confirm_crc( sric_context ctx, const sric_device *device )
+uint32_t msp430_xfer_progress( const msp430_xfer_t *xfer )
+{
+	g_assert( xfer != NULL && xfer->section != NULL );
+
+	if( xfer->done )
+		return xfer->section->len;
+
+	return xfer->next - xfer->section->addr;
+}
+
+uint32_t msp430_xfer_chunks_left( const msp430_xfer_t *xfer )
+{
+	uint32_t end, pos, n = 0;
+
+	g_assert( xfer != NULL && xfer->section != NULL );
+
+	if( xfer->done )
+		return 0;
+
+	end = xfer->section->addr + xfer->section->len;
+	for( pos = chunk_needed( xfer, xfer->next ); pos < end;
+	     pos = chunk_needed( xfer, pos + xfer->section_chunk ) )
+		n++;
+
+	return n;
+}
+
+gboolean msp430_confirm_crc( transport_t *ctx,
+			     const msp430_board_t *board,
+			     const sric_device *device,
+			     uint16_t version )
 {
 	uint8_t buf[4];
+	uint8_t sent;
+	uint16_t probes, next, ver;
 
 	/* Format:
 	 * 0-3: Password (currently ignored) */
@@ -195,39 +1065,223 @@ void msp430_confirm_crc( sric_context ctx, const sric_device *device )
 	msg.address = device->address;
 	msg.note = -1;
 	msg.payload_length = 1+4;
-	msg.payload[0] = commands[CMD_FW_CONFIRM];
+	msg.payload[0] = board->commands[CMD_FW_CONFIRM];
 	g_memmove(msg.payload+1, buf, 4);
 
 	/* The board handles the sending of an ack to a packet asynchronously
 	 * therefore it will switch over to the new firmware straight away
 	 * after successfully receiving this command and not send an ack.
-	 * To save lots of faffing around in the firmware I'm going to send
-	 * this command a few times and leave it at that */
-	int i;
-	for (i=0; i<10; i++) {
-		sric_txrx(ctx, &msg, &rtn, MSP430_FW_TIMEOUT);
+	 * So don't wait long for one, and then look for the board coming
+	 * back with its new firmware. */
+	fw_txrx(ctx, CMD_FW_CONFIRM, &msg, &rtn, MSP430_FW_PROBE_TIMEOUT);
+	sent = 1;
+
+	for( probes=0; probes < MSP430_FW_SWITCH_PROBES; probes++ ) {
+		/* No answer while it's rebooting */
+		if( !probe_next_address( ctx, board, device, MSP430_FW_PROBE_TIMEOUT, &next ) )
+			continue;
+
+		if( next != 0 ) {
+			/* The new firmware is waiting for the other half.
+			 * Reading the version resets its reception code,
+			 * which is fine as nothing has been sent to it. */
+			if( !get_fw_version( ctx, board, device, MSP430_FW_PROBE_TIMEOUT, &ver ) )
+				continue;
+
+			return ver == version;
+		}
+
+		/* Still waiting for confirmation, so it got lost */
+		if( sent == MSP430_FW_RETRIES )
+			return FALSE;
+
+		fw_txrx(ctx, CMD_FW_CONFIRM, &msg, &rtn, MSP430_FW_PROBE_TIMEOUT);
+		sent++;
 	}
+
+	return FALSE;
+}
+
+static gboolean probe_next_address( transport_t *ctx,
+				    const msp430_board_t *board,
+				    const sric_device *device,
+				    int timeout,
+				    uint16_t *next )
+{
+	sric_frame msg, rtn;
+	msg.address = device->address;
+	msg.note = -1;
+	msg.payload_length = 1;
+	msg.payload[0] = board->commands[CMD_FW_NEXT];
+
+	if (fw_txrx(ctx, CMD_FW_NEXT, &msg, &rtn, timeout)
+	    || rtn.payload_length < 2)
+		return FALSE;
+
+	*next = rtn.payload[0];
+	*next |= rtn.payload[1] << 8;
+
+	return TRUE;
+}
+
+static int fw_txrx( transport_t *ctx,
+		    uint8_t cmd,
+		    const sric_frame *msg,
+		    sric_frame *rtn,
+		    int timeout )
+{
+	gint64 start = msp430_fw_clock();
+	int r;
+
+	r = ctx->txrx( ctx, msg, rtn, timeout );
+	stats_txrx( cmd, msp430_fw_clock() - start, r == 0 );
+
+	return r;
+}
+
+static gboolean chunk_ack( const sric_frame *rtn, uint16_t *next )
+{
+	/* Format of reply:
+	   0-1: Next address (0 is lsb)
+	     2: 1 if the chunk was taken, otherwise 0
+	     3: CRC-8 of bytes 0-2 */
+
+	if( rtn->payload_length < 4
+	    || rtn->payload[3] != crc8( rtn->payload, 3 ) )
+		return FALSE;
+
+	*next = rtn->payload[0];
+	*next |= rtn->payload[1] << 8;
+
+	return TRUE;
+}
+
+static int fw_tx( transport_t *ctx,
+		  uint8_t cmd,
+		  const sric_frame *msg )
+{
+	gint64 start = msp430_fw_clock();
+	int r;
+
+	r = ctx->tx( ctx, msg );
+	stats_txrx( cmd, msp430_fw_clock() - start, r == 0 );
+
+	return r;
 }
 
-static void graph( char *str, uint16_t done, uint16_t total )
+static int fw_txrx_retry( transport_t *ctx,
+			  uint8_t cmd,
+			  const sric_frame *msg,
+			  sric_frame *rtn )
 {
-	uint8_t w = 61 - strlen(str);
-	float r = ((float)done)/((float)total);
-	float p =  r * ((float)w);
+	gulong backoff = MSP430_FW_BACKOFF;
+	int timeout = link_timeout( ctx, msg->address, cmd );
+	gint64 start;
 	uint8_t i;
+	int r;
 
-	printf("\r%s %4.4hx/%4.4hx (%3.0f%%) ", str, done, total,r*100.0);
-	for( i=0; i < p; i++ ) {
-		if( i == ((uint8_t)p) )
-			putchar('>');
-		else
-			putchar('=');
+	for( i=1; ; i++ ) {
+		start = msp430_fw_clock();
+		r = fw_txrx( ctx, cmd, msg, rtn, timeout );
+
+		/* A reply to a retry might have been to an earlier attempt,
+		   so only first attempts are timed (Karn's algorithm) */
+		if( r == 0 && i == 1 )
+			link_sample( ctx, msg->address, cmd, msp430_fw_clock() - start );
+		if( r == 0 || i == MSP430_FW_RETRIES )
+			return r;
+
+		/* The board may just be slower than it has been */
+		if( timeout < MSP430_FW_TIMEOUT_MAX ) {
+			timeout = MIN( timeout * 2, MSP430_FW_TIMEOUT_MAX );
+			stats_count( STATS_RTO_BACKOFF );
+		}
+
+		/* Give a noisy bus a moment to settle */
+		stats_count( STATS_TXRX_RETRY );
+		msp430_fw_sleep( backoff * 1000 );
+		backoff = MIN( backoff * 2, MSP430_FW_BACKOFF_MAX );
 	}
+}
+
+int msp430_link_timeout( transport_t *ctx,
+			 const sric_device *device,
+			 uint8_t cmd,
+			 gint64 *srtt_us )
+{
+	g_assert( cmd < NUM_COMMANDS );
+
+	G_LOCK( links );
+	*srtt_us = link_find( ctx, device->address )->srtt[cmd];
+	G_UNLOCK( links );
 
-	for( ; i < w; i++ )
-		putchar(' ');
+	return link_timeout( ctx, device->address, cmd );
+}
 
-	putchar('|');
+void msp430_link_reset( void )
+{
+	G_LOCK( links );
+	if( links != NULL )
+		g_array_set_size( links, 0 );
+	G_UNLOCK( links );
+}
+
+static fw_link_t* link_find( transport_t *ctx, int address )
+{
+	fw_link_t *l;
+	guint i;
+
+	if( links == NULL )
+		links = g_array_new( FALSE, TRUE, sizeof(fw_link_t) );
+
+	for( i=0; i<links->len; i++ ) {
+		l = &g_array_index( links, fw_link_t, i );
+		if( l->ctx == ctx && l->address == address )
+			return l;
+	}
+
+	g_array_set_size( links, links->len + 1 );
+	l = &g_array_index( links, fw_link_t, links->len - 1 );
+	l->ctx = ctx;
+	l->address = address;
+	return l;
+}
+
+static void link_sample( transport_t *ctx, int address, uint8_t cmd, gint64 rtt )
+{
+	fw_link_t *l;
+
+	G_LOCK( links );
+	l = link_find( ctx, address );
+
+	/* Anything quicker than the clock can tell still counts */
+	rtt = MAX( rtt, 1 );
+
+	if( l->srtt[cmd] == 0 ) {
+		l->srtt[cmd] = rtt;
+		l->rttvar[cmd] = rtt / 2;
+	} else {
+		gint64 err = rtt - l->srtt[cmd];
+
+		l->rttvar[cmd] += ( (err < 0 ? -err : err) - l->rttvar[cmd] ) / 4;
+		l->srtt[cmd] += err / 8;
+	}
+	G_UNLOCK( links );
+}
+
+static int link_timeout( transport_t *ctx, int address, uint8_t cmd )
+{
+	fw_link_t *l;
+	gint64 rto;
+
+	G_LOCK( links );
+	l = link_find( ctx, address );
+	if( l->srtt[cmd] == 0 )
+		rto = MSP430_FW_TIMEOUT * 1000;
+	else
+		rto = l->srtt[cmd] + 4 * l->rttvar[cmd];
+	G_UNLOCK( links );
 
-	fflush(stdout);
+	rto = (rto + 999) / 1000;
+	return CLAMP( rto, MSP430_FW_TIMEOUT_MIN, MSP430_FW_TIMEOUT_MAX );
 }
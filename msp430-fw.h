@@ -25,8 +25,31 @@
 #include <sric.h>
 
 #include "elf-access.h"
+#include "transport.h"
 
+/* Chunk size used by bootloaders that can't tell us otherwise */
 #define CHUNK_SIZE 16
+/* Largest chunk that fits in a SRIC frame after the command byte and
+   the 4 byte chunk header */
+#define MSP430_MAX_CHUNK (sizeof(((sric_frame*)0)->payload) - 5)
+/* Largest chunk that can be sent with msp430_send_block_from */
+#define MSP430_MAX_SKIP_CHUNK (MSP430_MAX_CHUNK - 2)
+/* Largest compressed data that can be sent with msp430_send_zblock */
+#define MSP430_MAX_ZDATA (MSP430_MAX_CHUNK - 3)
+/* Most chunks that are put in one compressed frame */
+#define MSP430_MAX_ZCHUNKS 32
+
+/* Number of times to send the firmware to a board before giving up
+   on getting the CRC to match */
+#define MSP430_XFER_ATTEMPTS 3
+/* Number of times a board may stop answering part way through a
+   transfer before giving up on it */
+#define MSP430_XFER_STALLS 3
+
+/* Group addresses are taken from the 7 bit addresses that aren't
+   reserved on I2C, so that they can be sent to over any transport */
+#define MSP430_GROUP_MIN 0x08
+#define MSP430_GROUP_MAX 0x77
 
 /* Names for the I2C commands */
 enum {
@@ -40,51 +63,372 @@ enum {
 	CMD_FW_CRCR,
 	/* Confirm the firmware CRC, triggering switchover */
 	CMD_FW_CONFIRM,
+	/* Read the bootloader's capabilities (optional) */
+	CMD_FW_CAPS,
+	/* Send several chunks in one compressed frame (optional) */
+	CMD_FW_ZCHUNK,
+	/* Join a group address that chunks can be sent to (optional) */
+	CMD_FW_GROUP,
 
 	/* Number of commands */
 	NUM_COMMANDS
 };
 
-extern uint8_t commands[NUM_COMMANDS];
+/* Bootloader capability bits, as returned by CMD_FW_CAPS */
+/* CMD_FW_NEXT echoes a sequence number and a CRC-8 alongside the address */
+#define MSP430_CAP_NEXT_CHECK (1 << 0)
+/* CMD_FW_CRCR accepts an address range and returns the CRC of the flash
+   in that range, in either half */
+#define MSP430_CAP_CRC_RANGE (1 << 1)
+/* Chunks may skip ahead of the next address, and the flash that was
+   skipped keeps its existing contents */
+#define MSP430_CAP_KEEP (1 << 2)
+/* Chunks may skip ahead of the next address, and the flash that was
+   skipped is left erased.  Ignored if MSP430_CAP_KEEP is set. */
+#define MSP430_CAP_JUMP (1 << 3)
+/* Bootloaders that can skip ahead use msp430_send_block_from */
+#define MSP430_CAP_SKIP (MSP430_CAP_KEEP | MSP430_CAP_JUMP)
+/* CMD_FW_ZCHUNK takes runs of chunks compressed with lz_compress */
+#define MSP430_CAP_COMPRESS (1 << 4)
+/* CMD_FW_GROUP makes the bootloader take chunks sent to a group address
+   as well as its own, in the MSP430_CAP_SKIP form, writing each one
+   wherever it says whatever address it's expecting.  Chunks sent to the
+   group get no reply.  It leaves the group when CMD_FW_VER resets it. */
+#define MSP430_CAP_GROUP (1 << 5)
+/* The replies to CMD_FW_CHUNK and CMD_FW_ZCHUNK carry the address the
+   bootloader expects next, whether it took the chunk and a CRC-8, so
+   the next address needn't be read after each window */
+#define MSP430_CAP_NEXT_ACK (1 << 6)
+
+/* The settings for one type of board, from its section of the config file */
+typedef struct {
+	/* Name of the section, and the SRIC board type */
+	char *name;
+	uint8_t type;
+
+	uint8_t commands[NUM_COMMANDS];
+	/* TRUE for each command that the board has a command number for */
+	gboolean command_present[NUM_COMMANDS];
+
+	/* Base addresses of the two halves of flash */
+	uint16_t bottom;
+	uint16_t top;
+
+	/* Number of chunks to send before asking the msp430 which address it
+	   expects next.  1 waits for every chunk to be acknowledged. */
+	uint16_t window;
+	/* The window grows by a chunk after each one that gets through
+	   whole, up to this many, and halves whenever a chunk is lost,
+	   down to window.  Set it to window to keep the window fixed. */
+	uint16_t max_window;
+
+	/* Number of bytes of firmware to send in each chunk, if the
+	   bootloader takes chunks that big.  Must be a power of two. */
+	uint16_t chunk_size;
+} msp430_board_t;
+
+/* Called to wait between retries of a failed transaction.
+   Defaults to g_usleep. */
+extern void (*msp430_fw_sleep)( gulong us );
+
+/* Returns the time in microseconds, which transactions are timed by.
+   Defaults to g_get_monotonic_time. */
+extern gint64 (*msp430_fw_clock)( void );
 
-extern uint16_t msp430_fw_bottom;
-extern uint16_t msp430_fw_top;
+/* Returns the timeout in ms used for the given command (one of the
+   CMD_FW_* values) to the device.  It's worked out from the round trip
+   times of the transactions so far, as TCP does (RFC 6298), and is a
+   fixed default until there have been any.  The smoothed round
+   trip time is put in *srtt_us, or 0 if there have been none. */
+int msp430_link_timeout( transport_t *ctx,
+			 const sric_device *dev,
+			 uint8_t cmd,
+			 gint64 *srtt_us );
+
+/* Forget the round trip times measured so far */
+void msp430_link_reset( void );
+
+/* Find out whether the device is there, waiting only briefly for each
+   reply.  Doesn't disturb a transfer in progress.
+   Returns FALSE if it never answered. */
+gboolean msp430_probe( transport_t *ctx,
+		       const msp430_board_t* board,
+		       const sric_device* dev );
 
 /* Read the firmware version from the device
    Return FALSE on failure.
    Result put in *ver. */
-gboolean msp430_get_fw_version( sric_context ctx, const sric_device* dev, uint16_t *ver);
+gboolean msp430_get_fw_version( transport_t *ctx,
+				const msp430_board_t* board,
+				const sric_device* dev,
+				uint16_t *ver );
+
+/* Read the capabilities of the device's bootloader.
+   Bootloaders that don't support CMD_FW_CAPS have no capabilities.
+   The largest chunk size the bootloader accepts is put in *max_chunk,
+   which is CHUNK_SIZE if the bootloader doesn't say.  The most chunks
+   it takes in one compressed frame is put in *max_zchunks, which is 1
+   if it doesn't say. */
+uint16_t msp430_get_caps( transport_t *ctx,
+			  const msp430_board_t* board,
+			  const sric_device* dev,
+			  uint16_t *max_chunk,
+			  uint8_t *max_zchunks );
+
+/* Read the CRC the device has calculated over the firmware it has received.
+   This covers the text section, padded out to a whole chunk, followed
+   by the IVT, as calculated by crc16.
+   Returns FALSE on failure. */
+gboolean msp430_get_crc( transport_t *ctx,
+			 const msp430_board_t* board,
+			 const sric_device* dev,
+			 uint16_t *crc );
+
+/* Read the CRC of len bytes of flash starting at addr, which may be in
+   either half.  Needs MSP430_CAP_CRC_RANGE.
+   Returns FALSE on failure. */
+gboolean msp430_get_crc_range( transport_t *ctx,
+			       const msp430_board_t* board,
+			       const sric_device* dev,
+			       uint16_t addr,
+			       uint16_t len,
+			       uint16_t *crc );
+
+/* Make the device take chunks sent to the given group address, until
+   its reception code is next reset.  Needs MSP430_CAP_GROUP.
+   Returns FALSE if it didn't answer. */
+gboolean msp430_join_group( transport_t *ctx,
+			    const msp430_board_t* board,
+			    const sric_device* dev,
+			    int group );
+
+/* Send every chunk of the section but the last, once, to all the
+   devices that have joined the group.  Devices that miss chunks have
+   them mended afterwards with msp430_crc_bisect.  The last chunk is
+   left to be sent to each device on its own, as it marks where the
+   image ends.
+   Nothing acknowledges a group frame, so after each window of chunks
+   the next address of pace, one of the devices with capabilities
+   caps, is read.  It only answers once it has written the window,
+   which keeps the chunks from coming faster than the devices can
+   write them. */
+void msp430_send_group_section( transport_t *ctx,
+				const msp430_board_t* board,
+				int group,
+				const sric_device* pace,
+				uint16_t caps,
+				uint16_t chunk_size,
+				const elf_section_t *section );
+
+/* Find out which chunks of the section the device has wrong, by
+   comparing the CRCs of ever smaller parts of it with the device's
+   flash, halving each part that doesn't match.  Needs
+   MSP430_CAP_CRC_RANGE.
+   Returns a copy of the section with each chunk that didn't match
+   inverted, so that with it as xfer->old a bootloader with
+   MSP430_CAP_KEEP is sent only those chunks again, or NULL if the
+   device stopped answering.  The number of chunks that didn't match
+   is put in *bad.  The copy's data and the copy are freed with
+   g_free. */
+elf_section_t* msp430_crc_bisect( transport_t *ctx,
+				  const msp430_board_t* board,
+				  const sric_device* dev,
+				  const elf_section_t *section,
+				  uint16_t chunk_size,
+				  uint32_t *bad );
 
-/* Read the next address the device is expecting */
-uint16_t msp430_get_next_address( sric_context ctx, const sric_device* dev );
+/* After a CRC mismatch, find out which chunks of the section to send
+   again.  Only bootloaders with MSP430_CAP_CRC_RANGE and MSP430_CAP_KEEP
+   can be sent just those.
+   Returns msp430_crc_bisect's copy of the section, to be the next
+   attempt's xfer->old, or NULL if the whole section has to be sent
+   again. */
+elf_section_t* msp430_crc_mend( transport_t *ctx,
+				const msp430_board_t* board,
+				const sric_device* dev,
+				uint16_t caps,
+				const elf_section_t *section,
+				uint16_t chunk_size,
+				uint32_t *bad );
 
-uint16_t msp430_get_next_address_once( sric_context ctx, const sric_device* dev );
+/* Returns the CRC the device calculates once it has been sent the text
+   section, whose own CRC is text_crc, and the IVT in chunks of
+   chunk_size.  The last chunk of the text is padded with 0xaa. */
+uint16_t msp430_image_crc( uint16_t text_crc,
+			   const elf_section_t *text,
+			   const elf_section_t *vectors,
+			   uint16_t chunk_size );
 
-/* Send a 16 byte chunk of firmware to the msp430.
+/* Read the next address the device is expecting into *next.
+   If the bootloader protects the address with a check value
+   (MSP430_CAP_NEXT_CHECK in caps) a single valid read is enough,
+   otherwise reads are repeated until two agree.
+   Returns FALSE at once if the device doesn't answer, or if the reads
+   never agreed or never passed their check. */
+gboolean msp430_get_next_address( transport_t *ctx,
+				  const msp430_board_t* board,
+				  const sric_device* dev,
+				  uint16_t caps,
+				  uint16_t *next );
+
+/* Read the next address once.
+   Returns FALSE if the device didn't answer. */
+gboolean msp430_get_next_address_once( transport_t *ctx,
+				       const msp430_board_t* board,
+				       const sric_device* dev,
+				       uint16_t *next );
+
+/* The result of reading the next address with the checked form of
+   CMD_FW_NEXT */
+typedef enum {
+	MSP430_NEXT_OK = 0,
+	/* The device didn't answer, even after fw_txrx_retry's retries */
+	MSP430_NEXT_NO_REPLY,
+	/* The reply was too short, or failed its sequence number or CRC */
+	MSP430_NEXT_BAD
+} msp430_next_t;
+
+/* Read the next address once using the checked form of CMD_FW_NEXT. */
+msp430_next_t msp430_get_next_address_checked( transport_t *ctx,
+					       const msp430_board_t* board,
+					       const sric_device* dev,
+					       uint16_t *next );
+
+/* Send a chunk of firmware to the msp430.
    Arguments:
     -     fd: The i2c device file descriptor
     - fw_ver: The firmware version
     -   addr: The chunk address
-    -  chunk: Pointer to the 16 byte chunk of data */
-void msp430_send_block( sric_context ctx,
-			const sric_device* dev,
-			uint16_t fw_ver,
-			uint16_t addr,
-			uint8_t *chunk );
-
-/* Send the given section to the msp430.
-   Arguments:
-    - 	       fd: The I2C file descriptor
-    -     section: The section to send
-    - check_first: FALSE means ignore the first expected address read from the MSP430.
-    		   This is useful for when the msp430 will accept data for
-		   another block of memory -- i.e. the IVT. */
-void msp430_send_section( sric_context ctx,
-			  const sric_device* dev,
-			  elf_section_t *section, 
-			  gboolean check_first );
+    -  chunk: Pointer to the chunk of data
+    -    len: Length of the chunk, no more than MSP430_MAX_CHUNK
+    -   next: If not NULL, where to put the address the device expects
+              next, from the reply of a bootloader with
+              MSP430_CAP_NEXT_ACK
+   Failed transactions are retried a few times before giving up.
+   Returns FALSE if the device never acknowledged the chunk, or if next
+   was given and the reply didn't carry a good address. */
+gboolean msp430_send_block( transport_t *ctx,
+			    const msp430_board_t* board,
+			    const sric_device* dev,
+			    uint16_t fw_ver,
+			    uint16_t addr,
+			    uint8_t *chunk,
+			    uint16_t len,
+			    uint16_t *next );
+
+/* The state of a firmware transfer to a single device.
+   Several of these may be stepped in turn to flash several devices
+   on the same bus at once. */
+typedef struct {
+	const msp430_board_t *board;
+	const sric_device *device;
+
+	/* Protocol settings for the device, set by msp430_xfer_init.
+	   The window changes as chunks are lost or not, between the
+	   board's window and max_window. */
+	uint16_t caps;
+	uint16_t chunk_size;
+	uint16_t window, max_window;
+	uint8_t zchunks;
+
+	/* The section being sent */
+	elf_section_t *section;
+	/* What's already in flash where the section is going, or NULL if
+	   unknown.  Set by the caller.  Chunks that match it aren't sent
+	   to devices with MSP430_CAP_KEEP.  Chunks that are erased (0xff)
+	   aren't sent to devices with MSP430_CAP_JUMP. */
+	const elf_section_t *old;
+	gboolean check_first;
+	/* Chunk size used for this section */
+	uint16_t section_chunk;
+	/* The next address the device expects */
+	uint16_t next;
+	/* TRUE once the device has received the whole section */
+	gboolean done;
+	/* TRUE if the device stopped answering.  The next call to
+	   msp430_xfer_step carries on from wherever it got to. */
+	gboolean failed;
+} msp430_xfer_t;
+
+/* Set up a transfer to the given device, whose bootloader has the given
+   capabilities, sending chunks of up to chunk_size bytes.  Bootloaders
+   with MSP430_CAP_COMPRESS are sent up to zchunks chunks at a time in
+   compressed frames, where that's smaller. */
+void msp430_xfer_init( msp430_xfer_t *xfer,
+		       const msp430_board_t* board,
+		       const sric_device* dev,
+		       uint16_t caps,
+		       uint16_t chunk_size,
+		       uint8_t zchunks );
+
+/* Start sending a section.  If check_first is FALSE the first address
+   the device expects is ignored and sending starts at the beginning of
+   the section.  This is useful for when the msp430 will accept data
+   for another block of memory -- i.e. the IVT.
+   Returns FALSE, and sets xfer->failed, if the device didn't answer. */
+gboolean msp430_xfer_start_section( transport_t *ctx,
+				    msp430_xfer_t *xfer,
+				    elf_section_t *section,
+				    gboolean check_first );
+
+/* Carry on sending a section that an earlier transfer got part way
+   through, from the address the device says it expects next. */
+void msp430_xfer_resume_section( msp430_xfer_t *xfer,
+				 elf_section_t *section,
+				 uint16_t next );
+
+/* Send one window of chunks and find out where the device has got to.
+   Returns FALSE once the device has received the whole section, or
+   if it stopped answering, in which case xfer->failed is set. */
+gboolean msp430_xfer_step( transport_t *ctx, msp430_xfer_t *xfer );
+
+/* Returns the number of bytes of the section the device has received */
+uint32_t msp430_xfer_progress( const msp430_xfer_t *xfer );
+
+/* Returns the number of chunks of the section still to be sent,
+   leaving out any that the device doesn't need */
+uint32_t msp430_xfer_chunks_left( const msp430_xfer_t *xfer );
+
+/* Send a chunk of firmware to a bootloader that can skip ahead
+   (MSP430_CAP_SKIP).  The bootloader only takes it if it's expecting the
+   address from, so that the chunks after a lost one aren't taken as a
+   skip.  Arguments are as for msp430_send_block, apart from:
+    -   from: The end of the previous chunk sent
+    -    len: No more than MSP430_MAX_SKIP_CHUNK */
+gboolean msp430_send_block_from( transport_t *ctx,
+				 const msp430_board_t* board,
+				 const sric_device* dev,
+				 uint16_t fw_ver,
+				 uint16_t from,
+				 uint16_t addr,
+				 uint8_t *chunk,
+				 uint16_t len,
+				 uint16_t *next );
+
+/* Send n chunks that follow on from each other in one compressed frame
+   to a bootloader with MSP430_CAP_COMPRESS.  Arguments are as for
+   msp430_send_block_from, apart from:
+    -      n: The number of chunks, all the same size
+    -  zdata: The chunks, compressed with lz_compress
+    -   zlen: Length of zdata, no more than MSP430_MAX_ZDATA */
+gboolean msp430_send_zblock( transport_t *ctx,
+			     const msp430_board_t* board,
+			     const sric_device* dev,
+			     uint16_t fw_ver,
+			     uint16_t from,
+			     uint16_t addr,
+			     uint8_t n,
+			     uint8_t *zdata,
+			     uint16_t zlen,
+			     uint16_t *next );
 
-/* Confirm that the checksum the msp430 calculated is valid */
-void msp430_confirm_crc( sric_context ctx, const sric_device* dev );
+/* Confirm that the checksum the msp430 calculated is valid, and wait for
+   it to switch over to the new firmware.
+   Returns TRUE once the device reports the given firmware version, or
+   FALSE if it doesn't switch over. */
+gboolean msp430_confirm_crc( transport_t *ctx,
+			     const msp430_board_t* board,
+			     const sric_device* dev,
+			     uint16_t version );
 
 #endif	/* __MSP430_FW */
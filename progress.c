@@ -0,0 +1,141 @@
+/*  This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA. */
+#include "progress.h"
+#include <stdio.h>
+#include <string.h>
+
+progress_mode_t progress_mode = PROGRESS_BAR;
+
+static const char *mode_names[] = { "bar", "json", "none" };
+
+static void show_bar( const progress_t *p, uint32_t done );
+static void show_json( const progress_t *p, uint32_t done );
+
+gboolean progress_mode_parse( const char *name, progress_mode_t *mode )
+{
+	guint i;
+
+	for( i=0; i<G_N_ELEMENTS( mode_names ); i++ )
+		if( strcmp( name, mode_names[i] ) == 0 ) {
+			*mode = i;
+			return TRUE;
+		}
+
+	return FALSE;
+}
+
+const char* progress_mode_name( progress_mode_t mode )
+{
+	g_assert( mode < G_N_ELEMENTS( mode_names ) );
+
+	return mode_names[mode];
+}
+
+void progress_start( progress_t *p,
+		     const char *board,
+		     int address,
+		     const char *section,
+		     uint32_t total,
+		     uint32_t done )
+{
+	g_assert( p != NULL );
+
+	p->board = board;
+	p->address = address;
+	p->section = section;
+	p->total = total;
+	p->bus = NULL;
+	p->start = g_get_monotonic_time();
+	p->start_done = done;
+}
+
+gboolean progress_due( gint64 *last )
+{
+	gint64 now;
+
+	if( progress_mode == PROGRESS_NONE )
+		return FALSE;
+
+	now = g_get_monotonic_time();
+	if( *last != 0 && now - *last < PROGRESS_INTERVAL )
+		return FALSE;
+
+	*last = now;
+	return TRUE;
+}
+
+void progress_show( const progress_t *p, uint32_t done )
+{
+	if( progress_mode == PROGRESS_BAR )
+		show_bar( p, done );
+	else if( progress_mode == PROGRESS_JSON )
+		show_json( p, done );
+}
+
+unsigned int progress_percent( const progress_t *p, uint32_t done )
+{
+	if( p->total == 0 )
+		return 100;
+
+	return (unsigned int)( (uint64_t)done * 100 / p->total );
+}
+
+void progress_end( void )
+{
+	if( progress_mode == PROGRESS_BAR ) {
+		putchar( '\n' );
+		fflush( stdout );
+	}
+}
+
+static void show_bar( const progress_t *p, uint32_t done )
+{
+	int w = 61 - strlen( p->section );
+	int n = w > 0 ? (int)( (uint64_t)done * w / MAX( p->total, 1 ) ) : 0;
+	char bar[64];
+	int i;
+
+	for( i=0; i<w; i++ ) {
+		if( i < n )
+			bar[i] = '=';
+		else
+			bar[i] = ' ';
+	}
+	if( n > 0 && n <= w )
+		bar[n-1] = '>';
+	bar[MAX( w, 0 )] = '\0';
+
+	printf( "\r%s %4.4x/%4.4x (%3u%%) %s|", p->section, done, p->total,
+		progress_percent( p, done ), bar );
+	fflush( stdout );
+}
+
+static void show_json( const progress_t *p, uint32_t done )
+{
+	gint64 us = g_get_monotonic_time() - p->start;
+	double rate = 0, eta = -1;
+
+	if( us > 0 && done > p->start_done ) {
+		rate = (done - p->start_done) * 1e6 / us;
+		eta = (p->total - MIN( done, p->total )) / rate;
+	}
+
+	/* One call, so that lines from several threads don't get mixed */
+	printf( "{%s%s%s\"board\": \"%s\", \"address\": %i, \"section\": \"%s\", "
+		"\"done\": %u, \"total\": %u, \"rate\": %.0f, \"eta\": %.1f}\n",
+		p->bus != NULL ? "\"bus\": \"" : "", p->bus != NULL ? p->bus : "",
+		p->bus != NULL ? "\", " : "",
+		p->board, p->address, p->section, done, p->total, rate, eta );
+	fflush( stdout );
+}
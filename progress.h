@@ -0,0 +1,85 @@
+/*  This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA. */
+
+/* Progress output for firmware transfers.  Output is limited to one
+   update every PROGRESS_INTERVAL, so drawing it doesn't hold up the
+   transfer. */
+#ifndef __PROGRESS
+#define __PROGRESS
+#include <stdint.h>
+#include <glib.h>
+
+/* How often progress is shown, in microseconds */
+#define PROGRESS_INTERVAL 200000
+
+typedef enum {
+	/* A bar that's redrawn in place */
+	PROGRESS_BAR = 0,
+	/* One JSON object per line, for other programs to read */
+	PROGRESS_JSON,
+	/* Nothing */
+	PROGRESS_NONE
+} progress_mode_t;
+
+/* How progress is shown.  Defaults to PROGRESS_BAR. */
+extern progress_mode_t progress_mode;
+
+/* Find the mode with the given name: "bar", "json" or "none".
+   Returns FALSE if there isn't one. */
+gboolean progress_mode_parse( const char *name, progress_mode_t *mode );
+
+/* Returns the name of the given mode */
+const char* progress_mode_name( progress_mode_t mode );
+
+/* The progress of sending one section to one board */
+typedef struct {
+	const char *board;
+	int address;
+	const char *section;
+	uint32_t total;
+	/* The bus the board is on, when there's more than one, or NULL.
+	   Set by the caller after progress_start. */
+	const char *bus;
+
+	/* When the section was started, and how much the board already
+	   had then, for the rate */
+	gint64 start;
+	uint32_t start_done;
+} progress_t;
+
+/* Start following the progress of sending a section.
+   done is how much of it the board already has. */
+void progress_start( progress_t *p,
+		     const char *board,
+		     int address,
+		     const char *section,
+		     uint32_t total,
+		     uint32_t done );
+
+/* Returns TRUE if it's time to show progress again, given when it was
+   last shown in *last, which is updated.  Start *last at 0. */
+gboolean progress_due( gint64 *last );
+
+/* Show how far the section has got.  In PROGRESS_BAR mode this redraws
+   the bar for a single board; progress of several boards at once is
+   drawn by the caller with progress_percent. */
+void progress_show( const progress_t *p, uint32_t done );
+
+/* Returns how far the section has got, from 0 to 100 */
+unsigned int progress_percent( const progress_t *p, uint32_t done );
+
+/* Finish the progress output, leaving the cursor on a new line */
+void progress_end( void );
+
+#endif	/* __PROGRESS */
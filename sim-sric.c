@@ -0,0 +1,608 @@
+/*  This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA. */
+#include "sim-sric.h"
+#include "crc16.h"
+#include "lz.h"
+
+/* Where the IVT lives */
+#define SIM_IVT 0xffe0
+
+typedef struct {
+	sim_config_t conf;
+	sric_device dev;
+
+	uint8_t flash[0x10000];
+	/* Base of the half being run from, and the half being written */
+	uint16_t running, target;
+	/* Firmware version being run */
+	uint16_t version;
+
+	/* The next address the bootloader expects */
+	uint16_t next;
+	/* End of the highest chunk of text received */
+	uint32_t text_end;
+	/* Whether the whole IVT has been received */
+	gboolean vectors;
+	/* Group address it also takes chunks at, or 0 */
+	int group;
+
+	/* Which addresses chunks have been sent for */
+	uint8_t sent[0x10000];
+	/* Simulated time at which the device finishes writing flash */
+	uint64_t busy_until;
+	/* Simulated time at which the device finishes rebooting */
+	uint64_t boot_until;
+	uint32_t switchovers;
+	/* Number of transactions taken from conf.script */
+	guint scripted;
+} sim_device_t;
+
+static sim_device_t *devices[SIM_MAX_DEVICES];
+static unsigned int n_devices = 0;
+static sim_stats_t stats;
+static uint32_t rand_state = 1;
+
+/* Look up the device at the given address */
+static sim_device_t* sim_find( int address );
+
+/* Restart firmware reception, as the bootloader does when its firmware
+   version is read */
+static void sim_restart( sim_device_t *d );
+
+/* Handle a frame sent to the device.
+   Returns FALSE if the device doesn't reply. */
+static gboolean sim_handle( sim_device_t *d, const sric_frame *msg, sric_frame *rtn );
+
+/* Handle a CMD_FW_CHUNK frame.
+   Returns TRUE if the chunk was written. */
+static gboolean sim_chunk( sim_device_t *d, const sric_frame *msg );
+
+/* Handle a CMD_FW_ZCHUNK frame.
+   Returns TRUE if all its chunks were written. */
+static gboolean sim_zchunk( sim_device_t *d, const sric_frame *msg );
+
+/* Fill in the reply to a chunk, which is empty unless the bootloader
+   has MSP430_CAP_NEXT_ACK */
+static void sim_chunk_ack( sim_device_t *d, gboolean taken, sric_frame *rtn );
+
+/* Write a chunk to flash, if the device is expecting it.
+   anywhere takes a chunk for any address in the half, as chunks sent
+   to the group are.
+   Returns FALSE if it isn't. */
+static gboolean sim_write( sim_device_t *d, gboolean anywhere,
+			   uint32_t from, uint32_t addr,
+			   const uint8_t *data, uint32_t len );
+
+/* CRC of the firmware received so far */
+static uint16_t sim_crc( sim_device_t *d );
+
+/* Returns a pseudo-random number between 0 and 1 */
+static double sim_rand( void );
+
+static int sim_txrx( transport_t *t,
+		     const sric_frame *msg,
+		     sric_frame *rtn,
+		     int timeout );
+
+/* Send a frame to a group address */
+static int sim_tx( transport_t *t, const sric_frame *msg );
+
+static const sric_device* sim_enumerate( transport_t *t,
+					 const sric_device *prev );
+
+/* The simulated bus is never closed */
+static void sim_close( transport_t *t );
+
+static transport_t sim_bus = { sim_txrx, sim_tx, sim_enumerate, sim_close };
+
+transport_t* sim_transport( void )
+{
+	return &sim_bus;
+}
+
+void sim_reset( uint32_t seed )
+{
+	unsigned int i;
+
+	for( i=0; i<n_devices; i++ )
+		g_free( devices[i] );
+	n_devices = 0;
+
+	memset( &stats, 0, sizeof(stats) );
+	rand_state = seed ? seed : 1;
+}
+
+void sim_add_device( const sim_config_t *conf )
+{
+	sim_device_t *d;
+
+	g_assert( conf != NULL && conf->board != NULL );
+	if( n_devices == SIM_MAX_DEVICES )
+		g_error( "Too many simulated devices" );
+
+	d = g_malloc( sizeof(sim_device_t) );
+	memset( d, 0, sizeof(sim_device_t) );
+	memset( d->flash, 0xff, sizeof(d->flash) );
+
+	d->conf = *conf;
+	d->dev.address = conf->address;
+	d->dev.type = conf->type;
+	d->running = conf->top;
+	d->target = conf->bottom;
+	d->version = 0;
+	sim_restart( d );
+
+	devices[n_devices++] = d;
+}
+
+void sim_load_flash( int address, const elf_section_t *section )
+{
+	sim_device_t *d = sim_find( address );
+
+	g_assert( d != NULL && section->addr + section->len <= sizeof(d->flash) );
+	memcpy( d->flash + section->addr, section->data, section->len );
+}
+
+void sim_sleep( gulong us )
+{
+	stats.time_us += us;
+}
+
+gint64 sim_now( void )
+{
+	return stats.time_us;
+}
+
+const sim_stats_t* sim_get_stats( void )
+{
+	return &stats;
+}
+
+int sim_fw_version( int address )
+{
+	sim_device_t *d = sim_find( address );
+
+	if( d == NULL )
+		return -1;
+	return d->version;
+}
+
+uint32_t sim_switchovers( int address )
+{
+	sim_device_t *d = sim_find( address );
+
+	if( d == NULL )
+		return 0;
+	return d->switchovers;
+}
+
+static const sric_device* sim_enumerate( transport_t *t,
+					 const sric_device *device )
+{
+	unsigned int i;
+
+	if( device == NULL )
+		return n_devices ? &devices[0]->dev : NULL;
+
+	for( i=0; i+1<n_devices; i++ )
+		if( &devices[i]->dev == device )
+			return &devices[i+1]->dev;
+
+	return NULL;
+}
+
+static int sim_txrx( transport_t *t,
+		     const sric_frame *msg,
+		     sric_frame *rtn,
+		     int timeout )
+{
+	sim_device_t *d;
+	uint32_t latency_us;
+	gboolean dropped;
+	uint8_t i;
+
+	g_assert( msg != NULL && rtn != NULL );
+
+	d = sim_find( msg->address );
+	stats.bytes += msg->payload_length;
+
+	for( i=0; d != NULL && i<NUM_COMMANDS; i++ )
+		if( d->conf.board->command_present[i] && msg->payload_length > 0
+		    && d->conf.board->commands[i] == msg->payload[0] ) {
+			stats.txrx[i]++;
+			break;
+		}
+
+	if( d == NULL || stats.time_us < d->boot_until ) {
+		/* Nobody there, or it's rebooting */
+		stats.time_us += (uint64_t)timeout * 1000;
+		stats.timeouts++;
+		return -1;
+	}
+
+	latency_us = d->conf.latency_us;
+	if( d->scripted < d->conf.script_len ) {
+		const trace_entry_t *e = &d->conf.script[d->scripted++];
+		uint32_t bytes_us = d->conf.byte_us * (e->length + e->reply_length);
+
+		/* The bytes are counted separately, as they may not be the
+		   same this time */
+		latency_us = e->latency_us > bytes_us ? e->latency_us - bytes_us : 0;
+		dropped = e->result != TRACE_OK;
+	} else
+		dropped = d->conf.drop > 0 && sim_rand() < d->conf.drop;
+
+	if( dropped ) {
+		/* Corrupted on the way there */
+		stats.time_us += (uint64_t)timeout * 1000;
+		stats.timeouts++;
+		stats.dropped++;
+		return -1;
+	}
+
+	/* The device holds the bus until it's finished writing flash */
+	if( stats.time_us < d->busy_until )
+		stats.time_us = d->busy_until;
+
+	stats.time_us += latency_us + d->conf.byte_us * msg->payload_length;
+
+	memset( rtn, 0, sizeof(*rtn) );
+	rtn->address = msg->address;
+	rtn->note = -1;
+	rtn->payload_length = 0;
+
+	if( !sim_handle( d, msg, rtn ) ) {
+		stats.time_us += (uint64_t)timeout * 1000;
+		stats.timeouts++;
+		return -1;
+	}
+
+	stats.bytes += rtn->payload_length;
+	stats.time_us += d->conf.byte_us * rtn->payload_length;
+	return 0;
+}
+
+static int sim_tx( transport_t *t, const sric_frame *msg )
+{
+	sim_device_t *members[SIM_MAX_DEVICES];
+	const msp430_board_t *board;
+	unsigned int i, n = 0;
+	uint32_t latency_us = 0, byte_us = 0;
+
+	g_assert( msg != NULL );
+
+	stats.bytes += msg->payload_length;
+
+	for( i=0; i<n_devices; i++ ) {
+		sim_device_t *d = devices[i];
+
+		if( d->group == 0 || d->group != msg->address
+		    || stats.time_us < d->boot_until )
+			continue;
+		members[n++] = d;
+
+		/* Every member holds the bus until it's finished writing,
+		   unless it misses the frame instead */
+		if( !d->conf.busy_drop && stats.time_us < d->busy_until )
+			stats.time_us = d->busy_until;
+		latency_us = MAX( latency_us, d->conf.latency_us );
+		byte_us = MAX( byte_us, d->conf.byte_us );
+	}
+
+	/* Nobody acknowledged the address */
+	if( n == 0 )
+		return -1;
+
+	stats.time_us += latency_us + byte_us * msg->payload_length;
+
+	/* Chunks are all that's taken from the group */
+	board = members[0]->conf.board;
+	if( msg->payload_length < 1 || msg->payload[0] != board->commands[CMD_FW_CHUNK] )
+		return 0;
+	stats.txrx[CMD_FW_CHUNK]++;
+	stats.chunks++;
+	stats.group_chunks++;
+
+	for( i=0; i<n; i++ ) {
+		if( members[i]->conf.drop > 0 && sim_rand() < members[i]->conf.drop ) {
+			stats.dropped++;
+			continue;
+		}
+		if( stats.time_us < members[i]->busy_until ) {
+			stats.lost++;
+			continue;
+		}
+		sim_chunk( members[i], msg );
+	}
+
+	return 0;
+}
+
+static void sim_close( transport_t *t )
+{
+}
+
+static sim_device_t* sim_find( int address )
+{
+	unsigned int i;
+
+	for( i=0; i<n_devices; i++ )
+		if( devices[i]->dev.address == address )
+			return devices[i];
+
+	return NULL;
+}
+
+static void sim_restart( sim_device_t *d )
+{
+	uint32_t end = d->target == d->conf.bottom ? d->conf.top : SIM_IVT;
+
+	d->next = d->target;
+	d->text_end = d->target;
+	d->vectors = FALSE;
+	d->group = 0;
+
+	/* Bootloaders that keep flash only overwrite what they're sent */
+	if( !(d->conf.caps & MSP430_CAP_KEEP) )
+		memset( d->flash + d->target, 0xff, end - d->target );
+}
+
+static gboolean sim_handle( sim_device_t *d, const sric_frame *msg, sric_frame *rtn )
+{
+	const uint8_t *p = msg->payload;
+	const uint8_t *commands = d->conf.board->commands;
+
+	if( msg->payload_length < 1 )
+		return FALSE;
+
+	if( d->conf.board->command_present[CMD_FW_CAPS]
+	    && p[0] == commands[CMD_FW_CAPS] ) {
+		/* Older bootloaders don't know this one */
+		if( d->conf.caps == 0 )
+			return FALSE;
+
+		rtn->payload[0] = d->conf.caps & 0xff;
+		rtn->payload[1] = d->conf.caps >> 8;
+		rtn->payload[2] = d->conf.max_chunk;
+		rtn->payload[3] = d->conf.max_zchunks;
+		rtn->payload_length = 4;
+	}
+	else if( p[0] == commands[CMD_FW_VER] ) {
+		rtn->payload[0] = d->version & 0xff;
+		rtn->payload[1] = d->version >> 8;
+		rtn->payload_length = 2;
+		sim_restart( d );
+	}
+	else if( p[0] == commands[CMD_FW_CHUNK] ) {
+		stats.chunks++;
+		sim_chunk_ack( d, sim_chunk( d, msg ), rtn );
+	}
+	else if( d->conf.board->command_present[CMD_FW_GROUP]
+		 && p[0] == commands[CMD_FW_GROUP] ) {
+		if( !(d->conf.caps & MSP430_CAP_GROUP) || msg->payload_length < 2 )
+			return FALSE;
+		d->group = p[1];
+	}
+	else if( d->conf.board->command_present[CMD_FW_ZCHUNK]
+		 && p[0] == commands[CMD_FW_ZCHUNK] ) {
+		if( !(d->conf.caps & MSP430_CAP_COMPRESS) )
+			return FALSE;
+		sim_chunk_ack( d, sim_zchunk( d, msg ), rtn );
+	}
+	else if( p[0] == commands[CMD_FW_NEXT] ) {
+		uint16_t next = d->next;
+
+		rtn->payload[0] = next & 0xff;
+		rtn->payload[1] = next >> 8;
+		rtn->payload_length = 2;
+
+		if( (d->conf.caps & MSP430_CAP_NEXT_CHECK) && msg->payload_length >= 2 ) {
+			rtn->payload[2] = p[1];
+			rtn->payload[3] = crc8( rtn->payload, 3 );
+			rtn->payload_length = 4;
+		}
+	}
+	else if( p[0] == commands[CMD_FW_CRCR] ) {
+		uint16_t crc;
+
+		if( (d->conf.caps & MSP430_CAP_CRC_RANGE) && msg->payload_length >= 5 ) {
+			uint32_t addr = p[1] | (p[2] << 8);
+			uint32_t len = p[3] | (p[4] << 8);
+
+			if( addr + len > sizeof(d->flash) )
+				return FALSE;
+			crc = crc16( CRC16_INIT, d->flash + addr, len );
+		}
+		else
+			crc = sim_crc( d );
+
+		rtn->payload[0] = crc & 0xff;
+		rtn->payload[1] = crc >> 8;
+		rtn->payload_length = 2;
+	}
+	else if( p[0] == commands[CMD_FW_CONFIRM] ) {
+		/* The bootloader never acks this */
+		if( d->vectors ) {
+			uint16_t old = d->running;
+
+			d->running = d->target;
+			d->target = old;
+			d->version = d->flash[d->running] | (d->flash[d->running + 1] << 8);
+			d->switchovers++;
+			d->boot_until = stats.time_us + d->conf.boot_us;
+			sim_restart( d );
+		}
+		return FALSE;
+	}
+	else
+		return FALSE;
+
+	return TRUE;
+}
+
+static gboolean sim_chunk( sim_device_t *d, const sric_frame *msg )
+{
+	const uint8_t *p = msg->payload;
+	uint32_t addr, from, len, hdr;
+
+	/* Format: command, version (2), address (2), data
+	   Bootloaders that can skip ahead also have the address they
+	   must be expecting (2) before the data. */
+	hdr = (d->conf.caps & MSP430_CAP_SKIP) ? 7 : 5;
+	if( msg->payload_length <= hdr )
+		return FALSE;
+	addr = p[3] | (p[4] << 8);
+	from = hdr == 7 ? p[5] | (p[6] << 8) : addr;
+	len = msg->payload_length - hdr;
+
+	if( d->sent[addr] )
+		stats.retransmits++;
+	d->sent[addr] = 1;
+
+	if( sim_rand() < d->conf.loss ) {
+		stats.lost++;
+		return FALSE;
+	}
+
+	if( len > (d->conf.caps ? d->conf.max_chunk : CHUNK_SIZE) )
+		return FALSE;
+
+	return sim_write( d, d->group != 0 && msg->address == d->group,
+			  from, addr, p + hdr, len );
+}
+
+static gboolean sim_zchunk( sim_device_t *d, const sric_frame *msg )
+{
+	const uint8_t *p = msg->payload;
+	uint8_t buf[MSP430_MAX_ZCHUNKS * MSP430_MAX_CHUNK];
+	uint32_t addr, from, n, len, i;
+	int32_t r;
+
+	stats.chunks++;
+	stats.zchunks++;
+
+	/* Format: command, version (2), address (2), the address it must
+	   be expecting (2), number of chunks, compressed chunks */
+	if( msg->payload_length <= 8 )
+		return FALSE;
+	addr = p[3] | (p[4] << 8);
+	from = p[5] | (p[6] << 8);
+	n = p[7];
+
+	if( d->sent[addr] )
+		stats.retransmits++;
+	d->sent[addr] = 1;
+
+	if( sim_rand() < d->conf.loss ) {
+		stats.lost++;
+		return FALSE;
+	}
+
+	/* Only bootloaders that can skip ahead take a chunk that
+	   isn't the one they're expecting */
+	if( n == 0 || n > d->conf.max_zchunks
+	    || ( !(d->conf.caps & MSP430_CAP_SKIP) && addr != from ) )
+		return FALSE;
+
+	r = lz_decompress( p + 8, msg->payload_length - 8, buf, sizeof(buf) );
+	if( r <= 0 || r % n != 0 )
+		return FALSE;
+	len = r / n;
+	if( len > d->conf.max_chunk )
+		return FALSE;
+
+	stats.zip_in += r;
+	stats.zip_out += msg->payload_length - 8;
+
+	for( i=0; i<n; i++, addr += len, from = addr )
+		if( !sim_write( d, FALSE, from, addr, buf + i * len, len ) )
+			return FALSE;
+
+	return TRUE;
+}
+
+static void sim_chunk_ack( sim_device_t *d, gboolean taken, sric_frame *rtn )
+{
+	if( !(d->conf.caps & MSP430_CAP_NEXT_ACK) )
+		return;
+
+	rtn->payload[0] = d->next & 0xff;
+	rtn->payload[1] = d->next >> 8;
+	rtn->payload[2] = taken;
+	rtn->payload[3] = crc8( rtn->payload, 3 );
+	rtn->payload_length = 4;
+}
+
+static gboolean sim_write( sim_device_t *d, gboolean anywhere,
+			   uint32_t from, uint32_t addr,
+			   const uint8_t *data, uint32_t len )
+{
+	uint32_t half_end;
+
+	half_end = d->target == d->conf.bottom ? d->conf.top : SIM_IVT;
+
+	if( addr >= SIM_IVT ) {
+		/* The IVT may start at any time, after which the next
+		   address wraps around to 0 at the end of it */
+		if( addr + len > sizeof(d->flash)
+		    || ( addr != SIM_IVT && addr != d->next ) )
+			return FALSE;
+
+		d->next = (addr + len) & 0xffff;
+		if( d->next == 0 )
+			d->vectors = TRUE;
+	}
+	else if( anywhere ) {
+		/* Chunks to the group may be lost by some members and not
+		   others, so they don't move the next address on */
+		if( addr < d->target || addr + len > half_end )
+			return FALSE;
+		d->text_end = MAX( d->text_end, addr + len );
+	}
+	else if( from != d->next || addr < from || addr + len > half_end )
+		return FALSE;
+	else {
+		d->next = addr + len;
+		d->text_end = MAX( d->text_end, addr + len );
+	}
+
+	g_memmove( d->flash + addr, data, len );
+	stats.chunks_accepted++;
+
+	if( d->conf.corrupt > 0 && sim_rand() < d->conf.corrupt ) {
+		d->flash[addr + (uint32_t)( sim_rand() * len )] ^= 0x10;
+		stats.corrupted++;
+	}
+	/* Chunks in a compressed frame are written one after another */
+	d->busy_until = MAX( d->busy_until, stats.time_us ) + d->conf.write_us;
+	return TRUE;
+}
+
+static uint16_t sim_crc( sim_device_t *d )
+{
+	uint16_t crc;
+
+	crc = crc16( CRC16_INIT, d->flash + d->target, d->text_end - d->target );
+	return crc16( crc, d->flash + SIM_IVT, sizeof(d->flash) - SIM_IVT );
+}
+
+static double sim_rand( void )
+{
+	/* xorshift32 */
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 17;
+	rand_state ^= rand_state << 5;
+
+	return rand_state / 4294967296.0;
+}
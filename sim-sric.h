@@ -0,0 +1,141 @@
+/*  This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA. */
+
+/* A simulated SRIC bus with MSP430 bootloaders on it.
+   Provides an in-memory transport, so that the transfer code can be run
+   without any hardware.  Time on the bus is simulated rather than
+   spent. */
+#ifndef __SIM_SRIC
+#define __SIM_SRIC
+#include <stdint.h>
+#include <glib.h>
+#include <sric.h>
+
+#include "msp430-fw.h"
+#include "transport.h"
+#include "trace.h"
+
+/* Number of devices that can be on the simulated bus */
+#define SIM_MAX_DEVICES 16
+
+typedef struct {
+	/* SRIC address and board type */
+	int address;
+	int type;
+	/* The board's command numbers */
+	const msp430_board_t *board;
+
+	/* Bootloader capabilities, as reported by CMD_FW_CAPS, and the
+	   largest chunk it accepts.  No capabilities means the device
+	   doesn't answer CMD_FW_CAPS at all. */
+	uint16_t caps;
+	uint8_t max_chunk;
+	/* Most chunks the bootloader takes in one compressed frame */
+	uint8_t max_zchunks;
+
+	/* Base addresses of the two halves of flash */
+	uint16_t bottom, top;
+
+	/* Microseconds taken by every transaction, plus each byte */
+	uint32_t latency_us;
+	uint32_t byte_us;
+	/* Microseconds the device is busy for after writing a chunk */
+	uint32_t write_us;
+	/* Microseconds the device doesn't answer for after switching over */
+	uint32_t boot_us;
+	/* Probability that a chunk frame is lost */
+	double loss;
+	/* Probability that any transaction gets no reply at all */
+	double drop;
+	/* Probability that a chunk is written to flash with a byte wrong */
+	double corrupt;
+	/* Frames sent to a group address while the device is writing
+	   flash are lost, as they are over sricd, rather than the device
+	   holding the bus until it's finished */
+	gboolean busy_drop;
+
+	/* Transactions with the device recorded by flashb --trace, or
+	   NULL.  Each transaction takes the time of the next one recorded
+	   in place of latency_us, with the bytes counted at byte_us, and
+	   gets no reply if that one didn't.  Once they run out,
+	   latency_us and drop are used. */
+	const trace_entry_t *script;
+	guint script_len;
+} sim_config_t;
+
+/* Transaction statistics for the whole bus */
+typedef struct {
+	/* Number of transactions of each command */
+	uint32_t txrx[NUM_COMMANDS];
+	/* Transactions that timed out */
+	uint32_t timeouts;
+	/* Transactions that were dropped */
+	uint32_t dropped;
+	/* Chunk frames sent, and how many of them the device kept */
+	uint32_t chunks;
+	uint32_t chunks_accepted;
+	/* Chunks sent for an address that had already been sent */
+	uint32_t retransmits;
+	/* Chunk frames that were lost */
+	uint32_t lost;
+	/* Chunks written to flash with a byte wrong */
+	uint32_t corrupted;
+	/* Chunk frames sent to a group address, which chunks also counts */
+	uint32_t group_chunks;
+	/* Compressed frames sent, the bytes of firmware the accepted
+	   ones held, and what those bytes were compressed to */
+	uint32_t zchunks;
+	uint64_t zip_in;
+	uint64_t zip_out;
+	/* Payload bytes in both directions */
+	uint64_t bytes;
+	/* Simulated time spent on the bus */
+	uint64_t time_us;
+} sim_stats_t;
+
+/* Returns the transport that reaches the simulated bus */
+transport_t* sim_transport( void );
+
+/* Remove all devices from the bus and clear the statistics.
+   seed seeds the frame loss. */
+void sim_reset( uint32_t seed );
+
+/* Add a device to the bus.  It runs firmware version 0 from the top
+   half, and so is waiting to receive the bottom half. */
+void sim_add_device( const sim_config_t *conf );
+
+/* Put the section in the flash of the device at the given address, as
+   if an earlier run had left it there */
+void sim_load_flash( int address, const elf_section_t *section );
+
+/* Wait for the given number of microseconds of simulated time.
+   Can be used as msp430_fw_sleep. */
+void sim_sleep( gulong us );
+
+/* Returns the simulated time in microseconds.
+   Can be used as msp430_fw_clock. */
+gint64 sim_now( void );
+
+/* Get the statistics since the last sim_reset */
+const sim_stats_t* sim_get_stats( void );
+
+/* Returns the firmware version the device at the given address is
+   running, or -1 if there's no such device */
+int sim_fw_version( int address );
+
+/* Returns the number of times the device at the given address has
+   switched over to new firmware */
+uint32_t sim_switchovers( int address );
+
+#endif	/* __SIM_SRIC */
@@ -0,0 +1,340 @@
+/*  This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA. */
+#include "stats.h"
+#include "msp430-fw.h"
+#include <string.h>
+
+/* Upper bounds of the latency histogram buckets in microseconds.
+   Anything slower goes in the last bucket. */
+static const gint64 buckets[] = { 100, 200, 500, 1000, 2000, 5000,
+				  10000, 20000, 50000, 100000, 200000, 500000 };
+#define NUM_BUCKETS (G_N_ELEMENTS(buckets) + 1)
+
+static const char *phase_names[STATS_NUM_PHASES] = {
+	"connect",
+	"load",
+	"enumerate",
+	"probe",
+	"send_text",
+	"send_vectors",
+	"verify",
+	"confirm"
+};
+
+static const char *command_names[NUM_COMMANDS] = {
+	"fw_ver",
+	"fw_chunk",
+	"fw_next",
+	"fw_crcr",
+	"fw_confirm",
+	"fw_caps",
+	"fw_zchunk",
+	"fw_group"
+};
+
+static const char *counter_names[STATS_NUM_COUNTERS] = {
+	"next_rereads",
+	"rewinds",
+	"retries",
+	"txrx_retries",
+	"resumes",
+	"zip_in_bytes",
+	"zip_out_bytes",
+	"repairs",
+	"repaired_chunks",
+	"group_boards",
+	"group_chunks",
+	"window_grows",
+	"window_shrinks",
+	"rto_backoffs"
+};
+
+typedef struct {
+	uint32_t count;
+	uint32_t failed;
+	gint64 total_us;
+	gint64 max_us;
+	uint32_t hist[NUM_BUCKETS];
+} cmd_stats_t;
+
+static gint64 phases[STATS_NUM_PHASES];
+static cmd_stats_t cmds[NUM_COMMANDS];
+static uint32_t counters[STATS_NUM_COUNTERS];
+
+typedef struct {
+	uint8_t bus;
+	const char *name;
+	int address;
+	uint16_t window;
+	gint64 srtt_us;
+	int timeout_ms;
+} link_stats_t;
+
+/* What the link controller settled on for each board */
+static GArray *links = NULL;
+/* Held whilst recording, as several buses may be flashed at once */
+G_LOCK_DEFINE_STATIC( record );
+
+void stats_reset( void )
+{
+	memset( phases, 0, sizeof(phases) );
+	memset( cmds, 0, sizeof(cmds) );
+	memset( counters, 0, sizeof(counters) );
+	if( links != NULL )
+		g_array_set_size( links, 0 );
+}
+
+void stats_phase_add( stats_phase_t phase, gint64 us )
+{
+	g_assert( phase < STATS_NUM_PHASES );
+
+	G_LOCK( record );
+	phases[phase] += us;
+	G_UNLOCK( record );
+}
+
+void stats_txrx( uint8_t cmd, gint64 us, gboolean ok )
+{
+	cmd_stats_t *c;
+	guint i;
+
+	g_assert( cmd < NUM_COMMANDS );
+	c = cmds + cmd;
+
+	G_LOCK( record );
+	c->count++;
+	if( !ok )
+		c->failed++;
+	c->total_us += us;
+	if( us > c->max_us )
+		c->max_us = us;
+
+	for( i=0; i < G_N_ELEMENTS(buckets); i++ )
+		if( us <= buckets[i] )
+			break;
+	c->hist[i]++;
+	G_UNLOCK( record );
+}
+
+void stats_count( stats_counter_t counter )
+{
+	stats_count_add( counter, 1 );
+}
+
+void stats_count_add( stats_counter_t counter, uint32_t n )
+{
+	g_assert( counter < STATS_NUM_COUNTERS );
+
+	G_LOCK( record );
+	counters[counter] += n;
+	G_UNLOCK( record );
+}
+
+void stats_link( uint8_t bus, const char *name, int address,
+		 uint16_t window, gint64 srtt_us, int timeout_ms )
+{
+	link_stats_t l;
+
+	l.bus = bus;
+	l.name = name;
+	l.address = address;
+	l.window = window;
+	l.srtt_us = srtt_us;
+	l.timeout_ms = timeout_ms;
+
+	G_LOCK( record );
+	if( links == NULL )
+		links = g_array_new( FALSE, FALSE, sizeof(link_stats_t) );
+	g_array_append_val( links, l );
+	G_UNLOCK( record );
+}
+
+void stats_print( FILE *f )
+{
+	guint i;
+	gint64 total = 0;
+
+	fprintf( f, "%-14s %10s\n", "Phase", "Time (ms)" );
+	for( i=0; i<STATS_NUM_PHASES; i++ ) {
+		fprintf( f, "%-14s %10.1f\n", phase_names[i], phases[i] / 1000.0 );
+		total += phases[i];
+	}
+	fprintf( f, "%-14s %10.1f\n\n", "total", total / 1000.0 );
+
+	fprintf( f, "%-14s %8s %8s %10s %10s\n",
+		 "Command", "Count", "Failed", "Mean (ms)", "Max (ms)" );
+	for( i=0; i<NUM_COMMANDS; i++ ) {
+		cmd_stats_t *c = cmds + i;
+
+		fprintf( f, "%-14s %8u %8u %10.2f %10.2f\n",
+			 command_names[i], c->count, c->failed,
+			 c->count ? c->total_us / 1000.0 / c->count : 0.0,
+			 c->max_us / 1000.0 );
+	}
+	fprintf( f, "\n" );
+
+	for( i=0; i<STATS_NUM_COUNTERS; i++ )
+		fprintf( f, "%-14s %8u\n", counter_names[i], counters[i] );
+
+	if( counters[STATS_ZIP_OUT] > 0 )
+		fprintf( f, "%-14s %8.2f\n", "zip_ratio",
+			 (double)counters[STATS_ZIP_IN] / counters[STATS_ZIP_OUT] );
+
+	if( links == NULL || links->len == 0 )
+		return;
+
+	fprintf( f, "\n%-14s %3s %7s %6s %10s %12s\n",
+		 "Board", "Bus", "Address", "Window", "RTT (ms)", "Timeout (ms)" );
+	for( i=0; i<links->len; i++ ) {
+		link_stats_t *l = &g_array_index( links, link_stats_t, i );
+
+		fprintf( f, "%-14s %3hhu %7i %6hu %10.2f %12i\n",
+			 l->name, l->bus, l->address, l->window,
+			 l->srtt_us / 1000.0, l->timeout_ms );
+	}
+}
+
+gboolean stats_write_json( const char *fname )
+{
+	FILE *f;
+	guint i, j;
+
+	f = fopen( fname, "w" );
+	if( f == NULL )
+		return FALSE;
+
+	fprintf( f, "{\n  \"phases_ms\": {" );
+	for( i=0; i<STATS_NUM_PHASES; i++ )
+		fprintf( f, "%s\"%s\": %.3f", i ? ", " : "",
+			 phase_names[i], phases[i] / 1000.0 );
+	fprintf( f, "},\n  \"commands\": {\n" );
+
+	for( i=0; i<NUM_COMMANDS; i++ ) {
+		cmd_stats_t *c = cmds + i;
+
+		fprintf( f, "    \"%s\": {\"count\": %u, \"failed\": %u, "
+			 "\"total_ms\": %.3f, \"max_ms\": %.3f, \"histogram\": [",
+			 command_names[i], c->count, c->failed,
+			 c->total_us / 1000.0, c->max_us / 1000.0 );
+
+		for( j=0; j<NUM_BUCKETS; j++ ) {
+			if( j < G_N_ELEMENTS(buckets) )
+				fprintf( f, "%s{\"le_us\": %" G_GINT64_FORMAT ", \"count\": %u}",
+					 j ? ", " : "", buckets[j], c->hist[j] );
+			else
+				fprintf( f, ", {\"le_us\": null, \"count\": %u}", c->hist[j] );
+		}
+
+		fprintf( f, "]}%s\n", i + 1 < NUM_COMMANDS ? "," : "" );
+	}
+	fprintf( f, "  },\n  \"counters\": {" );
+
+	for( i=0; i<STATS_NUM_COUNTERS; i++ )
+		fprintf( f, "%s\"%s\": %u", i ? ", " : "",
+			 counter_names[i], counters[i] );
+	fprintf( f, "},\n  \"links\": [" );
+
+	for( i=0; links != NULL && i<links->len; i++ ) {
+		link_stats_t *l = &g_array_index( links, link_stats_t, i );
+
+		fprintf( f, "%s\n    {\"bus\": %hhu, \"board\": \"%s\", \"address\": %i, "
+			 "\"window\": %hu, \"srtt_ms\": %.3f, \"timeout_ms\": %i}",
+			 i ? "," : "", l->bus, l->name, l->address, l->window,
+			 l->srtt_us / 1000.0, l->timeout_ms );
+	}
+	fprintf( f, "\n  ]\n}\n" );
+
+	return fclose( f ) == 0;
+}
+
+gboolean stats_write_prom( const char *fname )
+{
+	FILE *f;
+	guint i, j;
+
+	f = fopen( fname, "w" );
+	if( f == NULL )
+		return FALSE;
+
+	fprintf( f, "# HELP flashb_phase_seconds Time spent in each phase of flashing.\n"
+		 "# TYPE flashb_phase_seconds gauge\n" );
+	for( i=0; i<STATS_NUM_PHASES; i++ )
+		fprintf( f, "flashb_phase_seconds{phase=\"%s\"} %.6f\n",
+			 phase_names[i], phases[i] / 1e6 );
+
+	fprintf( f, "# HELP flashb_txrx_failures_total SRIC transactions that failed.\n"
+		 "# TYPE flashb_txrx_failures_total counter\n" );
+	for( i=0; i<NUM_COMMANDS; i++ )
+		fprintf( f, "flashb_txrx_failures_total{command=\"%s\"} %u\n",
+			 command_names[i], cmds[i].failed );
+
+	fprintf( f, "# HELP flashb_txrx_seconds Latency of SRIC transactions.\n"
+		 "# TYPE flashb_txrx_seconds histogram\n" );
+	for( i=0; i<NUM_COMMANDS; i++ ) {
+		cmd_stats_t *c = cmds + i;
+		uint32_t cumulative = 0;
+
+		for( j=0; j<NUM_BUCKETS; j++ ) {
+			cumulative += c->hist[j];
+
+			if( j < G_N_ELEMENTS(buckets) )
+				fprintf( f, "flashb_txrx_seconds_bucket{command=\"%s\",le=\"%g\"} %u\n",
+					 command_names[i], buckets[j] / 1e6, cumulative );
+			else
+				fprintf( f, "flashb_txrx_seconds_bucket{command=\"%s\",le=\"+Inf\"} %u\n",
+					 command_names[i], cumulative );
+		}
+
+		fprintf( f, "flashb_txrx_seconds_sum{command=\"%s\"} %.6f\n",
+			 command_names[i], c->total_us / 1e6 );
+		fprintf( f, "flashb_txrx_seconds_count{command=\"%s\"} %u\n",
+			 command_names[i], c->count );
+	}
+
+	for( i=0; i<STATS_NUM_COUNTERS; i++ )
+		fprintf( f, "# TYPE flashb_%s_total counter\n"
+			 "flashb_%s_total %u\n",
+			 counter_names[i], counter_names[i], counters[i] );
+
+	if( links != NULL && links->len > 0 ) {
+		fprintf( f, "# HELP flashb_link_window Window of chunks each board ended with.\n"
+			 "# TYPE flashb_link_window gauge\n" );
+		for( i=0; i<links->len; i++ ) {
+			link_stats_t *l = &g_array_index( links, link_stats_t, i );
+
+			fprintf( f, "flashb_link_window{bus=\"%hhu\",board=\"%s\",address=\"%i\"} %hu\n",
+				 l->bus, l->name, l->address, l->window );
+		}
+
+		fprintf( f, "# HELP flashb_link_rtt_seconds Smoothed round trip time of each board's chunks.\n"
+			 "# TYPE flashb_link_rtt_seconds gauge\n" );
+		for( i=0; i<links->len; i++ ) {
+			link_stats_t *l = &g_array_index( links, link_stats_t, i );
+
+			fprintf( f, "flashb_link_rtt_seconds{bus=\"%hhu\",board=\"%s\",address=\"%i\"} %.6f\n",
+				 l->bus, l->name, l->address, l->srtt_us / 1e6 );
+		}
+
+		fprintf( f, "# HELP flashb_link_timeout_seconds Timeout each board's chunks ended with.\n"
+			 "# TYPE flashb_link_timeout_seconds gauge\n" );
+		for( i=0; i<links->len; i++ ) {
+			link_stats_t *l = &g_array_index( links, link_stats_t, i );
+
+			fprintf( f, "flashb_link_timeout_seconds{bus=\"%hhu\",board=\"%s\",address=\"%i\"} %.3f\n",
+				 l->bus, l->name, l->address, l->timeout_ms / 1e3 );
+		}
+	}
+
+	return fclose( f ) == 0;
+}
@@ -0,0 +1,110 @@
+/*  This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA. */
+
+/* Timing and transaction statistics */
+#ifndef __STATS
+#define __STATS
+#include <stdint.h>
+#include <stdio.h>
+#include <glib.h>
+
+/* The phases of a flashb run that are timed */
+typedef enum {
+	STATS_PHASE_CONNECT = 0,
+	STATS_PHASE_LOAD,
+	STATS_PHASE_ENUMERATE,
+	STATS_PHASE_PROBE,
+	STATS_PHASE_SEND_TEXT,
+	STATS_PHASE_SEND_VECTORS,
+	STATS_PHASE_VERIFY,
+	STATS_PHASE_CONFIRM,
+
+	STATS_NUM_PHASES
+} stats_phase_t;
+
+/* Events that are counted */
+typedef enum {
+	/* The next address had to be read again */
+	STATS_NEXT_REREAD = 0,
+	/* The msp430 asked for an address before the end of a window */
+	STATS_REWIND,
+	/* An image was sent again after its CRC didn't match */
+	STATS_RETRY,
+	/* A transaction was tried again after getting no reply */
+	STATS_TXRX_RETRY,
+	/* A transfer carried on after the device stopped answering, or
+	   from where an earlier run left off */
+	STATS_RESUME,
+	/* Bytes of firmware sent in compressed frames, and what they
+	   compressed to */
+	STATS_ZIP_IN,
+	STATS_ZIP_OUT,
+	/* An image whose CRC didn't match was mended by sending only the
+	   chunks that were wrong again, and how many chunks that was */
+	STATS_REPAIR,
+	STATS_REPAIR_CHUNKS,
+	/* Boards sent the same image at once through a group address,
+	   and the chunks sent to the group */
+	STATS_GROUP_BOARDS,
+	STATS_GROUP_CHUNKS,
+	/* The window was grown after a whole one got through, or halved
+	   after a chunk was lost */
+	STATS_WINDOW_GROW,
+	STATS_WINDOW_SHRINK,
+	/* A transaction was retried with a longer timeout */
+	STATS_RTO_BACKOFF,
+
+	STATS_NUM_COUNTERS
+} stats_counter_t;
+
+/* Things may be recorded from several threads at once.  The statistics
+   are only printed or written once they've finished.  Phase times are
+   added up across threads, so with several buses they come to more than
+   the time taken. */
+
+/* Forget everything recorded so far */
+void stats_reset( void );
+
+/* Add time spent in the given phase */
+void stats_phase_add( stats_phase_t phase, gint64 us );
+
+/* Record a transaction of the given command (one of the CMD_FW_*
+   values) that took the given time.  ok is FALSE if it failed. */
+void stats_txrx( uint8_t cmd, gint64 us, gboolean ok );
+
+/* Count an event */
+void stats_count( stats_counter_t counter );
+
+/* Add n to a counter */
+void stats_count_add( stats_counter_t counter, uint32_t n );
+
+/* Record what the link controller in msp430-fw.c settled on for a
+   board: the window it ended with, and the smoothed round trip time and
+   timeout of its chunks */
+void stats_link( uint8_t bus, const char *name, int address,
+		 uint16_t window, gint64 srtt_us, int timeout_ms );
+
+/* Print a summary table */
+void stats_print( FILE *f );
+
+/* Write the statistics as JSON.
+   Returns FALSE if the file couldn't be written. */
+gboolean stats_write_json( const char *fname );
+
+/* Write the statistics in the Prometheus text format, as read by the
+   node exporter's textfile collector.
+   Returns FALSE if the file couldn't be written. */
+gboolean stats_write_prom( const char *fname );
+
+#endif	/* __STATS */
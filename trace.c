@@ -0,0 +1,344 @@
+/*  This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA. */
+#include "trace.h"
+#include <string.h>
+
+/* The start of a trace file, which is followed by TRACE_RECORD byte
+   records of:
+   time_us (8), latency_us (4), bus, address, command, length,
+   reply_length, result
+   with the multi-byte fields little-endian. */
+#define TRACE_MAGIC "FBTRACE1"
+#define TRACE_RECORD 18
+
+/* Time with no answer from a device that counts as a stall */
+#define TRACE_STALL_US 100000
+
+/* Number of slices the timeline of the run is split into */
+#define TRACE_SLICES 10
+
+typedef struct {
+	transport_t t;
+	transport_t *inner;
+	uint8_t bus;
+} trace_transport_t;
+
+static FILE *trace_file = NULL;
+static gint64 trace_start;
+/* Held whilst writing, as several buses may be flashed at once */
+G_LOCK_DEFINE_STATIC( trace_file );
+
+/* Add a transaction to the trace */
+static void trace_record( trace_transport_t *tt, const sric_frame *msg,
+			  const sric_frame *rtn, gint64 start, uint8_t result );
+
+static int trace_txrx( transport_t *t,
+		       const sric_frame *msg,
+		       sric_frame *rtn,
+		       int timeout );
+
+static int trace_tx( transport_t *t, const sric_frame *msg );
+
+static const sric_device* trace_enumerate( transport_t *t,
+					   const sric_device *prev );
+
+static void trace_transport_close( transport_t *t );
+
+gboolean trace_open( const char *fname )
+{
+	g_assert( trace_file == NULL );
+
+	trace_file = fopen( fname, "wb" );
+	if( trace_file == NULL ) {
+		g_print( "Failed to create trace '%s'\n", fname );
+		return FALSE;
+	}
+
+	fwrite( TRACE_MAGIC, 1, strlen(TRACE_MAGIC), trace_file );
+	fflush( trace_file );
+	trace_start = g_get_monotonic_time();
+	return TRUE;
+}
+
+void trace_close( void )
+{
+	if( trace_file == NULL )
+		return;
+
+	if( fclose( trace_file ) != 0 )
+		g_print( "Failed to write trace\n" );
+	trace_file = NULL;
+}
+
+transport_t* trace_transport( transport_t *inner, uint8_t bus )
+{
+	trace_transport_t *tt;
+
+	tt = g_malloc0( sizeof(trace_transport_t) );
+	tt->t.txrx = trace_txrx;
+	tt->t.tx = trace_tx;
+	tt->t.enumerate = trace_enumerate;
+	tt->t.close = trace_transport_close;
+	tt->inner = inner;
+	tt->bus = bus;
+
+	return &tt->t;
+}
+
+static int trace_txrx( transport_t *t,
+		       const sric_frame *msg,
+		       sric_frame *rtn,
+		       int timeout )
+{
+	trace_transport_t *tt = (trace_transport_t*)t;
+	gint64 start = g_get_monotonic_time();
+	int r;
+
+	r = tt->inner->txrx( tt->inner, msg, rtn, timeout );
+	trace_record( tt, msg, r == 0 ? rtn : NULL, start,
+		      r == 0 ? TRACE_OK : TRACE_NO_REPLY );
+
+	return r;
+}
+
+static int trace_tx( transport_t *t, const sric_frame *msg )
+{
+	trace_transport_t *tt = (trace_transport_t*)t;
+	gint64 start = g_get_monotonic_time();
+	int r;
+
+	r = tt->inner->tx( tt->inner, msg );
+	trace_record( tt, msg, NULL, start, r == 0 ? TRACE_SENT : TRACE_NOT_SENT );
+
+	return r;
+}
+
+static const sric_device* trace_enumerate( transport_t *t,
+					   const sric_device *prev )
+{
+	trace_transport_t *tt = (trace_transport_t*)t;
+
+	return tt->inner->enumerate( tt->inner, prev );
+}
+
+static void trace_transport_close( transport_t *t )
+{
+	trace_transport_t *tt = (trace_transport_t*)t;
+
+	tt->inner->close( tt->inner );
+	g_free( tt );
+}
+
+static void trace_record( trace_transport_t *tt, const sric_frame *msg,
+			  const sric_frame *rtn, gint64 start, uint8_t result )
+{
+	uint8_t buf[TRACE_RECORD];
+	uint64_t time_us;
+	uint32_t latency_us;
+	guint i;
+
+	latency_us = MIN( g_get_monotonic_time() - start, G_MAXUINT32 );
+
+	G_LOCK( trace_file );
+	if( trace_file == NULL ) {
+		G_UNLOCK( trace_file );
+		return;
+	}
+
+	time_us = start - trace_start;
+	for( i=0; i<8; i++ )
+		buf[i] = time_us >> (i * 8);
+	for( i=0; i<4; i++ )
+		buf[8+i] = latency_us >> (i * 8);
+	buf[12] = tt->bus;
+	buf[13] = msg->address;
+	buf[14] = msg->payload_length > 0 ? msg->payload[0] : 0;
+	buf[15] = msg->payload_length;
+	buf[16] = rtn != NULL ? rtn->payload_length : 0;
+	buf[17] = result;
+
+	/* Flushed straight away, so that nothing is lost if flashb is
+	   killed part way through, which is when a trace is wanted */
+	fwrite( buf, 1, sizeof(buf), trace_file );
+	fflush( trace_file );
+	G_UNLOCK( trace_file );
+}
+
+GArray* trace_load( const char *fname )
+{
+	gchar *contents;
+	gsize len, pos;
+	GArray *entries;
+	const gsize magic_len = strlen(TRACE_MAGIC);
+
+	if( !g_file_get_contents( fname, &contents, &len, NULL ) ) {
+		g_print( "Failed to read trace '%s'\n", fname );
+		return NULL;
+	}
+
+	if( len < magic_len || memcmp( contents, TRACE_MAGIC, magic_len ) != 0 ) {
+		g_print( "'%s' isn't a flashb trace\n", fname );
+		g_free( contents );
+		return NULL;
+	}
+
+	entries = g_array_new( FALSE, FALSE, sizeof(trace_entry_t) );
+
+	/* A record cut short by flashb being killed is left out */
+	for( pos = magic_len; pos + TRACE_RECORD <= len; pos += TRACE_RECORD ) {
+		const uint8_t *p = (const uint8_t*)contents + pos;
+		trace_entry_t e;
+		guint i;
+
+		e.time_us = 0;
+		for( i=0; i<8; i++ )
+			e.time_us |= (uint64_t)p[i] << (i * 8);
+		e.latency_us = 0;
+		for( i=0; i<4; i++ )
+			e.latency_us |= (uint32_t)p[8+i] << (i * 8);
+		e.bus = p[12];
+		e.address = p[13];
+		e.command = p[14];
+		e.length = p[15];
+		e.reply_length = p[16];
+		e.result = p[17];
+
+		g_array_append_val( entries, e );
+	}
+
+	g_free( contents );
+	return entries;
+}
+
+/* What happened to one device during the trace */
+typedef struct {
+	uint8_t bus, address;
+	uint32_t count, no_reply;
+	uint64_t bytes_out, bytes_in;
+	uint64_t first_us, last_us;
+	/* Latency of the transactions it answered */
+	uint64_t total_us;
+	uint32_t max_us;
+	/* Transactions and no replies for each command byte */
+	uint32_t commands[256], command_fails[256];
+	/* When it last answered, and how many have gone unanswered since */
+	uint64_t answered_us;
+	uint32_t unanswered;
+} trace_device_t;
+
+void trace_summary( FILE *f, GArray *entries )
+{
+	GArray *devices;
+	uint64_t end_us = 0, slice_us;
+	uint32_t slices[TRACE_SLICES], slice_fails[TRACE_SLICES];
+	uint64_t slice_bytes[TRACE_SLICES];
+	guint i, j;
+
+	if( entries->len == 0 ) {
+		fprintf( f, "Trace: empty\n" );
+		return;
+	}
+
+	for( i=0; i<entries->len; i++ ) {
+		const trace_entry_t *e = &g_array_index( entries, trace_entry_t, i );
+
+		end_us = MAX( end_us, e->time_us + e->latency_us );
+	}
+	slice_us = end_us / TRACE_SLICES + 1;
+	memset( slices, 0, sizeof(slices) );
+	memset( slice_fails, 0, sizeof(slice_fails) );
+	memset( slice_bytes, 0, sizeof(slice_bytes) );
+
+	fprintf( f, "Trace: %u transactions over %.3f s\n", entries->len, end_us / 1e6 );
+
+	devices = g_array_new( FALSE, TRUE, sizeof(trace_device_t) );
+
+	for( i=0; i<entries->len; i++ ) {
+		const trace_entry_t *e = &g_array_index( entries, trace_entry_t, i );
+		trace_device_t *d = NULL;
+		guint s = e->time_us / slice_us;
+
+		slices[s]++;
+		slice_bytes[s] += e->length + e->reply_length;
+		if( e->result != TRACE_OK && e->result != TRACE_SENT )
+			slice_fails[s]++;
+
+		for( j=0; j<devices->len; j++ ) {
+			d = &g_array_index( devices, trace_device_t, j );
+			if( d->bus == e->bus && d->address == e->address )
+				break;
+		}
+		if( j == devices->len ) {
+			g_array_set_size( devices, devices->len + 1 );
+			d = &g_array_index( devices, trace_device_t, j );
+			d->bus = e->bus;
+			d->address = e->address;
+			d->first_us = d->answered_us = e->time_us;
+		}
+
+		d->count++;
+		d->commands[e->command]++;
+		d->bytes_out += e->length;
+		d->bytes_in += e->reply_length;
+		d->last_us = e->time_us + e->latency_us;
+
+		if( e->result == TRACE_OK || e->result == TRACE_SENT ) {
+			/* Anything long enough without an answer was a stall */
+			if( e->time_us >= d->answered_us + TRACE_STALL_US )
+				fprintf( f, "Trace: bus %hhu address %hhu stalled at %.3f s for %.3f s, %u unanswered\n",
+					 d->bus, d->address, d->answered_us / 1e6,
+					 (e->time_us - d->answered_us) / 1e6, d->unanswered );
+			d->answered_us = e->time_us + e->latency_us;
+			d->unanswered = 0;
+
+			if( e->result == TRACE_OK ) {
+				d->total_us += e->latency_us;
+				d->max_us = MAX( d->max_us, e->latency_us );
+			}
+		} else {
+			d->no_reply++;
+			d->command_fails[e->command]++;
+			d->unanswered++;
+		}
+	}
+
+	for( i=0; i<devices->len; i++ ) {
+		trace_device_t *d = &g_array_index( devices, trace_device_t, i );
+		uint32_t answered = d->count - d->no_reply;
+
+		fprintf( f, "Device: bus %hhu address %hhu, %.3f s to %.3f s, %u transactions, "
+			 "%u unanswered, %" G_GUINT64_FORMAT " bytes out, %" G_GUINT64_FORMAT " in, "
+			 "latency %.0f us mean, %u us max\n",
+			 d->bus, d->address, d->first_us / 1e6, d->last_us / 1e6, d->count,
+			 d->no_reply, d->bytes_out, d->bytes_in,
+			 answered ? (double)d->total_us / answered : 0.0, d->max_us );
+
+		for( j=0; j<256; j++ )
+			if( d->commands[j] > 0 )
+				fprintf( f, "  command %3u: %8u transactions, %6u unanswered\n",
+					 j, d->commands[j], d->command_fails[j] );
+
+		if( d->last_us >= d->answered_us + TRACE_STALL_US )
+			fprintf( f, "  never answered again after %.3f s, %u unanswered\n",
+				 d->answered_us / 1e6, d->unanswered );
+	}
+
+	fprintf( f, "%-17s %12s %10s %10s\n", "Time (s)", "Transactions", "Unanswered", "Bytes" );
+	for( i=0; i<TRACE_SLICES; i++ )
+		fprintf( f, "%7.3f - %7.3f %12u %10u %10" G_GUINT64_FORMAT "\n",
+			 i * slice_us / 1e6, MIN( (i + 1) * slice_us, end_us ) / 1e6,
+			 slices[i], slice_fails[i], slice_bytes[i] );
+
+	g_array_free( devices, TRUE );
+}
@@ -0,0 +1,80 @@
+/*  This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA. */
+
+/* A record of every transaction on the bus, written as it happens so
+   that a slow or stalled run can be looked at afterwards, or replayed
+   against the simulated bus with the same timing. */
+#ifndef __TRACE
+#define __TRACE
+#include <stdint.h>
+#include <stdio.h>
+#include <glib.h>
+
+#include "transport.h"
+
+/* What became of a transaction */
+enum {
+	/* The device answered */
+	TRACE_OK = 0,
+	/* Nothing came back */
+	TRACE_NO_REPLY,
+	/* It was sent with tx, so wasn't meant to get a reply */
+	TRACE_SENT,
+	/* It couldn't be sent at all */
+	TRACE_NOT_SENT
+};
+
+typedef struct {
+	/* When it started, in microseconds since the trace was opened,
+	   and how long it took */
+	uint64_t time_us;
+	uint32_t latency_us;
+	/* Position of its bus on the command line, and the address it
+	   was sent to */
+	uint8_t bus;
+	uint8_t address;
+	/* The first byte of the payload, which is the board's number for
+	   the command, and the lengths of the payloads both ways */
+	uint8_t command;
+	uint8_t length;
+	uint8_t reply_length;
+	/* One of the TRACE_* results */
+	uint8_t result;
+} trace_entry_t;
+
+/* Start a trace in the given file, replacing anything in it.
+   Returns FALSE, having printed why, if it couldn't be created. */
+gboolean trace_open( const char *fname );
+
+/* Finish the trace.  The transports wrapped by trace_transport must be
+   closed first. */
+void trace_close( void );
+
+/* Wrap a transport so that every transaction through it is added to
+   the trace.  bus is recorded with each one.  Closing the returned
+   transport closes the one it wraps.  Transactions may be recorded
+   from several threads at once. */
+transport_t* trace_transport( transport_t *inner, uint8_t bus );
+
+/* Read a trace file.
+   Returns an array of trace_entry_t in the order they were recorded, or
+   NULL, having printed why, if it couldn't be read. */
+GArray* trace_load( const char *fname );
+
+/* Print a summary of the trace: what each device was sent and how
+   quickly it answered, when it stopped answering, and how the
+   transactions were spread over the run. */
+void trace_summary( FILE *f, GArray *entries );
+
+#endif	/* __TRACE */
@@ -0,0 +1,277 @@
+/*  This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA. */
+#include "transport.h"
+#include "crc16.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+
+/* A frame is written to the board's I2C address as its payload length,
+   the payload, and a CRC-8 of both.  The reply is read back after a
+   repeated start in the same form, so each transaction is a single
+   I2C_RDWR ioctl with no trip through sricd.  Replies can be no longer
+   than an SMBus block (32 bytes), which all the bootloader's are. */
+
+typedef struct {
+	transport_t t;
+	int fd;
+
+	/* The boards given when it was opened */
+	sric_device *devices;
+	guint n_devices;
+
+	/* Timeout last given to the adapter, in ms */
+	int timeout;
+} i2c_transport_t;
+
+static int i2c_transport_txrx( transport_t *t,
+			       const sric_frame *msg,
+			       sric_frame *rtn,
+			       int timeout );
+
+static int i2c_transport_tx( transport_t *t, const sric_frame *msg );
+
+static const sric_device* i2c_transport_enumerate( transport_t *t,
+						   const sric_device *prev );
+
+static void i2c_transport_close( transport_t *t );
+
+/* Put the frame in buf as it's written to the bus.
+   Returns the number of bytes, or 0 if it's too long. */
+static uint8_t i2c_frame( const sric_frame *msg, uint8_t *buf );
+
+/* Read the list of boards from a spec of the form ADDR=TYPE,...
+   Returns FALSE if it's not in that form. */
+static gboolean i2c_parse_devices( i2c_transport_t *i2c, const char *list );
+
+transport_t* transport_i2c_open( const char *spec )
+{
+	i2c_transport_t *i2c;
+	gchar **parts;
+	unsigned long funcs;
+
+	parts = g_strsplit( spec, ":", 2 );
+	if( parts[0] == NULL || parts[1] == NULL ) {
+		g_print( "The i2c transport needs a device and a list of boards: i2c:DEV:ADDR=TYPE,...\n" );
+		g_strfreev( parts );
+		return NULL;
+	}
+
+	i2c = g_malloc0( sizeof(i2c_transport_t) );
+	i2c->t.txrx = i2c_transport_txrx;
+	i2c->t.tx = i2c_transport_tx;
+	i2c->t.enumerate = i2c_transport_enumerate;
+	i2c->t.close = i2c_transport_close;
+	i2c->timeout = -1;
+
+	if( !i2c_parse_devices( i2c, parts[1] ) ) {
+		g_print( "Failed to read the list of boards '%s': should be ADDR=TYPE,...\n",
+			 parts[1] );
+		goto fail;
+	}
+
+	i2c->fd = open( parts[0], O_RDWR );
+	if( i2c->fd < 0 ) {
+		g_print( "Failed to open '%s': %s\n", parts[0], strerror(errno) );
+		goto fail;
+	}
+
+	if( ioctl( i2c->fd, I2C_FUNCS, &funcs ) < 0 ) {
+		g_print( "Failed to read what '%s' can do: %s\n", parts[0], strerror(errno) );
+		close( i2c->fd );
+		goto fail;
+	}
+
+	if( !(funcs & I2C_FUNC_I2C) ) {
+		g_print( "'%s' can't do combined I2C transactions (I2C_FUNC_I2C)\n", parts[0] );
+		close( i2c->fd );
+		goto fail;
+	}
+
+	/* Replies are read with I2C_M_RECV_LEN, which adapters advertise
+	   on its own */
+	if( !(funcs & I2C_FUNC_SMBUS_READ_BLOCK_DATA) ) {
+		g_print( "'%s' can't read replies whose length comes first "
+			 "(I2C_FUNC_SMBUS_READ_BLOCK_DATA)\n", parts[0] );
+		close( i2c->fd );
+		goto fail;
+	}
+
+	/* Failed transactions are retried by msp430-fw.  An adapter that
+	   won't take this only retries on arbitration loss, so the
+	   result doesn't matter. */
+	ioctl( i2c->fd, I2C_RETRIES, 0 );
+
+	g_strfreev( parts );
+	return &i2c->t;
+
+fail:
+	g_free( i2c->devices );
+	g_free( i2c );
+	g_strfreev( parts );
+	return NULL;
+}
+
+static int i2c_transport_txrx( transport_t *t,
+			       const sric_frame *msg,
+			       sric_frame *rtn,
+			       int timeout )
+{
+	i2c_transport_t *i2c = (i2c_transport_t*)t;
+	uint8_t wbuf[2 + sizeof(msg->payload)];
+	uint8_t rbuf[2 + I2C_SMBUS_BLOCK_MAX];
+	struct i2c_msg msgs[2];
+	struct i2c_rdwr_ioctl_data rdwr;
+	uint8_t len;
+
+	len = i2c_frame( msg, wbuf );
+	if( len == 0 )
+		return -1;
+
+	/* The adapter's timeout is in units of 10 ms.  One that won't
+	   take it keeps its own, and it's not asked again until the
+	   timeout changes. */
+	if( timeout != i2c->timeout ) {
+		ioctl( i2c->fd, I2C_TIMEOUT, (timeout + 9) / 10 );
+		i2c->timeout = timeout;
+	}
+
+	msgs[0].addr = msg->address;
+	msgs[0].flags = 0;
+	msgs[0].len = len;
+	msgs[0].buf = wbuf;
+
+	/* The first byte read says how many follow.  The adapter is told
+	   to read one more, for the CRC. */
+	rbuf[0] = 2;
+	msgs[1].addr = msg->address;
+	msgs[1].flags = I2C_M_RD | I2C_M_RECV_LEN;
+	msgs[1].len = sizeof(rbuf);
+	msgs[1].buf = rbuf;
+
+	rdwr.msgs = msgs;
+	rdwr.nmsgs = 2;
+
+	if( ioctl( i2c->fd, I2C_RDWR, &rdwr ) < 0 )
+		return -1;
+
+	len = rbuf[0];
+	if( len > I2C_SMBUS_BLOCK_MAX
+	    || rbuf[len + 1] != crc8( rbuf, len + 1 ) )
+		return -1;
+
+	rtn->address = msg->address;
+	rtn->note = -1;
+	rtn->payload_length = len;
+	memcpy( rtn->payload, rbuf + 1, len );
+
+	return 0;
+}
+
+static int i2c_transport_tx( transport_t *t, const sric_frame *msg )
+{
+	i2c_transport_t *i2c = (i2c_transport_t*)t;
+	uint8_t wbuf[2 + sizeof(msg->payload)];
+	struct i2c_msg m;
+	struct i2c_rdwr_ioctl_data rdwr;
+
+	m.addr = msg->address;
+	m.flags = 0;
+	m.len = i2c_frame( msg, wbuf );
+	m.buf = wbuf;
+	if( m.len == 0 )
+		return -1;
+
+	rdwr.msgs = &m;
+	rdwr.nmsgs = 1;
+
+	return ioctl( i2c->fd, I2C_RDWR, &rdwr ) < 0 ? -1 : 0;
+}
+
+static uint8_t i2c_frame( const sric_frame *msg, uint8_t *buf )
+{
+	uint8_t len;
+
+	if( msg->payload_length < 0
+	    || msg->payload_length > (int)sizeof(msg->payload) )
+		return 0;
+
+	len = msg->payload_length;
+	buf[0] = len;
+	memcpy( buf + 1, msg->payload, len );
+	buf[len + 1] = crc8( buf, len + 1 );
+
+	return len + 2;
+}
+
+static const sric_device* i2c_transport_enumerate( transport_t *t,
+						   const sric_device *prev )
+{
+	i2c_transport_t *i2c = (i2c_transport_t*)t;
+
+	if( prev == NULL )
+		return i2c->n_devices ? i2c->devices : NULL;
+
+	if( prev + 1 < i2c->devices + i2c->n_devices )
+		return prev + 1;
+
+	return NULL;
+}
+
+static void i2c_transport_close( transport_t *t )
+{
+	i2c_transport_t *i2c = (i2c_transport_t*)t;
+
+	close( i2c->fd );
+	g_free( i2c->devices );
+	g_free( i2c );
+}
+
+static gboolean i2c_parse_devices( i2c_transport_t *i2c, const char *list )
+{
+	gchar **boards, **b;
+	gboolean ok = TRUE;
+
+	boards = g_strsplit( list, ",", 0 );
+	i2c->n_devices = g_strv_length( boards );
+	i2c->devices = g_malloc0( sizeof(sric_device) * MAX( i2c->n_devices, 1 ) );
+
+	for( b = boards; *b != NULL && ok; b++ ) {
+		sric_device *dev = i2c->devices + (b - boards);
+		unsigned long addr, type;
+		char *end;
+
+		addr = strtoul( *b, &end, 0 );
+		if( *end != '=' || end == *b ) {
+			ok = FALSE;
+			break;
+		}
+
+		type = strtoul( end + 1, &end, 0 );
+		/* 7 bit addresses, not including the reserved ones */
+		if( *end != '\0' || addr < 0x08 || addr > 0x77 || type > 0xff )
+			ok = FALSE;
+
+		dev->address = addr;
+		dev->type = type;
+	}
+
+	g_strfreev( boards );
+	return ok && i2c->n_devices > 0;
+}
@@ -0,0 +1,86 @@
+/*  This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA. */
+#include "transport.h"
+
+/* Frames go through sricd, which handles the bus */
+typedef struct {
+	transport_t t;
+	sric_context ctx;
+} sric_transport_t;
+
+static int sric_transport_txrx( transport_t *t,
+				const sric_frame *msg,
+				sric_frame *rtn,
+				int timeout );
+
+static int sric_transport_tx( transport_t *t, const sric_frame *msg );
+
+static const sric_device* sric_transport_enumerate( transport_t *t,
+						    const sric_device *prev );
+
+static void sric_transport_close( transport_t *t );
+
+transport_t* transport_sric_open( void )
+{
+	sric_transport_t *s;
+	sric_context ctx;
+
+	ctx = sric_init();
+	if (sric_get_error(ctx) & SRIC_ERROR_SRICD) {
+		g_print("Failed to connect to sricd.\n");
+		return NULL;
+	}
+
+	s = g_malloc0( sizeof(sric_transport_t) );
+	s->t.txrx = sric_transport_txrx;
+	s->t.tx = sric_transport_tx;
+	s->t.enumerate = sric_transport_enumerate;
+	s->t.close = sric_transport_close;
+	s->ctx = ctx;
+
+	return &s->t;
+}
+
+static int sric_transport_txrx( transport_t *t,
+				const sric_frame *msg,
+				sric_frame *rtn,
+				int timeout )
+{
+	sric_transport_t *s = (sric_transport_t*)t;
+
+	return sric_txrx( s->ctx, msg, rtn, timeout );
+}
+
+static int sric_transport_tx( transport_t *t, const sric_frame *msg )
+{
+	sric_transport_t *s = (sric_transport_t*)t;
+
+	return sric_tx( s->ctx, msg );
+}
+
+static const sric_device* sric_transport_enumerate( transport_t *t,
+						    const sric_device *prev )
+{
+	sric_transport_t *s = (sric_transport_t*)t;
+
+	return sric_enumerate_devices( s->ctx, prev );
+}
+
+static void sric_transport_close( transport_t *t )
+{
+	sric_transport_t *s = (sric_transport_t*)t;
+
+	sric_quit( s->ctx );
+	g_free( s );
+}
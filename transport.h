@@ -0,0 +1,59 @@
+/*  This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA. */
+
+/* The link that frames are sent to devices over.  Each backend fills in
+   a transport_t, which is the first member of its own state. */
+#ifndef __TRANSPORT
+#define __TRANSPORT
+#include <glib.h>
+#include <sric.h>
+
+typedef struct transport transport_t;
+
+struct transport {
+	/* Send a frame and wait up to timeout ms for the reply.
+	   Returns 0 on success, as sric_txrx does. */
+	int (*txrx)( transport_t *t,
+		     const sric_frame *msg,
+		     sric_frame *rtn,
+		     int timeout );
+
+	/* Send a frame that gets no reply, such as one to a group
+	   address.  Returns 0 on success. */
+	int (*tx)( transport_t *t, const sric_frame *msg );
+
+	/* Returns the device after prev on the bus, the first device if
+	   prev is NULL, or NULL after the last one. */
+	const sric_device* (*enumerate)( transport_t *t,
+					 const sric_device *prev );
+
+	/* Disconnect and free the transport */
+	void (*close)( transport_t *t );
+};
+
+/* Open the transport described by spec, which is one of:
+    sricd                  Through sricd, using libsric.  Used if spec
+                           is NULL.
+    i2c:DEV:ADDR=TYPE,...  Straight to the boards on the Linux i2c-dev
+                           device DEV (such as /dev/i2c-1), without
+                           sricd.  Each board is given by its address
+                           and board type.
+   Returns NULL, having printed why, if it can't be opened. */
+transport_t* transport_open( const char *spec );
+
+/* The backends, as used by transport_open */
+transport_t* transport_sric_open( void );
+transport_t* transport_i2c_open( const char *spec );
+
+#endif	/* __TRANSPORT */